@@ -98,6 +98,7 @@ workspace "librw"
 		system "windows"
 	filter { "platforms:linux*" }
 		system "linux"
+		links { "pthread" }
 
 	filter { "platforms:win*gl3" }
 		includedirs { path.join(_OPTIONS["sdl2dir"], "include") }
@@ -285,6 +286,18 @@ project "ska2anm"
 	findlibs()
 	removeplatforms { "*gl3", "*d3d9", "*ps2" }
 
+project "rwconvert"
+	kind "ConsoleApp"
+	characterset ("MBCS")
+	targetdir (Bindir)
+	files { path.join("tools/rwconvert", "*.cpp"),
+	        path.join("tools/rwconvert", "*.h") }
+	includedirs { "." }
+	libdirs { Libdir }
+	links { "librw" }
+	findlibs()
+	removeplatforms { "*gl3", "*d3d9", "*ps2" }
+
 --project "ps2test"
 --	kind "ConsoleApp"
 --	targetdir (Bindir)
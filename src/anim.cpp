@@ -81,15 +81,59 @@ Animation::create(AnimInterpolatorInfo *interpInfo, int32 numFrames,
 	anim->keyframes = data;
 	data += anim->numFrames*interpInfo->animKeyFrameSize;
 	anim->customData = data;
+	anim->keyFrameNodes = nil;
+	anim->nodeKeyFrames = nil;
+	anim->nodeKeyStart = nil;
 	return anim;
 }
 
 void
 Animation::destroy(void)
 {
+	rwFree(this->keyFrameNodes);
 	rwFree(this);
 }
 
+// Find the node of every keyframe by following the prev links
+// and list the keyframes of every node.
+// The first numNodes*2 frames are the start frames of all nodes.
+// Call this after changing the keyframes.
+void
+Animation::updateKeyFrameNodes(int32 numNodes)
+{
+	int32 i, n, sz;
+	int32 *start;
+	KeyFrameHeader *first;
+
+	// all three arrays in one block
+	rwFree(this->keyFrameNodes);
+	this->keyFrameNodes = rwNewT(int32, this->numFrames*2 + numNodes+1, MEMDUR_EVENT | ID_ANIMANIMATION);
+	this->nodeKeyFrames = this->keyFrameNodes + this->numFrames;
+	this->nodeKeyStart = this->nodeKeyFrames + this->numFrames;
+	sz = this->interpInfo->animKeyFrameSize;
+	first = (KeyFrameHeader*)this->keyframes;
+	for(i = 0; i < this->numFrames; i++){
+		if(i < numNodes)
+			this->keyFrameNodes[i] = i;
+		else
+			this->keyFrameNodes[i] = this->keyFrameNodes[((uint8*)this->getAnimFrame(i)->prev - (uint8*)first)/sz];
+	}
+
+	// counting sort, keeps the keyframes of a node in order
+	start = this->nodeKeyStart;
+	memset(start, 0, (numNodes+1)*sizeof(int32));
+	for(i = 0; i < this->numFrames; i++)
+		start[this->keyFrameNodes[i]+1]++;
+	for(n = 0; n < numNodes; n++)
+		start[n+1] += start[n];
+	for(i = 0; i < this->numFrames; i++)
+		this->nodeKeyFrames[start[this->keyFrameNodes[i]]++] = i;
+	// every start is now at the next node's, shift back
+	for(n = numNodes; n > 0; n--)
+		start[n] = start[n-1];
+	start[0] = 0;
+}
+
 int32
 Animation::getNumNodes(void)
 {
@@ -236,6 +280,8 @@ AnimInterpolator::setCurrentAnim(Animation *anim)
 	this->blendCB = interpInfo->blendCB;
 	this->interpCB = interpInfo->interpCB;
 	this->addCB = interpInfo->addCB;
+	if(anim->keyFrameNodes == nil)
+		anim->updateKeyFrameNodes(this->numNodes);
 	for(i = 0; i < numNodes; i++){
 		InterpFrameHeader *intf;
 		KeyFrameHeader *kf1, *kf2;
@@ -267,13 +313,12 @@ AnimInterpolator::addTime(float32 t)
 	KeyFrameHeader *last = this->getAnimFrame(this->currentAnim->numFrames);
 	KeyFrameHeader *next = (KeyFrameHeader*)this->nextFrame;
 	InterpFrameHeader *ifrm = nil;
+	int32 *nodes = this->currentAnim->keyFrameNodes;
 	while(next < last && next->prev->time <= this->currentTime){
 		// find next interpolation frame to expire
-		for(i = 0; i < this->numNodes; i++){
-			ifrm = this->getInterpFrame(i);
-			if(ifrm->keyFrame2 == next->prev)
-				break;
-		}
+		i = ((uint8*)next - (uint8*)this->currentAnim->keyframes)/currentAnimKeyFrameSize;
+		ifrm = this->getInterpFrame(nodes[i]);
+		assert(ifrm->keyFrame2 == next->prev);
 		// advance interpolation frame
 		ifrm->keyFrame1 = ifrm->keyFrame2;
 		ifrm->keyFrame2 = next;
@@ -290,4 +335,62 @@ AnimInterpolator::addTime(float32 t)
 	}
 }
 
+// Jump to time t. Keyframes are sorted by the time of their prev frame,
+// so the next frame can be found with a binary search. The current
+// frame of every node is its last keyframe before that, found with
+// another binary search in the node's keyframes.
+void
+AnimInterpolator::setCurrentTime(float32 t)
+{
+	int32 i, n, lo, hi, mid;
+	int32 *keys;
+	Animation *anim = this->currentAnim;
+	InterpFrameHeader *ifrm;
+	KeyFrameHeader *kf;
+
+	if(anim == nil)
+		return;
+	if(t < 0.0f)
+		t = 0.0f;
+	if(t > anim->duration)
+		t = anim->duration;
+
+	// first frame that hasn't started yet
+	lo = this->numNodes*2;
+	hi = anim->numFrames;
+	while(lo < hi){
+		mid = (lo + hi)/2;
+		if(this->getAnimFrame(mid)->prev->time <= t)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	this->nextFrame = this->getAnimFrame(lo);
+
+	for(n = 0; n < this->numNodes; n++){
+		// the node's second keyframe is always before lo
+		keys = &anim->nodeKeyFrames[anim->nodeKeyStart[n]];
+		i = 2;
+		hi = anim->nodeKeyStart[n+1] - anim->nodeKeyStart[n];
+		while(i < hi){
+			mid = (i + hi)/2;
+			if(keys[mid] < lo)
+				i = mid+1;
+			else
+				hi = mid;
+		}
+		kf = this->getAnimFrame(keys[i-1]);
+		ifrm = this->getInterpFrame(n);
+		ifrm->keyFrame1 = kf->prev;
+		ifrm->keyFrame2 = kf;
+	}
+
+	this->currentTime = t;
+	for(i = 0; i < this->numNodes; i++){
+		ifrm = this->getInterpFrame(i);
+		this->interpCB(ifrm, ifrm->keyFrame1, ifrm->keyFrame2,
+		               this->currentTime, anim->customData);
+	}
+}
+
 }
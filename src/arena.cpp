@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#define PLUGIN_ID 0
+
+// Allocator that honours the MemHint duration:
+//  MEMDUR_FUNCTION - linear scratch arena, rewound when everything in it is freed
+//  MEMDUR_FRAME    - linear arena, freed all at once by resetFrameArena()
+//  everything else - size class pools, big blocks go to malloc
+// Every block has a 16 byte header so free knows where it came from,
+// blocks in the linear arenas have another 16 bytes in front of that.
+
+namespace rw {
+
+enum {
+	BLOCK_HEAP = 0,
+	BLOCK_POOL,
+	BLOCK_FUNCTION,
+	BLOCK_FRAME
+};
+
+struct ArenaBlock
+{
+	size_t size;
+	uint32 hint;
+	uint8 type;
+	uint8 sizeClass;
+};
+#define HEADERSIZE 16
+static_assert(sizeof(ArenaBlock) <= HEADERSIZE, "arena block header too big");
+#define HEADER(p) ((ArenaBlock*)((uint8*)(p) - HEADERSIZE))
+
+struct LinearBlock
+{
+	size_t prev;	// offset of the block below
+	uint32 generation;
+	bool32 freed;
+};
+#define LINEARHEADERSIZE 16
+static_assert(sizeof(LinearBlock) <= LINEARHEADERSIZE, "linear block header too big");
+#define LINEARHEADER(b) ((LinearBlock*)((uint8*)(b) - LINEARHEADERSIZE))
+
+struct LinearArena
+{
+	uint8 *mem;
+	size_t size;
+	size_t top;
+	size_t lastBlock;	// offset of the topmost block
+	int32 numLive;
+	uint32 generation;	// incremented by resetFrameArena
+};
+
+#define NUMSIZECLASSES 8	// 16 to 2048 bytes
+#define MINCLASSSIZE 16
+#define SLABSIZE (64*1024)
+
+struct Slab
+{
+	Slab *next;
+};
+
+struct ArenaPool
+{
+	uint8 *freeList[NUMSIZECLASSES];
+	Slab *slabs;
+	uint8 *slabTop;
+	uint8 *slabEnd;
+};
+
+#define NUMIDSTATS 256
+
+static LinearArena functionArena;
+static LinearArena frameArena;
+static ArenaPool pool;
+static size_t functionArenaSize = 1024*1024;
+static size_t frameArenaSize = 1024*1024;
+static MemoryStats durationStats[5];
+static MemoryStats idStats[NUMIDSTATS];
+
+//
+// Statistics
+//
+
+static MemoryStats*
+findIdStats(uint32 id, bool32 create)
+{
+	uint32 i, n;
+	i = (id * 0x9E3779B1u) >> 24;
+	for(n = 0; n < NUMIDSTATS; n++, i = (i+1) % NUMIDSTATS){
+		if(idStats[i].numAllocs && idStats[i].id == id)
+			return &idStats[i];
+		if(idStats[i].numAllocs == 0){
+			if(!create)
+				return nil;
+			idStats[i].id = id;
+			return &idStats[i];
+		}
+	}
+	return nil;
+}
+
+static void
+countAlloc(MemoryStats *s, size_t sz)
+{
+	s->numAllocs++;
+	s->numBlocks++;
+	s->bytes += sz;
+	if(s->bytes > s->peakBytes)
+		s->peakBytes = s->bytes;
+}
+
+static void
+countFree(MemoryStats *s, size_t sz)
+{
+	s->numBlocks--;
+	s->bytes -= sz;
+}
+
+static void
+statAlloc(uint32 hint, size_t sz)
+{
+	MemoryStats *s;
+	countAlloc(&durationStats[(hint>>16) % 5], sz);
+	s = findIdStats(hint & 0xFFFF, 1);
+	if(s)
+		countAlloc(s, sz);
+}
+
+static void
+statFree(uint32 hint, size_t sz)
+{
+	MemoryStats *s;
+	countFree(&durationStats[(hint>>16) % 5], sz);
+	s = findIdStats(hint & 0xFFFF, 0);
+	if(s)
+		countFree(s, sz);
+}
+
+//
+// Linear arenas
+//
+
+// returns the ArenaBlock header
+static uint8*
+linearAlloc(LinearArena *a, size_t arenaSize, size_t sz)
+{
+	LinearBlock *lb;
+	size_t need = LINEARHEADERSIZE + HEADERSIZE + ((sz + 15) & ~(size_t)15);
+	if(a->mem == nil){
+		a->mem = (uint8*)malloc(arenaSize);
+		if(a->mem == nil)
+			return nil;
+		a->size = arenaSize;
+		a->top = 0;
+		a->numLive = 0;
+	}
+	if(need > a->size - a->top)
+		return nil;
+	lb = (LinearBlock*)(a->mem + a->top);
+	lb->prev = a->top ? a->lastBlock : 0;
+	lb->generation = a->generation;
+	lb->freed = 0;
+	a->lastBlock = a->top;
+	a->top += need;
+	a->numLive++;
+	return a->mem + a->lastBlock + LINEARHEADERSIZE;
+}
+
+// Blocks from before the last reset are gone already.
+static bool32
+linearIsLive(LinearArena *a, uint8 *block)
+{
+	return LINEARHEADER(block)->generation == a->generation;
+}
+
+// Rewind over the topmost blocks that are freed.
+static void
+linearFree(LinearArena *a, uint8 *block)
+{
+	LinearBlock *lb;
+
+	if(!linearIsLive(a, block))
+		return;
+	LINEARHEADER(block)->freed = 1;
+	a->numLive--;
+	while(a->top > 0){
+		lb = (LinearBlock*)(a->mem + a->lastBlock);
+		if(!lb->freed)
+			break;
+		a->top = a->lastBlock;
+		a->lastBlock = lb->prev;
+	}
+}
+
+// grow the topmost block in place
+static bool32
+linearGrow(LinearArena *a, uint8 *block, size_t sz)
+{
+	size_t need = LINEARHEADERSIZE + HEADERSIZE + ((sz + 15) & ~(size_t)15);
+	if(block != a->mem + a->lastBlock + LINEARHEADERSIZE || need > a->size - a->lastBlock)
+		return 0;
+	a->top = a->lastBlock + need;
+	return 1;
+}
+
+//
+// Size class pools
+//
+
+static int32
+getSizeClass(size_t sz)
+{
+	int32 c = 0;
+	size_t classSize = MINCLASSSIZE;
+	while(classSize < sz){
+		classSize *= 2;
+		if(++c >= NUMSIZECLASSES)
+			return -1;
+	}
+	return c;
+}
+
+static uint8*
+poolAlloc(int32 c)
+{
+	uint8 *block;
+	size_t blockSize = HEADERSIZE + (MINCLASSSIZE << c);
+
+	if(block = pool.freeList[c], block){
+		pool.freeList[c] = *(uint8**)(block + HEADERSIZE);
+		return block;
+	}
+	if(pool.slabTop == nil || blockSize > (size_t)(pool.slabEnd - pool.slabTop)){
+		Slab *slab = (Slab*)malloc(SLABSIZE);
+		if(slab == nil)
+			return nil;
+		slab->next = pool.slabs;
+		pool.slabs = slab;
+		pool.slabTop = (uint8*)slab + HEADERSIZE;
+		pool.slabEnd = (uint8*)slab + SLABSIZE;
+	}
+	block = pool.slabTop;
+	pool.slabTop += blockSize;
+	return block;
+}
+
+static void
+poolFree(uint8 *block, int32 c)
+{
+	*(uint8**)(block + HEADERSIZE) = pool.freeList[c];
+	pool.freeList[c] = block;
+}
+
+//
+// MemoryFunctions
+//
+
+static void*
+malloc_arena(size_t sz, uint32 hint)
+{
+	uint8 *block;
+	ArenaBlock *b;
+	int32 c;
+	uint8 type;
+
+	if(sz == 0) return nil;
+	block = nil;
+	c = 0;
+	lockEngine();
+	switch(hint & 0xFFFF0000){
+	case MEMDUR_FUNCTION:
+		type = BLOCK_FUNCTION;
+		block = linearAlloc(&functionArena, functionArenaSize, sz);
+		break;
+	case MEMDUR_FRAME:
+		type = BLOCK_FRAME;
+		block = linearAlloc(&frameArena, frameArenaSize, sz);
+		break;
+	default:
+		type = BLOCK_POOL;
+		c = getSizeClass(sz);
+		if(c >= 0)
+			block = poolAlloc(c);
+		break;
+	}
+	if(block == nil){
+		type = BLOCK_HEAP;
+		block = (uint8*)malloc(HEADERSIZE + sz);
+		if(block == nil){
+			unlockEngine();
+			return nil;
+		}
+	}
+	b = (ArenaBlock*)block;
+	b->size = sz;
+	b->hint = hint;
+	b->type = type;
+	b->sizeClass = c;
+	statAlloc(hint, sz);
+	unlockEngine();
+	return block + HEADERSIZE;
+}
+
+static void
+freeBlock(ArenaBlock *b)
+{
+	statFree(b->hint, b->size);
+	switch(b->type){
+	case BLOCK_FUNCTION:
+		linearFree(&functionArena, (uint8*)b);
+		break;
+	case BLOCK_FRAME:
+		// stays until resetFrameArena
+		if(linearIsLive(&frameArena, (uint8*)b))
+			frameArena.numLive--;
+		break;
+	case BLOCK_POOL:
+		poolFree((uint8*)b, b->sizeClass);
+		break;
+	default:
+		free(b);
+		break;
+	}
+}
+
+static void
+free_arena(void *p)
+{
+	if(p == nil)
+		return;
+	lockEngine();
+	freeBlock(HEADER(p));
+	unlockEngine();
+}
+
+static bool32
+isPoolHint(uint32 hint)
+{
+	uint32 dur = hint & 0xFFFF0000;
+	return dur != MEMDUR_FUNCTION && dur != MEMDUR_FRAME;
+}
+
+static void*
+realloc_arena(void *p, size_t sz, uint32 hint)
+{
+	ArenaBlock *b;
+	void *newp;
+	bool32 inPlace;
+
+	if(p == nil)
+		return malloc_arena(sz, hint);
+	b = HEADER(p);
+
+	lockEngine();
+	inPlace = 0;
+	if(b->type == BLOCK_POOL && isPoolHint(hint))
+		inPlace = sz <= (size_t)MINCLASSSIZE << b->sizeClass;
+	else if(b->type == BLOCK_FUNCTION && (hint & 0xFFFF0000) == MEMDUR_FUNCTION)
+		inPlace = linearGrow(&functionArena, (uint8*)b, sz);
+	else if(b->type == BLOCK_HEAP && isPoolHint(hint) && getSizeClass(sz) < 0){
+		ArenaBlock *nb = (ArenaBlock*)realloc(b, HEADERSIZE + sz);
+		if(nb == nil){
+			unlockEngine();
+			return nil;
+		}
+		b = nb;
+		inPlace = 1;
+	}
+	if(inPlace){
+		statFree(b->hint, b->size);
+		b->size = sz;
+		b->hint = hint;
+		statAlloc(hint, sz);
+		unlockEngine();
+		return (uint8*)b + HEADERSIZE;
+	}
+	unlockEngine();
+
+	newp = malloc_arena(sz, hint);
+	if(newp == nil)
+		return nil;
+	memcpy(newp, p, b->size < sz ? b->size : sz);
+	free_arena(p);
+	return newp;
+}
+
+MemoryFunctions arenaMemfuncs = {
+	malloc_arena,
+	realloc_arena,
+	free_arena,
+	nil,
+	nil
+};
+
+void
+setArenaSizes(size_t functionSize, size_t frameSize)
+{
+	assert(functionArena.mem == nil && frameArena.mem == nil);
+	functionArenaSize = functionSize;
+	frameArenaSize = frameSize;
+}
+
+void
+resetFrameArena(void)
+{
+	lockEngine();
+	frameArena.top = frameArena.lastBlock = 0;
+	frameArena.numLive = 0;
+	frameArena.generation++;
+	unlockEngine();
+}
+
+void
+releaseArenas(void)
+{
+	Slab *slab, *next;
+	lockEngine();
+	free(functionArena.mem);
+	free(frameArena.mem);
+	memset(&functionArena, 0, sizeof(functionArena));
+	memset(&frameArena, 0, sizeof(frameArena));
+	for(slab = pool.slabs; slab; slab = next){
+		next = slab->next;
+		free(slab);
+	}
+	memset(&pool, 0, sizeof(pool));
+	unlockEngine();
+}
+
+const MemoryStats*
+getMemDurationStats(uint32 memdur)
+{
+	return &durationStats[(memdur>>16) % 5];
+}
+
+const MemoryStats*
+getMemIdStats(uint32 id)
+{
+	return findIdStats(id & 0xFFFF, 0);
+}
+
+void
+printMemStats(void)
+{
+	static const char *durNames[5] = { "NA", "FUNCTION", "FRAME", "EVENT", "GLOBAL" };
+	int32 i;
+	MemoryStats *s;
+	for(i = 0; i < 5; i++){
+		s = &durationStats[i];
+		printf("%-8s %8d blocks %10zu bytes %10zu peak %10u allocs\n", durNames[i],
+			s->numBlocks, s->bytes, s->peakBytes, s->numAllocs);
+	}
+	for(i = 0; i < NUMIDSTATS; i++){
+		s = &idStats[i];
+		if(s->numAllocs)
+			printf("ID %04X  %8d blocks %10zu bytes %10zu peak %10u allocs\n", s->id,
+				s->numBlocks, s->bytes, s->peakBytes, s->numAllocs);
+	}
+}
+
+}
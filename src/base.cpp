@@ -9,7 +9,17 @@
 #define PSEP_S "/"
 #ifdef __unix__
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mutex>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
 #endif
 
 #include "rwbase.h"
@@ -18,6 +28,7 @@
 #include "rwpipeline.h"
 #include "rwobjects.h"
 #include "rwengine.h"
+#include "rwsimdimpl.h"
 
 namespace rw {
 
@@ -180,6 +191,116 @@ slerp(const Quat &q, const Quat &p, float32 a)
 // V3d
 //
 
+//
+// SIMD versions of the hot matrix functions.
+// Operations are done in the same order as the scalar code.
+// Matrix rows are loaded as 4 floats; w holds flags/padding, so it's
+// masked off on load and left untouched on store.
+//
+
+#ifdef RW_SIMD
+
+static bool32 simdMath = 1;
+
+static void
+transformSIMD(V3d *out, const V3d *in, int32 n, const Matrix *m, bool32 points)
+{
+	vec4 zero = vzero();
+	vec4 r = vselxyz(vload(&m->right.x), zero);
+	vec4 u = vselxyz(vload(&m->up.x), zero);
+	vec4 a = vselxyz(vload(&m->at.x), zero);
+	vec4 p = vselxyz(vload(&m->pos.x), zero);
+	vec4 res[4];
+	V3d tmp[4];
+	int32 i, j, num;
+	// four at a time so all loads are done before the stores
+	for(i = 0; i < n; i += 4){
+		num = n-i < 4 ? n-i : 4;
+		const V3d *src = in+i;
+		V3d *dst = out+i;
+		if(num < 4){
+			memcpy(tmp, src, num*sizeof(V3d));
+			src = dst = tmp;
+		}
+		for(j = 0; j < 4; j++){
+			const float32 *v = &src[j].x;
+			res[j] = vadd(vadd(vmul(vdup(v), r), vmul(vdup(v+1), u)), vmul(vdup(v+2), a));
+			if(points)
+				res[j] = vadd(res[j], p);
+		}
+		vstore3x4(&dst->x, res[0], res[1], res[2], res[3]);
+		if(num < 4)
+			memcpy(out+i, tmp, num*sizeof(V3d));
+	}
+}
+
+static void
+multSIMD(Matrix *dst, const Matrix *src1, const Matrix *src2)
+{
+	vec4 zero = vzero();
+	vec4 b0 = vselxyz(vload(&src2->right.x), zero);
+	vec4 b1 = vselxyz(vload(&src2->up.x), zero);
+	vec4 b2 = vselxyz(vload(&src2->at.x), zero);
+	vec4 b3 = vselxyz(vload(&src2->pos.x), zero);
+	const float32 *a = &src1->right.x;
+	vec4 r[4];
+	int32 i;
+	for(i = 0; i < 4; i++, a += 4)
+		r[i] = vadd(vadd(vmul(vdup(a), b0), vmul(vdup(a+1), b1)), vmul(vdup(a+2), b2));
+	r[3] = vadd(r[3], b3);
+	float32 *d = &dst->right.x;
+	for(i = 0; i < 4; i++, d += 4)
+		vstore(d, vselxyz(r[i], vload(d)));
+}
+
+static void
+invertGeneralSIMD(Matrix *dst, const Matrix *src)
+{
+	vec4 zero = vzero();
+	vec4 r = vselxyz(vload(&src->right.x), zero);
+	vec4 u = vselxyz(vload(&src->up.x), zero);
+	vec4 a = vselxyz(vload(&src->at.x), zero);
+	// cofactors, transposed below
+	vec4 c0 = vcross(u, a);
+	vec4 c1 = vcross(a, r);
+	vec4 c2 = vcross(r, u);
+	vec4 c3 = zero;
+	float32 det, invdet;
+	det = src->up.x * vgetx(c1) + src->at.x * vgetx(c2) + vgetx(c0) * src->right.x;
+	invdet = 1.0;
+	if(det != 0.0f)
+		invdet = 1.0f/det;
+	vec4 vinvdet = vdup(&invdet);
+	vtranspose(c0, c1, c2, c3);
+	c0 = vmul(c0, vinvdet);
+	c1 = vmul(c1, vinvdet);
+	c2 = vmul(c2, vinvdet);
+	c3 = vsub(zero, vadd(vadd(vmul(vdup(&src->pos.x), c0), vmul(vdup(&src->pos.y), c1)), vmul(vdup(&src->pos.z), c2)));
+	vstore(&dst->right.x, vselxyz(c0, vload(&dst->right.x)));
+	vstore(&dst->up.x, vselxyz(c1, vload(&dst->up.x)));
+	vstore(&dst->at.x, vselxyz(c2, vload(&dst->at.x)));
+	vstore(&dst->pos.x, vselxyz(c3, vload(&dst->pos.x)));
+}
+#endif
+
+void
+setSimdMath(bool32 b)
+{
+#ifdef RW_SIMD
+	simdMath = b;
+#endif
+}
+
+bool32
+getSimdMath(void)
+{
+#ifdef RW_SIMD
+	return simdMath;
+#else
+	return 0;
+#endif
+}
+
 V3d
 cross(const V3d &a, const V3d &b)
 {
@@ -193,6 +314,12 @@ V3d::transformPoints(V3d *out, const V3d *in, int32 n, const Matrix *m)
 {
 	int32 i;
 	V3d tmp;
+#ifdef RW_SIMD
+	if(simdMath){
+		transformSIMD(out, in, n, m, 1);
+		return;
+	}
+#endif
 	for(i = 0; i < n; i++){
 		tmp.x = in[i].x*m->right.x + in[i].y*m->up.x + in[i].z*m->at.x + m->pos.x;
 		tmp.y = in[i].x*m->right.y + in[i].y*m->up.y + in[i].z*m->at.y + m->pos.y;
@@ -206,6 +333,12 @@ V3d::transformVectors(V3d *out, const V3d *in, int32 n, const Matrix *m)
 {
 	int32 i;
 	V3d tmp;
+#ifdef RW_SIMD
+	if(simdMath){
+		transformSIMD(out, in, n, m, 0);
+		return;
+	}
+#endif
 	for(i = 0; i < n; i++){
 		tmp.x = in[i].x*m->right.x + in[i].y*m->up.x + in[i].z*m->at.x;
 		tmp.y = in[i].x*m->right.y + in[i].y*m->up.y + in[i].z*m->at.y;
@@ -528,6 +661,12 @@ Matrix::lookAt(const V3d &dir, const V3d &up)
 void
 Matrix::mult_(Matrix *dst, const Matrix *src1, const Matrix *src2)
 {
+#ifdef RW_SIMD
+	if(simdMath){
+		multSIMD(dst, src1, src2);
+		return;
+	}
+#endif
 	dst->right.x = src1->right.x*src2->right.x + src1->right.y*src2->up.x + src1->right.z*src2->at.x;
 	dst->right.y = src1->right.x*src2->right.y + src1->right.y*src2->up.y + src1->right.z*src2->at.y;
 	dst->right.z = src1->right.x*src2->right.z + src1->right.y*src2->up.z + src1->right.z*src2->at.z;
@@ -570,6 +709,13 @@ Matrix*
 Matrix::invertGeneral(Matrix *dst, const Matrix *src)
 {
 	float32 det, invdet;
+#ifdef RW_SIMD
+	if(simdMath){
+		invertGeneralSIMD(dst, src);
+		dst->flags &= ~IDENTITY;
+		return dst;
+	}
+#endif
 	// calculate a few cofactors
 	dst->right.x = src->up.y*src->at.z - src->up.z*src->at.y;
 	dst->right.y = src->at.y*src->right.z - src->at.z*src->right.y;
@@ -653,6 +799,60 @@ Matrix::makeRotation(Matrix *dst, const Quat &q)
 	dst->pad1 = dst->pad2 = dst->pad3 = 0;
 }
 
+// Rotation matrices for n quaternions that are stride bytes apart
+void
+Matrix::makeRotations(Matrix *dst, const Quat *q, int32 n, int32 stride)
+{
+	int32 i = 0;
+#ifdef RW_SIMD
+	if(simdMath){
+		static const float32 one = 1.0f, two = 2.0f;
+		vec4 vone = vdup(&one), vtwo = vdup(&two), zero = vzero();
+		vec4 x, y, z, w, xx, yy, zz, yz, zx, xy, wx, wy, wz;
+		vec4 r[4], u[4], a[4];
+		int32 j;
+		// four at a time in SoA form, same math as makeRotation
+		for(; i+4 <= n; i += 4){
+			const uint8 *qp = (const uint8*)q + i*stride;
+			x = vload((const float32*)qp);
+			y = vload((const float32*)(qp + stride));
+			z = vload((const float32*)(qp + 2*stride));
+			w = vload((const float32*)(qp + 3*stride));
+			vtranspose(x, y, z, w);
+			xx = vmul(x, x); yy = vmul(y, y); zz = vmul(z, z);
+			yz = vmul(y, z); zx = vmul(z, x); xy = vmul(x, y);
+			wx = vmul(w, x); wy = vmul(w, y); wz = vmul(w, z);
+
+			r[0] = vsub(vone, vmul(vtwo, vadd(yy, zz)));
+			r[1] = vmul(vtwo, vadd(xy, wz));
+			r[2] = vmul(vtwo, vsub(zx, wy));
+			r[3] = zero;
+			u[0] = vmul(vtwo, vsub(xy, wz));
+			u[1] = vsub(vone, vmul(vtwo, vadd(xx, zz)));
+			u[2] = vmul(vtwo, vadd(yz, wx));
+			u[3] = zero;
+			a[0] = vmul(vtwo, vadd(zx, wy));
+			a[1] = vmul(vtwo, vsub(yz, wx));
+			a[2] = vsub(vone, vmul(vtwo, vadd(xx, yy)));
+			a[3] = zero;
+			vtranspose(r[0], r[1], r[2], r[3]);
+			vtranspose(u[0], u[1], u[2], u[3]);
+			vtranspose(a[0], a[1], a[2], a[3]);
+			for(j = 0; j < 4; j++){
+				Matrix *m = &dst[i+j];
+				vstore(&m->right.x, r[j]);
+				vstore(&m->up.x, u[j]);
+				vstore(&m->at.x, a[j]);
+				vstore(&m->pos.x, zero);
+				m->flags = TYPEORTHONORMAL;
+			}
+		}
+	}
+#endif
+	for(; i < n; i++)
+		makeRotation(&dst[i], *(const Quat*)((const uint8*)q + i*stride));
+}
+
 float32
 Matrix::normalError(void)
 {
@@ -682,39 +882,204 @@ Matrix::identityError(void)
 	return dot(r,r) + dot(u,u) + dot(a,a) + dot(pos,pos);
 }
 
+#ifdef __unix__
+// Directory listings for correctPathCase, so resolving a path
+// doesn't mean a readdir scan per component every time.
+// Each directory keeps its entry names in a table hashed by
+// lowercase name. A name that isn't found re-reads the directory
+// if its mtime changed; call flushPathCache() after renames
+// that don't touch the directory.
+// Directories are keyed by absolute path, so changing the working
+// directory doesn't return stale listings. The cache has its own lock
+// so file system calls don't hold up threads waiting for the engine.
+
+struct PathCacheDir
+{
+	PathCacheDir *next;
+	uint32 hash;
+	char *path;
+	struct timespec mtime;
+	char *names;	// all entry names, 0 separated
+	int32 *slots;	// offsets into names, -1 is empty
+	uint32 mask;
+};
+
+#define PATHCACHESIZE 256
+static PathCacheDir *pathCache[PATHCACHESIZE];
+static std::mutex pathCacheMutex;
+
+static uint32
+hashName(const char *s, bool32 ci)
+{
+	uint32 h = 2166136261u;
+	for(; *s; s++){
+		h ^= (uint8)(ci ? tolower(*s) : *s);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void
+readPathCacheDir(PathCacheDir *d, DIR *direct)
+{
+	struct dirent *dirent;
+	size_t size, cap, len;
+	int32 numNames, i;
+	uint32 size2, h;
+
+	rwFree(d->names);
+	rwFree(d->slots);
+	cap = 1024;
+	size = 0;
+	numNames = 0;
+	d->names = (char*)rwMalloc(cap, MEMDUR_GLOBAL);
+	while(dirent = readdir(direct), dirent != nil){
+		len = strlen(dirent->d_name)+1;
+		if(size + len > cap){
+			while(size + len > cap)
+				cap *= 2;
+			d->names = (char*)rwRealloc(d->names, cap, MEMDUR_GLOBAL);
+		}
+		memcpy(d->names+size, dirent->d_name, len);
+		size += len;
+		numNames++;
+	}
+
+	size2 = 16;
+	while(size2 < (uint32)numNames*2)
+		size2 *= 2;
+	d->mask = size2-1;
+	d->slots = rwNewT(int32, size2, MEMDUR_GLOBAL);
+	memset(d->slots, 0xFF, size2*sizeof(int32));
+	// insert in readdir order so the first match wins, like a scan
+	for(i = 0, len = 0; i < numNames; i++){
+		h = hashName(d->names+len, 1) & d->mask;
+		while(d->slots[h] >= 0)
+			h = (h+1) & d->mask;
+		d->slots[h] = (int32)len;
+		len += strlen(d->names+len)+1;
+	}
+}
+
+static PathCacheDir*
+findPathCacheDir(const char *path)
+{
+	PathCacheDir *d;
+	DIR *direct;
+	struct stat st;
+	uint32 h = hashName(path, 0);
+
+	for(d = pathCache[h % PATHCACHESIZE]; d; d = d->next)
+		if(d->hash == h && strcmp(d->path, path) == 0)
+			return d;
+	if(stat(path, &st) != 0 || (direct = opendir(path)) == nil)
+		return nil;
+	d = rwNewT(PathCacheDir, 1, MEMDUR_GLOBAL);
+	memset(d, 0, sizeof(*d));
+	d->hash = h;
+	d->path = rwStrdup(path, MEMDUR_GLOBAL);
+	d->mtime = st.st_mtim;
+	readPathCacheDir(d, direct);
+	closedir(direct);
+	d->next = pathCache[h % PATHCACHESIZE];
+	pathCache[h % PATHCACHESIZE] = d;
+	return d;
+}
+
+static const char*
+lookupPathCacheDir(PathCacheDir *d, const char *name)
+{
+	uint32 h = hashName(name, 1) & d->mask;
+	for(; d->slots[h] >= 0; h = (h+1) & d->mask)
+		if(strcmp_ci(d->names+d->slots[h], name) == 0)
+			return d->names+d->slots[h];
+	return nil;
+}
+
+// re-read the directory if it changed since we last read it
+static bool32
+refreshPathCacheDir(PathCacheDir *d)
+{
+	DIR *direct;
+	struct stat st;
+	if(stat(d->path, &st) != 0 ||
+	   (st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec))
+		return 0;
+	if(direct = opendir(d->path), direct == nil)
+		return 0;
+	d->mtime = st.st_mtim;
+	readPathCacheDir(d, direct);
+	closedir(direct);
+	return 1;
+}
+#endif
+
+void
+flushPathCache(void)
+{
+#ifdef __unix__
+	PathCacheDir *d, *next;
+	pathCacheMutex.lock();
+	for(int i = 0; i < PATHCACHESIZE; i++){
+		for(d = pathCache[i]; d; d = next){
+			next = d->next;
+			rwFree(d->path);
+			rwFree(d->names);
+			rwFree(d->slots);
+			rwFree(d);
+		}
+		pathCache[i] = nil;
+	}
+	pathCacheMutex.unlock();
+#endif
+}
+
 void
 correctPathCase(char *filename)
 {
 #ifdef __unix__
-	DIR *direct;
-	struct dirent *dirent;
+	PathCacheDir *d;
+	const char *name;
+	size_t len, skip;
 
-	char *dir, *arg;
-	char copy[1024], sofar[1024] = ".";
+	char *dir, *arg, *save;
+	char copy[1024], sofar[1024];
 	strncpy(copy, filename, 1024);
+	copy[1023] = '\0';
 	arg = copy;
-	// hack for absolute paths
+	// resolve relative paths from the working directory,
+	// skip is where the relative part starts again
 	if(filename[0] == '/'){
-		sofar[0] = '/';
-		sofar[1] = '/';
-		sofar[2] = '\0';
+		sofar[0] = '\0';
+		skip = 0;
 		arg++;
+	}else{
+		if(getcwd(sofar, sizeof(sofar)) == nil)
+			return;
+		if(strcmp(sofar, "/") == 0)
+			sofar[0] = '\0';
+		skip = strlen(sofar)+1;
 	}
-	while((dir = strtok(arg, PSEP_S))){
+	pathCacheMutex.lock();
+	while((dir = strtok_r(arg, PSEP_S, &save))){
 		arg = nil;
-		if(direct = opendir(sofar), dir == nil)
-			return;
-		while(dirent = readdir(direct), dirent != nil)
-			if(strncmp_ci(dirent->d_name, dir, 1024) == 0){
-				strncat(sofar, PSEP_S, 1024);
-				strncat(sofar, dirent->d_name, 1024);
-				break;
-			}
-		closedir(direct);
-		if(dirent == nil)
-			return;
+		if(d = findPathCacheDir(sofar[0] ? sofar : "/"), d == nil)
+			goto out;
+		name = lookupPathCacheDir(d, dir);
+		if(name == nil && refreshPathCacheDir(d))
+			name = lookupPathCacheDir(d, dir);
+		if(name == nil)
+			goto out;
+		len = strlen(sofar);
+		if(len + 1 + strlen(name) >= sizeof(sofar))
+			goto out;
+		sofar[len] = PSEP_C;
+		strcpy(sofar+len+1, name);
 	}
-	strcpy(filename, sofar+2);
+	if(strlen(sofar) > skip)
+		strcpy(filename, sofar+skip);
+out:
+	pathCacheMutex.unlock();
 #endif
 }
 
@@ -941,11 +1306,50 @@ Stream::readF32(void)
 	return tmp;
 }
 
+uint8*
+Stream::getPointer(uint32, uint32)
+{
+	return nil;
+}
+
 
 
 void
 StreamMemory::close(void)
 {
+	if(this->growable){
+		rwFree(this->data);
+		this->data = nil;
+		this->length = this->capacity = this->position = 0;
+		this->growable = 0;
+	}
+}
+
+// Make room for len bytes at position. On failure the old
+// buffer and capacity are kept.
+static bool32
+growMemory(StreamMemory *s, uint32 position, uint32 len)
+{
+	uint32 size, cap;
+	uint8 *data;
+
+	// S_EOF can't be a position
+	if(len >= StreamMemory::S_EOF - position){
+		RWERROR((ERR_GENERAL, "memory stream too large"));
+		return 0;
+	}
+	size = position + len;
+	cap = s->capacity < 256 ? 256 : s->capacity;
+	while(cap < size)
+		cap = cap > 0x7FFFFFFF ? size : cap*2;
+	data = (uint8*)rwRealloc(s->data, cap, MEMDUR_EVENT);
+	if(data == nil){
+		RWERROR((ERR_ALLOC, cap));
+		return 0;
+	}
+	s->data = data;
+	s->capacity = cap;
+	return 1;
 }
 
 uint32
@@ -954,11 +1358,14 @@ StreamMemory::write8(const void *data, uint32 len)
 	if(this->eof())
 		return 0;
 	uint32 l = len;
-	if(this->position+l > this->length){
-		if(this->position+l > this->capacity)
+	if(l > this->capacity-this->position){
+		if(this->growable)
+			growMemory(this, this->position, len);
+		if(l > this->capacity-this->position)
 			l = this->capacity-this->position;
-		this->length = this->position+l;
 	}
+	if(this->position+l > this->length)
+		this->length = this->position+l;
 	memcpy(&this->data[this->position], data, l);
 	this->position += l;
 	if(len != l)
@@ -991,6 +1398,8 @@ StreamMemory::seek(int32 offset, int32 whence)
 	else
 		this->position = this->length-offset;
 	if(this->position > this->length){
+		if(this->growable && this->position > this->capacity)
+			growMemory(this, 0, this->position);
 		// TODO: ideally this would depend on the mode
 		if(this->position > this->capacity)
 			this->position = S_EOF;
@@ -1020,9 +1429,31 @@ StreamMemory::open(uint8 *data, uint32 length, uint32 capacity)
 	if(this->capacity < this->length)
 		this->capacity = this->length;
 	this->position = 0;
+	this->growable = 0;
+	this->patchSizes = 0;
+	return this;
+}
+
+StreamMemory*
+StreamMemory::openGrowable(uint32 capacity, bool32 patchSizes)
+{
+	this->data = capacity ? (uint8*)rwMalloc(capacity, MEMDUR_EVENT) : nil;
+	this->capacity = this->data ? capacity : 0;
+	this->length = 0;
+	this->position = 0;
+	this->growable = 1;
+	this->patchSizes = patchSizes;
 	return this;
 }
 
+uint8*
+StreamMemory::getPointer(uint32 offset, uint32 len)
+{
+	if(offset > this->length || len > this->length-offset)
+		return nil;
+	return &this->data[offset];
+}
+
 uint32
 StreamMemory::getLength(void)
 {
@@ -1030,6 +1461,88 @@ StreamMemory::getLength(void)
 }
 
 
+StreamMapped*
+StreamMapped::open(const char *path)
+{
+	assert(this->data == nil);
+	this->mapped = 0;
+#ifdef __unix__
+	struct stat st;
+	int fd = ::open(path, O_RDONLY);
+	if(fd >= 0){
+		if(fstat(fd, &st) == 0 && st.st_size > 0 && (uint64)st.st_size <= 0xFFFFFFFE){
+			void *p = mmap(nil, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(p != MAP_FAILED){
+#ifdef MADV_SEQUENTIAL
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+#endif
+				StreamMemory::open((uint8*)p, (uint32)st.st_size);
+				this->mapped = 1;
+			}
+		}
+		::close(fd);
+	}
+#elif defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nil,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nil);
+	if(file != INVALID_HANDLE_VALUE){
+		LARGE_INTEGER size;
+		if(GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= 0xFFFFFFFE){
+			HANDLE mapping = CreateFileMappingA(file, nil, PAGE_READONLY, 0, 0, nil);
+			if(mapping){
+				void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				if(p){
+					StreamMemory::open((uint8*)p, (uint32)size.QuadPart);
+					this->mapped = 1;
+				}
+				// the view keeps the mapping alive
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+	}
+#endif
+	if(!this->mapped){
+		uint32 len;
+		uint8 *p = getFileContents(path, &len);
+		if(p == nil){
+			RWERROR((ERR_FILE, path));
+			return nil;
+		}
+		StreamMemory::open(p, len);
+	}
+	return this;
+}
+
+void
+StreamMapped::close(void)
+{
+	if(this->data){
+#ifdef __unix__
+		if(this->mapped)
+			munmap(this->data, this->length);
+		else
+#elif defined(_WIN32)
+		if(this->mapped)
+			UnmapViewOfFile(this->data);
+		else
+#endif
+			rwFree(this->data);
+	}
+	this->data = nil;
+	this->length = 0;
+	this->capacity = 0;
+	this->position = 0;
+	this->mapped = 0;
+}
+
+uint32
+StreamMapped::write8(const void*, uint32)
+{
+	return 0;
+}
+
+
 StreamFile*
 StreamFile::open(const char *path, const char *mode)
 {
@@ -1091,6 +1604,25 @@ writeChunkHeader(Stream *s, int32 type, int32 size)
 	return true;
 }
 
+uint32
+beginChunk(Stream *s, int32 type, int32 size)
+{
+	uint32 start = s->patchesSizes() ? s->tell() : 0;
+	writeChunkHeader(s, type, size);
+	return start;
+}
+
+void
+endChunk(Stream *s, uint32 start)
+{
+	if(!s->patchesSizes())
+		return;
+	uint32 end = s->tell();
+	s->seek(start+4, 0);
+	s->writeI32(end - start - 12);
+	s->seek(end, 0);
+}
+
 bool
 readChunkHeaderInfo(Stream *s, ChunkHeaderInfo *header)
 {
@@ -1128,6 +1660,255 @@ findChunk(Stream *s, uint32 type, uint32 *length, uint32 *version)
 	return false;
 }
 
+//
+// ChunkIndex
+//
+
+#define CHUNKINDEX_MAGIC 0x49435752	// 'RWCI'
+#define CHUNKINDEX_VERSION 2
+
+ChunkIndex*
+ChunkIndex::create(void)
+{
+	ChunkIndex *idx = rwNewT(ChunkIndex, 1, MEMDUR_EVENT);
+	idx->numEntries = 0;
+	idx->space = 0;
+	idx->entries = nil;
+	idx->streamSize = 0;
+	return idx;
+}
+
+void
+ChunkIndex::destroy(void)
+{
+	rwFree(this->entries);
+	rwFree(this);
+}
+
+static int32
+addIndexEntry(ChunkIndex *idx, ChunkHeaderInfo *header, uint32 offset, int32 parent)
+{
+	ChunkIndex::Entry *e;
+	if(idx->numEntries >= idx->space){
+		idx->space = idx->space ? idx->space*2 : 64;
+		idx->entries = rwResizeT(ChunkIndex::Entry, idx->entries, idx->space, MEMDUR_EVENT);
+	}
+	e = &idx->entries[idx->numEntries];
+	e->type = header->type;
+	e->length = header->length;
+	e->version = header->version;
+	e->build = header->build;
+	e->offset = offset;
+	e->parent = parent;
+	e->next = -1;
+	return idx->numEntries++;
+}
+
+static uint32
+streamLength(Stream *stream)
+{
+	uint32 pos, len;
+	pos = stream->tell();
+	stream->seek(0, 2);
+	len = stream->tell();
+	stream->seek(pos, 0);
+	return len;
+}
+
+/* Index the chunks in [tell, end). If parentHeader is given the data
+ * has to be an exact sequence of chunks with the parent's library ID,
+ * otherwise everything added here is thrown away again and the parent
+ * is treated as a leaf. A top level chunk that runs past end is an
+ * error. */
+static bool32
+indexChunks(ChunkIndex *idx, Stream *stream, uint32 end, int32 parent, ChunkHeaderInfo *parentHeader)
+{
+	ChunkHeaderInfo header;
+	uint32 offset, dataEnd;
+	int32 mark = idx->numEntries;
+	int32 prev = -1;
+	int32 e;
+
+	for(;;){
+		offset = stream->tell();
+		if(offset >= end)
+			break;
+		if(end - offset < 12){
+			if(parentHeader)
+				goto fail;
+			break;
+		}
+		if(!readChunkHeaderInfo(stream, &header)){
+			if(parentHeader)
+				goto fail;
+			break;
+		}
+		if(parentHeader == nil && header.type == ID_NAOBJECT)
+			break;
+		if(header.length > end - offset - 12){
+			if(parentHeader == nil)
+				RWERROR((ERR_GENERAL, "chunk runs past the end of the stream"));
+			goto fail;
+		}
+		if(parentHeader &&
+		   (header.version != parentHeader->version ||
+		    header.build != parentHeader->build))
+			goto fail;
+		e = addIndexEntry(idx, &header, offset, parent);
+		if(prev >= 0)
+			idx->entries[prev].next = e;
+		prev = e;
+		dataEnd = offset + 12 + header.length;
+		if(header.type != ID_STRUCT && header.length >= 12)
+			indexChunks(idx, stream, dataEnd, e, &header);
+		stream->seek(dataEnd, 0);
+	}
+	return 1;
+fail:
+	idx->numEntries = mark;
+	return 0;
+}
+
+// Index all chunks from the current position to the end of the stream
+bool32
+ChunkIndex::build(Stream *stream)
+{
+	this->numEntries = 0;
+	this->streamSize = streamLength(stream);
+	if(!indexChunks(this, stream, this->streamSize, -1, nil))
+		return 0;
+	return this->numEntries > 0;
+}
+
+int32
+ChunkIndex::getFirstChild(int32 parent)
+{
+	int32 i = parent+1;
+	if(parent < -1)
+		return -1;
+	if(i < this->numEntries && this->entries[i].parent == parent)
+		return i;
+	return -1;
+}
+
+int32
+ChunkIndex::findChild(int32 parent, uint32 type, int32 n)
+{
+	int32 i;
+	for(i = this->getFirstChild(parent); i >= 0; i = this->entries[i].next)
+		if(type == 0 || this->entries[i].type == type)
+			if(n-- == 0)
+				return i;
+	return -1;
+}
+
+bool32
+ChunkIndex::seek(Stream *stream, int32 entry)
+{
+	if(entry < 0 || entry >= this->numEntries)
+		return 0;
+	stream->seek(this->entries[entry].offset + 12, 0);
+	return !stream->eof();
+}
+
+// children follow their parent and siblings are in order,
+// so walking the index always terminates
+static bool32
+validIndexEntries(ChunkIndex *idx)
+{
+	ChunkIndex::Entry *e;
+	for(int32 i = 0; i < idx->numEntries; i++){
+		e = &idx->entries[i];
+		if(e->parent < -1 || e->parent >= i)
+			return 0;
+		if(e->next != -1 && (e->next <= i || e->next >= idx->numEntries))
+			return 0;
+		if(e->offset > idx->streamSize || e->length > idx->streamSize - e->offset ||
+		   idx->streamSize - e->offset - e->length < 12)
+			return 0;
+	}
+	return 1;
+}
+
+ChunkIndex*
+ChunkIndex::streamRead(Stream *stream, Stream *data)
+{
+	uint32 buf[4];
+	ChunkIndex *idx;
+	stream->read32(buf, sizeof(buf));
+	if(stream->eof() || buf[0] != CHUNKINDEX_MAGIC){
+		RWERROR((ERR_GENERAL, "not a chunk index"));
+		return nil;
+	}
+	if(buf[1] != CHUNKINDEX_VERSION){
+		RWERROR((ERR_VERSION, buf[1]));
+		return nil;
+	}
+	// every indexed chunk has a 12 byte header in the stream
+	if(buf[2] > buf[3]/12 || buf[2] > 0x7FFFFFFF/sizeof(Entry)){
+		RWERROR((ERR_GENERAL, "chunk index corrupt"));
+		return nil;
+	}
+	if(buf[3] != streamLength(data)){
+		RWERROR((ERR_GENERAL, "chunk index is stale"));
+		return nil;
+	}
+	idx = ChunkIndex::create();
+	idx->numEntries = buf[2];
+	idx->space = buf[2];
+	idx->streamSize = buf[3];
+	idx->entries = rwNewT(ChunkIndex::Entry, idx->numEntries, MEMDUR_EVENT);
+	if(idx->numEntries && idx->entries == nil){
+		RWERROR((ERR_ALLOC, idx->numEntries*sizeof(Entry)));
+		idx->destroy();
+		return nil;
+	}
+	if(stream->read32(idx->entries, idx->numEntries*sizeof(Entry)) != idx->numEntries*sizeof(Entry)){
+		RWERROR((ERR_GENERAL, "chunk index truncated"));
+		idx->destroy();
+		return nil;
+	}
+	if(!validIndexEntries(idx)){
+		RWERROR((ERR_GENERAL, "chunk index corrupt"));
+		idx->destroy();
+		return nil;
+	}
+	return idx;
+}
+
+bool32
+ChunkIndex::streamWrite(Stream *stream)
+{
+	uint32 buf[4] = { CHUNKINDEX_MAGIC, CHUNKINDEX_VERSION,
+	                  (uint32)this->numEntries, this->streamSize };
+	stream->write32(buf, sizeof(buf));
+	stream->write32(this->entries, this->numEntries*sizeof(Entry));
+	return 1;
+}
+
+ChunkIndex*
+ChunkIndex::read(const char *filename, Stream *data)
+{
+	StreamFile stream;
+	ChunkIndex *idx;
+	if(stream.open(filename, "rb") == nil)
+		return nil;
+	idx = ChunkIndex::streamRead(&stream, data);
+	stream.close();
+	return idx;
+}
+
+bool32
+ChunkIndex::write(const char *filename)
+{
+	StreamFile stream;
+	if(stream.open(filename, "wb") == nil)
+		return 0;
+	this->streamWrite(&stream);
+	stream.close();
+	return 1;
+}
+
 int32
 findPointer(void *p, void **list, int32 num)
 {
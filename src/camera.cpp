@@ -13,7 +13,7 @@
 
 namespace rw {
 
-int32 Camera::numAllocated;
+atomic32 Camera::numAllocated;
 
 PluginList Camera::s_plglist(sizeof(Camera));
 
@@ -474,7 +474,8 @@ bool
 Camera::streamWrite(Stream *stream)
 {
 	CameraChunkData buf;
-	writeChunkHeader(stream, ID_CAMERA, this->streamGetSize());
+	uint32 chunk = beginChunk(stream, ID_CAMERA,
+		stream->patchesSizes() ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, sizeof(CameraChunkData));
 	buf.viewWindow = this->viewWindow;
 	buf.viewOffset = this->viewOffset;
@@ -484,6 +485,7 @@ Camera::streamWrite(Stream *stream)
 	buf.projection = this->projection;
 	stream->write32(&buf, sizeof(CameraChunkData));
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
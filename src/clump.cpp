@@ -14,8 +14,10 @@
 
 namespace rw {
 
-int32 Clump::numAllocated;
-int32 Atomic::numAllocated;
+atomic32 Clump::numAllocated;
+atomic32 Atomic::numAllocated;
+ObjPool Clump::s_pool(&Clump::s_plglist, ID_CLUMP);
+ObjPool Atomic::s_pool(&Atomic::s_plglist, ID_ATOMIC);
 
 PluginList Clump::s_plglist(sizeof(Clump));
 PluginList Atomic::s_plglist(sizeof(Atomic));
@@ -27,7 +29,7 @@ PluginList Atomic::s_plglist(sizeof(Atomic));
 Clump*
 Clump::create(void)
 {
-	Clump *clump = (Clump*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_CLUMP);
+	Clump *clump = (Clump*)s_pool.alloc();
 	if(clump == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -91,7 +93,7 @@ Clump::destroy(void)
 	if(f = this->getFrame(), f)
 		f->destroyHierarchy();
 	assert(this->world == nil);
-	rwFree(this);
+	s_pool.free(this);
 	numAllocated--;
 }
 
@@ -287,8 +289,8 @@ fail:
 bool
 Clump::streamWrite(Stream *stream)
 {
-	int size = this->streamGetSize();
-	writeChunkHeader(stream, ID_CLUMP, size);
+	int size = stream->patchesSizes() ? 0 : this->streamGetSize();
+	uint32 chunk = beginChunk(stream, ID_CLUMP, size);
 	int32 numAtomics = this->countAtomics();
 	int32 numLights = this->countLights();
 	int32 numCameras = this->countCameras();
@@ -305,13 +307,15 @@ Clump::streamWrite(Stream *stream)
 
 	if(rw::version >= 0x30400){
 		size = 12+4;
-		FORLIST(lnk, this->atomics)
-			size += 12 + Atomic::fromClump(lnk)->geometry->streamGetSize();
-		writeChunkHeader(stream, ID_GEOMETRYLIST, size);
+		if(!stream->patchesSizes())
+			FORLIST(lnk, this->atomics)
+				size += 12 + Atomic::fromClump(lnk)->geometry->streamGetSize();
+		uint32 geolist = beginChunk(stream, ID_GEOMETRYLIST, size);
 		writeChunkHeader(stream, ID_STRUCT, 4);
 		stream->writeI32(numAtomics);	// same as numGeometries
 		FORLIST(lnk, this->atomics)
 			Atomic::fromClump(lnk)->geometry->streamWrite(stream);
+		endChunk(stream, geolist);
 	}
 
 	FORLIST(lnk, this->atomics)
@@ -340,6 +344,7 @@ Clump::streamWrite(Stream *stream)
 	rwFree(frmlst.frames);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -411,7 +416,7 @@ worldAtomicSync(ObjectWithFrame *obj)
 Atomic*
 Atomic::create(void)
 {
-	Atomic *atomic = (Atomic*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_ATOMIC);
+	Atomic *atomic = (Atomic*)s_pool.alloc();
 	if(atomic == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -470,7 +475,7 @@ Atomic::destroy(void)
 	assert(this->clump == nil);
 	assert(this->world == nil);
 	this->setFrame(nil);
-	rwFree(this);
+	s_pool.free(this);
 	numAllocated--;
 }
 
@@ -507,7 +512,8 @@ Atomic::getWorldBoundingSphere(void)
 	return s;
 }
 
-static uint32 atomicRights[2];
+// filled in by the rights plugin while reading, one per loading thread
+static RWTHREADLOCAL uint32 atomicRights[2];
 
 Atomic*
 Atomic::streamReadClump(Stream *stream,
@@ -558,7 +564,8 @@ Atomic::streamWriteClump(Stream *stream, FrameList_ *frmlst)
 	Clump *c = this->clump;
 	if(c == nil)
 		return false;
-	writeChunkHeader(stream, ID_ATOMIC, this->streamGetSize());
+	uint32 chunk = beginChunk(stream, ID_ATOMIC,
+		stream->patchesSizes() ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, rw::version < 0x30400 ? 12 : 16);
 	buf[0] = findPointer(this->getFrame(), (void**)frmlst->frames, frmlst->numFrames);
 
@@ -580,6 +587,7 @@ Atomic::streamWriteClump(Stream *stream, FrameList_ *frmlst)
 	}
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -406,7 +406,12 @@ rasterSetFormat(Raster *raster)
 	natras->hasAlpha = formatInfoRW[(raster->format >> 8) & 0xF].hasAlpha;
 	raster->stride = raster->width*natras->bpp;
 
+#ifdef RW_D3D9
 	natras->autogenMipmap = (raster->format & (Raster::MIPMAP|Raster::AUTOMIPMAP)) == (Raster::MIPMAP|Raster::AUTOMIPMAP);
+#else
+	// no device to generate them, setFromImage fills all levels
+	natras->autogenMipmap = 0;
+#endif
 }
 
 static Raster*
@@ -436,6 +441,32 @@ rasterCreateTexture(Raster *raster)
 	return raster;
 }
 
+// DXT1 for C565 and C1555, DXT3 for C4444, DXT5 for C8888
+static Raster*
+rasterCreateCompressed(Raster *raster)
+{
+	D3dRaster *natras = GETD3DRASTEREXT(raster);
+	int32 dxt;
+
+	// DXT1 has alpha only for 1555
+	switch(raster->format & (Raster::PAL4 | Raster::PAL8 | 0xF00)){
+	case Raster::C565:  dxt = 1; natras->hasAlpha = 0; break;
+	case Raster::C1555: dxt = 1; natras->hasAlpha = 1; break;
+	case Raster::C4444: dxt = 3; natras->hasAlpha = 1; break;
+	case Raster::C8888: dxt = 5; natras->hasAlpha = 1; break;
+	default:
+		RWERROR((ERR_INVRASTER));
+		return nil;
+	}
+	allocateDXT(raster, dxt, Raster::calculateNumLevels(raster->width, raster->height),
+	            natras->hasAlpha);
+	if(natras->texture == nil){
+		RWERROR((ERR_NOTEXTURE));
+		return nil;
+	}
+	return raster;
+}
+
 #ifdef RW_D3D9
 
 static Raster*
@@ -537,7 +568,10 @@ rasterCreate(Raster *raster)
 	switch(raster->type){
 	case Raster::NORMAL:
 	case Raster::TEXTURE:
-		ret = rasterCreateTexture(raster);
+		if(raster->flags & Raster::COMPRESSED)
+			ret = rasterCreateCompressed(raster);
+		else
+			ret = rasterCreateTexture(raster);
 		break;
 
 #ifdef RW_D3D9
@@ -675,6 +709,25 @@ imageFindRasterFormat(Image *img, int32 type,
 
 	assert((type&0xF) == Raster::TEXTURE);
 
+	if(type & Raster::COMPRESSED){
+		// DXT1 unless alpha needs more than one bit, then DXT5
+		if(!img->hasAlpha()){
+			format = Raster::C565;
+			depth = 16;
+		}else if(img->hasCutoutAlpha()){
+			format = Raster::C1555;
+			depth = 16;
+		}else{
+			format = Raster::C8888;
+			depth = 32;
+		}
+		*pWidth = img->width;
+		*pHeight = img->height;
+		*pDepth = depth;
+		*pFormat = format | type;
+		return 1;
+	}
+
 //	for(width = 1; width < img->width; width <<= 1);
 //	for(height = 1; height < img->height; height <<= 1);
 	// Perhaps non-power-of-2 textures are acceptable?
@@ -722,11 +775,41 @@ imageFindRasterFormat(Image *img, int32 type,
 	return 1;
 }
 
+static bool32
+rasterFromImageDXT(Raster *raster, Image *image)
+{
+	D3dRaster *natras = GETD3DRASTEREXT(raster);
+	int32 dxt;
+	switch(natras->format){
+	case D3DFMT_DXT1: dxt = 1; break;
+	case D3DFMT_DXT3: dxt = 3; break;
+	case D3DFMT_DXT5: dxt = 5; break;
+	default:
+		RWERROR((ERR_INVRASTER));
+		return 0;
+	}
+
+	bool unlock = false;
+	if(raster->pixels == nil){
+		raster->lock(0, Raster::LOCKWRITE|Raster::LOCKNOFETCH);
+		unlock = true;
+	}
+	assert(raster->pixels);
+	assert(image->width == raster->width);
+	assert(image->height == raster->height);
+	image->getPixelsDXT(dxt, raster->pixels);
+	if(unlock)
+		raster->unlock(0);
+	return 1;
+}
+
 bool32
 rasterFromImage(Raster *raster, Image *image)
 {
 	if((raster->type&0xF) != Raster::TEXTURE)
 		return 0;
+	if(GETD3DRASTEREXT(raster)->customFormat)
+		return rasterFromImageDXT(raster, image);
 
 	void (*conv)(uint8 *out, uint8 *in) = nil;
 
@@ -987,16 +1070,12 @@ allocateDXT(Raster *raster, int32 dxt, int32 numLevels, bool32 hasAlpha)
 	ras->format = dxtMap[dxt-1];
 	ras->hasAlpha = hasAlpha;
 	ras->customFormat = 1;
-	if(ras->autogenMipmap)
-		numLevels = 0;
-	else if(raster->format & Raster::MIPMAP)
-		{}
-	else
+	// hardware can't generate compressed levels, setFromImage fills them
+	ras->autogenMipmap = 0;
+	if((raster->format & Raster::MIPMAP) == 0)
 		numLevels = 1;
 	ras->texture = createTexture(raster->width, raster->height,
-	                             numLevels,
-	                             ras->autogenMipmap ? D3DUSAGE_AUTOGENMIPMAP : 0,
-	                             ras->format);
+	                             numLevels, 0, ras->format);
 	raster->flags &= ~Raster::DONTALLOCATE;
 }
 
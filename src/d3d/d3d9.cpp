@@ -252,6 +252,7 @@ writeNativeData(Stream *stream, int32 len, void *object, int32, int32)
 	InstanceDataHeader *header = (InstanceDataHeader*)geometry->instData;
 	int32 size = 64 + geometry->meshHeader->numMeshes*36;
 	uint8 *data = rwNewT(uint8, size, MEMDUR_FUNCTION | ID_GEOMETRY);
+	memset(data, 0, size);
 	stream->writeI32(size);
 
 	uint8 *p = data;
@@ -229,12 +229,11 @@ enum
 	VSLOC_boneMatrices = VSLOC_afterLights
 };
 
-static float skinMatrices[64*16];
-
 void
 uploadSkinMatrices(Atomic *a)
 {
 	int i;
+	float skinMatrices[64*16];
 	Skin *skin = Skin::get(a->geometry);
 	float *m = skinMatrices;
 	HAnimHierarchy *hier = Skin::getHierarchy(a);
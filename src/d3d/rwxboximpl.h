@@ -5,6 +5,9 @@ Raster *rasterCreate(Raster *raster);
 uint8 *rasterLock(Raster *raster, int32 level, int32 lockMode);
 void rasterUnlock(Raster*, int32);
 int32 rasterNumLevels(Raster *raster);
+bool32 imageFindRasterFormat(Image *img, int32 type,
+	int32 *width, int32 *height, int32 *depth, int32 *format);
+bool32 rasterFromImage(Raster *raster, Image *image);
 Image *rasterToImage(Raster *raster);
 
 }
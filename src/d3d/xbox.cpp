@@ -28,6 +28,8 @@ driverOpen(void *o, int32, int32)
 	engine->driver[PLATFORM_XBOX]->rasterLock = rasterLock;
 	engine->driver[PLATFORM_XBOX]->rasterUnlock = rasterUnlock;
 	engine->driver[PLATFORM_XBOX]->rasterNumLevels = rasterNumLevels;
+	engine->driver[PLATFORM_XBOX]->imageFindRasterFormat = imageFindRasterFormat;
+	engine->driver[PLATFORM_XBOX]->rasterFromImage = rasterFromImage;
 	engine->driver[PLATFORM_XBOX]->rasterToImage = rasterToImage;
 
 	return o;
@@ -583,6 +585,35 @@ rasterCreateTexture(Raster *raster)
 	return raster;
 }
 
+// DXT1 for C565 and C1555, DXT3 for C4444, DXT5 for C8888
+static Raster*
+rasterCreateCompressed(Raster *raster)
+{
+	XboxRaster *natras = GETXBOXRASTEREXT(raster);
+
+	// DXT1 has alpha only for 1555
+	switch(raster->format & (Raster::PAL4 | Raster::PAL8 | 0xF00)){
+	case Raster::C565:  natras->format = D3DFMT_DXT1; natras->hasAlpha = 0; break;
+	case Raster::C1555: natras->format = D3DFMT_DXT1; natras->hasAlpha = 1; break;
+	case Raster::C4444: natras->format = D3DFMT_DXT3; natras->hasAlpha = 1; break;
+	case Raster::C8888: natras->format = D3DFMT_DXT5; natras->hasAlpha = 1; break;
+	default:
+		RWERROR((ERR_INVRASTER));
+		return nil;
+	}
+	natras->customFormat = 1;
+	assert(natras->texture == nil);
+	natras->texture = createTexture(raster->width, raster->height,
+	                                raster->format & Raster::MIPMAP ?
+	                                  Raster::calculateNumLevels(raster->width, raster->height) : 1,
+	                                natras->format);
+	if(natras->texture == nil){
+		RWERROR((ERR_NOTEXTURE));
+		return nil;
+	}
+	return raster;
+}
+
 Raster*
 rasterCreate(Raster *raster)
 {
@@ -602,7 +633,10 @@ rasterCreate(Raster *raster)
 	switch(raster->type){
 	case Raster::NORMAL:
 	case Raster::TEXTURE:
-		ret = rasterCreateTexture(raster);
+		if(raster->flags & Raster::COMPRESSED)
+			ret = rasterCreateCompressed(raster);
+		else
+			ret = rasterCreateTexture(raster);
 		break;
 	default:
 		RWERROR((ERR_INVRASTER));
@@ -691,6 +725,69 @@ unswizzle(uint8 *dst, uint8 *src, int32 w, int32 h, int32 bpp)
 	}
 }
 
+// Only compressed rasters for now, the others would have to be swizzled
+bool32
+imageFindRasterFormat(Image *img, int32 type,
+	int32 *pWidth, int32 *pHeight, int32 *pDepth, int32 *pFormat)
+{
+	int32 depth, format;
+
+	assert((type&0xF) == Raster::TEXTURE);
+	if((type & Raster::COMPRESSED) == 0){
+		RWERROR((ERR_INVRASTER));
+		return 0;
+	}
+
+	// DXT1 unless alpha needs more than one bit, then DXT5
+	if(!img->hasAlpha()){
+		format = Raster::C565;
+		depth = 16;
+	}else if(img->hasCutoutAlpha()){
+		format = Raster::C1555;
+		depth = 16;
+	}else{
+		format = Raster::C8888;
+		depth = 32;
+	}
+	*pWidth = img->width;
+	*pHeight = img->height;
+	*pDepth = depth;
+	*pFormat = format | type;
+	return 1;
+}
+
+bool32
+rasterFromImage(Raster *raster, Image *image)
+{
+	XboxRaster *natras = GETXBOXRASTEREXT(raster);
+	int32 dxt;
+
+	if((raster->type&0xF) != Raster::TEXTURE || !natras->customFormat){
+		RWERROR((ERR_INVRASTER));
+		return 0;
+	}
+	switch(natras->format){
+	case D3DFMT_DXT1: dxt = 1; break;
+	case D3DFMT_DXT3: dxt = 3; break;
+	case D3DFMT_DXT5: dxt = 5; break;
+	default:
+		RWERROR((ERR_INVRASTER));
+		return 0;
+	}
+
+	bool unlock = false;
+	if(raster->pixels == nil){
+		raster->lock(0, Raster::LOCKWRITE|Raster::LOCKNOFETCH);
+		unlock = true;
+	}
+	assert(image->width == raster->width);
+	assert(image->height == raster->height);
+	image->getPixelsDXT(dxt, raster->pixels);
+	if(unlock)
+		raster->unlock(0);
+	return 1;
+}
+
 Image*
 rasterToImage(Raster *raster)
 {
@@ -36,7 +36,7 @@ Engine::State Engine::state = Dead;
 MemoryFunctions Engine::memfuncs;
 PluginList Driver::s_plglist[NUM_PLATFORMS];
 
-const char *allocLocation;
+RWTHREADLOCAL const char *allocLocation;
 
 void *malloc_h(size_t sz, uint32 hint) { if(sz == 0) return nil; return malloc(sz); }
 void *realloc_h(void *p, size_t sz, uint32 hint) { return realloc(p, sz); }
@@ -66,7 +66,6 @@ malloc_managed(size_t sz, uint32 hint)
 	origPtr = malloc(sz + sizeof(MemoryBlock) + 15);
 	if(origPtr == nil)
 		return nil;
-	totalMemoryAllocated += sz;
 	data = (uint8*)origPtr;
 	data += sizeof(MemoryBlock);
 	data = (uint8*)ALIGN16((uintptr)data);
@@ -76,7 +75,10 @@ malloc_managed(size_t sz, uint32 hint)
 	mem->hint = hint;
 	mem->origPtr = origPtr;
 	mem->codeline = allocLocation;
+	lockEngine();
 	allocations.add(&mem->inAllocList);
+	totalMemoryAllocated += sz;
+	unlockEngine();
 
 	return data;
 }
@@ -94,11 +96,13 @@ realloc_managed(void *p, size_t sz, uint32 hint)
 	mem = (MemoryBlock*)((uint8*)p-sizeof(MemoryBlock));
 	offset = (uint8*)p - (uint8*)mem->origPtr;
 
+	lockEngine();
 	mem->inAllocList.remove();
 
 	origPtr = realloc(mem->origPtr, sz + sizeof(MemoryBlock) + 15);
 	if(origPtr == nil){
 		allocations.add(&mem->inAllocList);
+		unlockEngine();
 		return nil;
 	}
 	p = (uint8*)origPtr + offset;
@@ -110,6 +114,7 @@ realloc_managed(void *p, size_t sz, uint32 hint)
 	mem->codeline = allocLocation;
 	allocations.add(&mem->inAllocList);
 	totalMemoryAllocated += mem->sz;
+	unlockEngine();
 
 	return p;
 }
@@ -121,8 +126,10 @@ free_managed(void *p)
 	if(p == nil)
 		return;
 	mem = (MemoryBlock*)((uint8*)p-sizeof(MemoryBlock));
+	lockEngine();
 	mem->inAllocList.remove();
 	totalMemoryAllocated -= mem->sz;
+	unlockEngine();
 	free(mem->origPtr);
 }
 
@@ -294,6 +301,9 @@ Engine::open(EngineOpenParams *p)
 		engine->driver[i]->rasterToImage = null::rasterToImage;
 	}
 
+	// all plugins are registered now
+	initObjPools();
+
 	Engine::state = Opened;
 	return 1;
 }
@@ -333,7 +343,23 @@ Engine::term(void)
 		return;
 	}
 
+	// objects still alive are leaked, so plugins can register again
+	releaseObjPools();
+	Engine::s_plglist.numObjects = 0;
+	Frame::s_plglist.numObjects = 0;
+	Raster::s_plglist.numObjects = 0;
+	Texture::s_plglist.numObjects = 0;
+	TexDictionary::s_plglist.numObjects = 0;
+	Geometry::s_plglist.numObjects = 0;
+	Material::s_plglist.numObjects = 0;
+	Atomic::s_plglist.numObjects = 0;
+	Light::s_plglist.numObjects = 0;
+	Camera::s_plglist.numObjects = 0;
+	Clump::s_plglist.numObjects = 0;
+	World::s_plglist.numObjects = 0;
 	PluginList::close();
+	flushPathCache();
+	stopJobThreads();
 
 	// This has to be reset because it won't be opened again otherwise
 	// TODO: maybe reset more stuff here?
@@ -13,22 +13,98 @@
 
 namespace rw {
 
-int32 Frame::numAllocated;
+atomic32 Frame::numAllocated;
+ObjPool Frame::s_pool(&Frame::s_plglist, ID_FRAMELIST);
 
 PluginList Frame::s_plglist(sizeof(Frame));
-static void *frameOpen(void *object, int32 offset, int32 size) { engine->frameDirtyList.init(); return object; }
-static void *frameClose(void *object, int32 offset, int32 size) { return object; }
+
+// Flattened hierarchy, cached in the root frame.
+// Breadth first, so parents always come before their children.
+struct FrameHierarchy
+{
+	int32 numFrames;
+	Frame **frames;
+	int32 *parents;		// index into frames, -1 for the root
+	uint8 *flags;		// accumulated hierarchy flags while synching
+};
+
+struct FrameGlobals
+{
+	int32 numSyncThreads;
+};
+int32 frameModuleOffset;
+
+#define FRAMEGLOBAL(v) (PLUGINOFFSET(FrameGlobals, engine, frameModuleOffset)->v)
+
+static void*
+frameOpen(void *object, int32 offset, int32 size)
+{
+	frameModuleOffset = offset;
+	engine->frameDirtyList.init();
+	FRAMEGLOBAL(numSyncThreads) = 1;
+	return object;
+}
+static void*
+frameClose(void *object, int32 offset, int32 size)
+{
+	return object;
+}
 
 void
 Frame::registerModule(void)
 {
-	Engine::registerPlugin(0, ID_FRAMEMODULE, frameOpen, frameClose);
+	Engine::registerPlugin(sizeof(FrameGlobals), ID_FRAMEMODULE, frameOpen, frameClose);
+}
+
+void Frame::setNumSyncThreads(int32 n) { FRAMEGLOBAL(numSyncThreads) = n; }
+int32 Frame::getNumSyncThreads(void) { return FRAMEGLOBAL(numSyncThreads); }
+
+static void
+dropHierarchy(Frame *root)
+{
+	rwFree(root->hierarchy);
+	root->hierarchy = nil;
+}
+
+static FrameHierarchy*
+getHierarchy(Frame *root)
+{
+	FrameHierarchy *h;
+	Frame *f;
+	int32 i, n;
+	uint8 *mem;
+
+	if(root->hierarchy)
+		return root->hierarchy;
+	n = root->count();
+	mem = rwNewT(uint8, sizeof(FrameHierarchy) + n*(sizeof(Frame*) + sizeof(int32) + 1),
+		MEMDUR_EVENT | ID_FRAMELIST);
+	h = (FrameHierarchy*)mem;
+	mem += sizeof(FrameHierarchy);
+	h->numFrames = n;
+	h->frames = (Frame**)mem;
+	mem += n*sizeof(Frame*);
+	h->parents = (int32*)mem;
+	mem += n*sizeof(int32);
+	h->flags = mem;
+
+	h->frames[0] = root;
+	h->parents[0] = -1;
+	n = 1;
+	for(i = 0; i < n; i++)
+		for(f = h->frames[i]->child; f; f = f->next){
+			h->frames[n] = f;
+			h->parents[n++] = i;
+		}
+	assert(n == h->numFrames);
+	root->hierarchy = h;
+	return h;
 }
 
 Frame*
 Frame::create(void)
 {
-	Frame *f = (Frame*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_FRAMELIST);
+	Frame *f = (Frame*)s_pool.alloc();
 	if(f == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -39,6 +115,7 @@ Frame::create(void)
 	f->child = nil;
 	f->next = nil;
 	f->root = f;
+	f->hierarchy = nil;
 	f->matrix.setIdentity();
 	f->ltm.setIdentity();
 	s_plglist.construct(f);
@@ -60,11 +137,15 @@ Frame::destroy(void)
 	s_plglist.destruct(this);
 	if(this->getParent())
 		this->removeChild();
-	if(this->object.privateFlags & Frame::HIERARCHYSYNC)
+	if(this->object.privateFlags & Frame::HIERARCHYSYNC){
+		lockEngine();
 		this->inDirtyList.remove();
+		unlockEngine();
+	}
+	dropHierarchy(this);
 	for(Frame *f = this->child; f; f = f->next)
 		f->object.parent = nil;
-	rwFree(this);
+	s_pool.free(this);
 	numAllocated--;
 }
 
@@ -78,9 +159,14 @@ Frame::destroyHierarchy(void)
 	}
 	assert(this->objectList.isEmpty());
 	s_plglist.destruct(this);
-	if(this->object.privateFlags & Frame::HIERARCHYSYNC)
+	if(this->object.privateFlags & Frame::HIERARCHYSYNC){
+		lockEngine();
 		this->inDirtyList.remove();
-	rwFree(this);
+		unlockEngine();
+	}
+	dropHierarchy(this);
+	s_pool.free(this);
+	numAllocated--;
 }
 
 Frame*
@@ -89,6 +175,8 @@ Frame::addChild(Frame *child, bool32 append)
 	Frame *c;
 	if(child->getParent())
 		child->removeChild();
+	dropHierarchy(child);
+	dropHierarchy(this->root);
 	if(append){
 		if(this->child == nil)
 			this->child = child;
@@ -107,7 +195,9 @@ Frame::addChild(Frame *child, bool32 append)
 		c->setHierarchyRoot(this);
 	// If the child was a root, remove from dirty list
 	if(child->object.privateFlags & Frame::HIERARCHYSYNC){
+		lockEngine();
 		child->inDirtyList.remove();
+		unlockEngine();
 		child->object.privateFlags &= ~Frame::HIERARCHYSYNC;
 	}
 	this->updateObjects();
@@ -119,6 +209,7 @@ Frame::removeChild(void)
 {
 	Frame *parent = this->getParent();
 	Frame *child = parent->child;
+	dropHierarchy(this->root);
 	if(child == this)
 		parent->child = this->next;
 	else{
@@ -171,63 +262,53 @@ Frame::count(void)
 
 /* Synch just LTM matrices in a hierarchy */
 static void
-syncLTMRecurse(Frame *frame, uint8 hierarchyFlags)
+syncLTMs(FrameHierarchy *h)
 {
-	for(; frame; frame = frame->next){
-		// If frame is dirty or any parent was dirty, update LTM
-		hierarchyFlags |= frame->object.privateFlags;
-		if(hierarchyFlags & Frame::SUBTREESYNCLTM){
+	Frame **frames = h->frames;
+	int32 *parents = h->parents;
+	uint8 *flags = h->flags;
+	Frame *root = frames[0];
+
+	// Sync root's LTM
+	flags[0] = root->object.privateFlags;
+	if(flags[0] & Frame::SUBTREESYNCLTM)
+		root->ltm = root->matrix;
+	root->object.privateFlags &= ~Frame::SUBTREESYNCLTM;
+	// ...and children. If frame is dirty or any parent was dirty, update LTM
+	for(int32 i = 1; i < h->numFrames; i++){
+		Frame *frame = frames[i];
+		flags[i] = flags[parents[i]] | frame->object.privateFlags;
+		if(flags[i] & Frame::SUBTREESYNCLTM){
 			Matrix::mult(&frame->ltm, &frame->matrix,
-			             &frame->getParent()->ltm);
+			             &frames[parents[i]]->ltm);
 			frame->object.privateFlags &= ~Frame::SUBTREESYNCLTM;
 		}
-		// And synch all children
-		syncLTMRecurse(frame->child, hierarchyFlags);
 	}
 }
 
 /* Synch just objects in a hierarchy */
 static void
-syncObjRecurse(Frame *frame)
+syncObjects(FrameHierarchy *h)
 {
-	for(; frame; frame = frame->next){
-		// Synch attached objects
+	for(int32 i = 0; i < h->numFrames; i++){
+		Frame *frame = h->frames[i];
 		FORLIST(lnk, frame->objectList)
 			ObjectWithFrame::fromFrame(lnk)->sync();
-		frame->object.privateFlags &= ~Frame::SUBTREESYNCOBJ;
-		// And synch all children
-		syncObjRecurse(frame->child);
+		frame->object.privateFlags &= ~Frame::SUBTREESYNC;
 	}
 }
 
-/* Synch LTM and objects */
 static void
-syncRecurse(Frame *frame, uint8 hierarchyFlags)
+syncLTMJob(int32 i, void *data)
 {
-	for(; frame; frame = frame->next){
-		// If frame is dirty or any parent was dirty, update LTM
-		hierarchyFlags |= frame->object.privateFlags;
-		if(hierarchyFlags & Frame::SUBTREESYNCLTM)
-			Matrix::mult(&frame->ltm, &frame->matrix,
-			             &frame->getParent()->ltm);
-		// Synch attached objects
-		FORLIST(lnk, frame->objectList)
-			ObjectWithFrame::fromFrame(lnk)->sync();
-		frame->object.privateFlags &= ~Frame::SUBTREESYNC;
-		// And synch all children
-		syncRecurse(frame->child, hierarchyFlags);
-	}
+	syncLTMs(((FrameHierarchy**)data)[i]);
 }
 
 /* Sync the LTMs of the hierarchy of which 'this' is the root */
 void
 Frame::syncHierarchyLTM(void)
 {
-	// Sync root's LTM
-	if(this->object.privateFlags & Frame::SUBTREESYNCLTM)
-		this->ltm = this->matrix;
-	// ...and children
-	syncLTMRecurse(this->child, this->object.privateFlags);
+	syncLTMs(getHierarchy(this));
 	// all clean now
 	this->object.privateFlags &= ~Frame::SYNCLTM;
 }
@@ -240,32 +321,71 @@ Frame::getLTM(void)
 	return &this->ltm;
 }
 
+// Loader threads keep their dirty frames to themselves
+static LinkList*
+getDirtyList(void)
+{
+	LoaderContext *ctx = getLoaderContext();
+	return ctx ? &ctx->frameDirtyList : &engine->frameDirtyList;
+}
+
 /* Synch all dirty frames; LTMs and objects */
 void
 Frame::syncDirty(void)
 {
-	Frame *frame;
-	FORLIST(lnk, engine->frameDirtyList){
+	Frame *frame, **roots;
+	FrameHierarchy **syncList;
+	int32 numThreads = FRAMEGLOBAL(numSyncThreads);
+	int32 i, n, numRoots, numFrames;
+	uint8 *syncLTM;
+
+	// Take the roots off the dirty list and clear their flags, so frames
+	// made dirty by other threads while we're syncing go into the list
+	// again and aren't lost.
+	lockEngine();
+	LinkList *list = getDirtyList();
+	numRoots = 0;
+	FORLIST(lnk, *list)
+		numRoots++;
+	if(numRoots == 0){
+		unlockEngine();
+		return;
+	}
+	roots = rwNewT(Frame*, numRoots, MEMDUR_FUNCTION | ID_FRAMELIST);
+	syncLTM = rwNewT(uint8, numRoots, MEMDUR_FUNCTION | ID_FRAMELIST);
+	i = 0;
+	FORLIST(lnk, *list){
 		frame = LLLinkGetData(lnk, Frame, inDirtyList);
-		if(frame->object.privateFlags & Frame::HIERARCHYSYNCLTM){
-			// Sync root's LTM
-			if(frame->object.privateFlags & Frame::SUBTREESYNCLTM)
-				frame->ltm = frame->matrix;
-			// Synch attached objects
-			FORLIST(lnk, frame->objectList)
-				ObjectWithFrame::fromFrame(lnk)->sync();
-			// ...and children
-			syncRecurse(frame->child, frame->object.privateFlags);
-		}else{
-			// LTMs are clean, just synch objects
-			FORLIST(lnk, frame->objectList)
-				ObjectWithFrame::fromFrame(lnk)->sync();
-			syncObjRecurse(frame->child);
-		}
-		// all clean now
-		frame->object.privateFlags &= ~(Frame::SYNCLTM | Frame::SYNCOBJ);
+		roots[i] = frame;
+		syncLTM[i++] = !!(frame->object.privateFlags & Frame::HIERARCHYSYNCLTM);
+		frame->object.privateFlags &= ~Frame::HIERARCHYSYNC;
+		frame->inDirtyList.init();
 	}
-	engine->frameDirtyList.init();
+	list->init();
+	unlockEngine();
+
+	// LTMs of different hierarchies are independent, sync those first.
+	// Objects are synched afterwards on this thread.
+	syncList = rwNewT(FrameHierarchy*, numRoots, MEMDUR_FUNCTION | ID_FRAMELIST);
+	n = 0;
+	numFrames = 0;
+	for(i = 0; i < numRoots; i++){
+		if(!syncLTM[i])
+			continue;
+		syncList[n] = getHierarchy(roots[i]);
+		numFrames += syncList[n++]->numFrames;
+	}
+	// not worth it for small scenes
+	if(numFrames < 1024)
+		numThreads = 1;
+	parallelFor(n, numThreads, syncLTMJob, syncList);
+
+	for(i = 0; i < numRoots; i++)
+		syncObjects(getHierarchy(roots[i]));
+
+	rwFree(syncList);
+	rwFree(syncLTM);
+	rwFree(roots);
 }
 
 void
@@ -307,11 +427,13 @@ void
 Frame::updateObjects(void)
 {
 	// Mark root as dirty and insert into dirty list if necessary
+	lockEngine();
 	if((this->root->object.privateFlags & HIERARCHYSYNC) == 0)
-		engine->frameDirtyList.add(&this->root->inDirtyList);
+		getDirtyList()->add(&this->root->inDirtyList);
 	this->root->object.privateFlags |= HIERARCHYSYNC;
 	// Mark subtree as dirty as well
 	this->object.privateFlags |= SUBTREESYNC;
+	unlockEngine();
 }
 
 void
@@ -418,10 +540,11 @@ FrameList_::streamWrite(Stream *stream)
 	int size = 0, structsize = 0;
 	structsize = 4 + this->numFrames*sizeof(FrameStreamData);
 	size += 12 + structsize;
-	for(int32 i = 0; i < this->numFrames; i++)
-		size += 12 + Frame::s_plglist.streamGetSize(this->frames[i]);
+	if(!stream->patchesSizes())
+		for(int32 i = 0; i < this->numFrames; i++)
+			size += 12 + Frame::s_plglist.streamGetSize(this->frames[i]);
 
-	writeChunkHeader(stream, ID_FRAMELIST, size);
+	uint32 chunk = beginChunk(stream, ID_FRAMELIST, size);
 	writeChunkHeader(stream, ID_STRUCT, structsize);
 	stream->writeU32(this->numFrames);
 	for(int32 i = 0; i < this->numFrames; i++){
@@ -437,6 +560,7 @@ FrameList_::streamWrite(Stream *stream)
 	}
 	for(int32 i = 0; i < this->numFrames; i++)
 		Frame::s_plglist.streamWrite(stream, this->frames[i]);
+	endChunk(stream, chunk);
 }
 
 static Frame*
@@ -15,72 +15,200 @@
 
 namespace rw {
 
-int32 Geometry::numAllocated;
-int32 Material::numAllocated;
+atomic32 Geometry::numAllocated;
+atomic32 Material::numAllocated;
+ObjPool Geometry::s_pool(&Geometry::s_plglist, ID_GEOMETRY);
+ObjPool Material::s_pool(&Material::s_plglist, ID_MATERIAL);
 
 PluginList Geometry::s_plglist(sizeof(Geometry));
 PluginList Material::s_plglist(sizeof(Material));
 
 static SurfaceProperties defaultSurfaceProps = { 1.0f, 1.0f, 1.0f };
 
-// We allocate twice because we have to allocate the data separately for uninstancing
-Geometry*
-Geometry::create(int32 numVerts, int32 numTris, uint32 flags)
+static bool32 packedStreamRead = 1;
+
+void Geometry::setPackedStreamRead(bool32 b) { packedStreamRead = b; }
+bool32 Geometry::getPackedStreamRead(void) { return packedStreamRead; }
+
+static bool32 optimizeMeshes = 0;
+
+void Geometry::setOptimizeMeshes(bool32 b) { optimizeMeshes = b; }
+bool32 Geometry::getOptimizeMeshes(void) { return optimizeMeshes; }
+
+#define ALIGN16(x) (((x) + 15) & ~15)
+
+// Size of triangles, colors and tex coords
+static int32
+dataSize(Geometry *geo)
 {
-	Geometry *geo = (Geometry*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_GEOMETRY);
-	if(geo == nil){
-		RWERROR((ERR_ALLOC, s_plglist.size));
-		return nil;
+	int32 sz = geo->numTriangles*sizeof(Triangle);
+	if(geo->flags & Geometry::PRELIT)
+		sz += geo->numVertices*sizeof(RGBA);
+	sz += geo->numTexCoordSets*geo->numVertices*sizeof(TexCoords);
+	return sz;
+}
+
+// Set up the attribute pointers. The triangle pointer
+// will hold the first address (even when there are no triangles)
+// so we can free easily.
+static void
+setupData(Geometry *geo, uint8 *data)
+{
+	geo->triangles = (Triangle*)data;
+	data += geo->numTriangles*sizeof(Triangle);
+	if(geo->flags & Geometry::PRELIT && geo->numVertices){
+		geo->colors = (RGBA*)data;
+		data += geo->numVertices*sizeof(RGBA);
 	}
-	numAllocated++;
+	if(geo->numVertices)
+		for(int32 i = 0; i < geo->numTexCoordSets; i++){
+			geo->texCoords[i] = (TexCoords*)data;
+			data += geo->numVertices*sizeof(TexCoords);
+		}
+
+	// init triangles
+	for(int32 i = 0; i < geo->numTriangles; i++)
+		geo->triangles[i].matId = 0xFFFF;
+}
+
+// Size of one morph target including its vertices and normals
+static int32
+morphTargetSize(Geometry *geo)
+{
+	int32 sz = sizeof(MorphTarget);
+	if(!(geo->flags & Geometry::NATIVE)){
+		sz += geo->numVertices*sizeof(V3d);
+		if(geo->flags & Geometry::NORMALS)
+			sz += geo->numVertices*sizeof(V3d);
+	}
+	return sz;
+}
+
+// Memory layout: MorphTarget[n]; (vertices and normals)[n]
+// Bounding spheres of morph targets before 'first' are kept.
+static void
+setupMorphTargets(Geometry *geo, MorphTarget *mts, int32 n, int32 first)
+{
+	V3d *data  = (V3d*)&mts[n];
+	for(int32 i = 0; i < n; i++){
+		mts->parent = geo;
+		mts->vertices = nil;
+		mts->normals = nil;
+		if(i >= first){
+			mts->boundingSphere.center.x = 0.0f;
+			mts->boundingSphere.center.y = 0.0f;
+			mts->boundingSphere.center.z = 0.0f;
+			mts->boundingSphere.radius = 0.0f;
+		}
+		if(!(geo->flags & Geometry::NATIVE) && geo->numVertices){
+			mts->vertices = data;
+			data += geo->numVertices;
+			if(geo->flags & Geometry::NORMALS){
+				mts->normals = data;
+				data += geo->numVertices;
+			}
+		}
+		mts++;
+	}
+}
+
+// Packed morph targets can't be resized inside the geometry block,
+// so copy them out to a block of their own.
+static MorphTarget*
+resizeMorphTargets(Geometry *geo, int32 size, int32 copySize)
+{
+	MorphTarget *mts;
+	if(geo->packed & Geometry::PACKEDMORPHS){
+		mts = (MorphTarget*)rwNew(size, MEMDUR_EVENT | ID_GEOMETRY);
+		memcpy(mts, geo->morphTargets, copySize < size ? copySize : size);
+		geo->packed &= ~Geometry::PACKEDMORPHS;
+	}else
+		mts = (MorphTarget*)rwResize(geo->morphTargets, size, MEMDUR_EVENT | ID_GEOMETRY);
+	geo->morphTargets = mts;
+	return mts;
+}
+
+static Geometry*
+initGeometry(uint8 *block, int32 numVerts, int32 numTris, uint32 flags)
+{
+	Geometry *geo = (Geometry*)block;
 	geo->object.init(Geometry::ID, 0);
 	geo->flags = flags & 0xFF00FFFF;
 	geo->numTexCoordSets = (flags & 0xFF0000) >> 16;
 	if(geo->numTexCoordSets == 0)
-		geo->numTexCoordSets = (geo->flags & TEXTURED)  ? 1 :
-		                       (geo->flags & TEXTURED2) ? 2 : 0;
+		geo->numTexCoordSets = (geo->flags & Geometry::TEXTURED)  ? 1 :
+		                       (geo->flags & Geometry::TEXTURED2) ? 2 : 0;
 	geo->numTriangles = numTris;
 	geo->numVertices = numVerts;
+	geo->packed = 0;
 
 	geo->colors = nil;
 	for(int32 i = 0; i < 8; i++)
 		geo->texCoords[i] = nil;
 	geo->triangles = nil;
-	// Allocate all attributes at once. The triangle pointer
-	// will hold the first address (even when there are no triangles)
-	// so we can free easily.
-	if(!(geo->flags & NATIVE)){
-		int32 sz = geo->numTriangles*sizeof(Triangle);
-		if(geo->flags & PRELIT)
-			sz += geo->numVertices*sizeof(RGBA);
-		sz += geo->numTexCoordSets*geo->numVertices*sizeof(TexCoords);
-
-		uint8 *data = (uint8*)rwNew(sz, MEMDUR_EVENT | ID_GEOMETRY);
-		geo->triangles = (Triangle*)data;
-		data += geo->numTriangles*sizeof(Triangle);
-		if(geo->flags & PRELIT && geo->numVertices){
-			geo->colors = (RGBA*)data;
-			data += geo->numVertices*sizeof(RGBA);
-		}
-		if(geo->numVertices)
-			for(int32 i = 0; i < geo->numTexCoordSets; i++){
-				geo->texCoords[i] = (TexCoords*)data;
-				data += geo->numVertices*sizeof(TexCoords);
-			}
-
-		// init triangles
-		for(int32 i = 0; i < geo->numTriangles; i++)
-			geo->triangles[i].matId = 0xFFFF;
-	}
 	geo->numMorphTargets = 0;
 	geo->morphTargets = nil;
-	geo->addMorphTargets(1);
 
 	geo->matList.init();
 	geo->lockedSinceInst = 0;
 	geo->meshHeader = nil;
 	geo->instData = nil;
 	geo->refCount = 1;
+	return geo;
+}
+
+// We allocate twice because we have to allocate the data separately for uninstancing
+Geometry*
+Geometry::create(int32 numVerts, int32 numTris, uint32 flags)
+{
+	uint8 *block = (uint8*)s_pool.alloc();
+	if(block == nil){
+		RWERROR((ERR_ALLOC, s_plglist.size));
+		return nil;
+	}
+	numAllocated++;
+	Geometry *geo = initGeometry(block, numVerts, numTris, flags);
+	// Allocate all attributes at once.
+	if(!(geo->flags & NATIVE))
+		setupData(geo, (uint8*)rwNew(dataSize(geo), MEMDUR_EVENT | ID_GEOMETRY));
+	geo->addMorphTargets(1);
+
+	s_plglist.construct(geo);
+	return geo;
+}
+
+// Geometry, plugin data, attributes and morph targets in one block.
+// Whatever gets reallocated later is copied out of it.
+Geometry*
+Geometry::createPacked(int32 numVerts, int32 numTris, uint32 flags, int32 numMorphTargets)
+{
+	if(numMorphTargets < 1)
+		numMorphTargets = 1;
+	int32 geoSize = ALIGN16(s_plglist.size);
+	// need the flags and counts to size the rest
+	Geometry tmp;
+	initGeometry((uint8*)&tmp, numVerts, numTris, flags);
+	int32 dataSz = 0;
+	if(!(tmp.flags & NATIVE))
+		dataSz = ALIGN16(dataSize(&tmp));
+	int32 mtSize = numMorphTargets*morphTargetSize(&tmp);
+
+	int32 sz = geoSize + dataSz + mtSize;
+	uint8 *block = (uint8*)rwMalloc(sz, MEMDUR_EVENT | ID_GEOMETRY);
+	if(block == nil){
+		RWERROR((ERR_ALLOC, sz));
+		return nil;
+	}
+	numAllocated++;
+	Geometry *geo = initGeometry(block, numVerts, numTris, flags);
+	geo->packed = PACKEDBLOCK | PACKEDMORPHS;
+	if(!(geo->flags & NATIVE)){
+		setupData(geo, block + geoSize);
+		geo->packed |= PACKEDDATA;
+	}
+	geo->morphTargets = (MorphTarget*)(block + geoSize + dataSz);
+	setupMorphTargets(geo, geo->morphTargets, numMorphTargets, 0);
+	geo->numMorphTargets = numMorphTargets;
 
 	s_plglist.construct(geo);
 	return geo;
@@ -89,17 +217,21 @@ Geometry::create(int32 numVerts, int32 numTris, uint32 flags)
 void
 Geometry::destroy(void)
 {
-	this->refCount--;
-	if(this->refCount <= 0){
+	if(--this->refCount <= 0){
 		s_plglist.destruct(this);
 		// Also frees colors and tex coords
-		rwFree(this->triangles);
+		if(!(this->packed & PACKEDDATA))
+			rwFree(this->triangles);
 		// Also frees their data
-		rwFree(this->morphTargets);
+		if(!(this->packed & PACKEDMORPHS))
+			rwFree(this->morphTargets);
 		// Also frees indices
 		rwFree(this->meshHeader);
 		this->matList.deinit();
-		rwFree(this);
+		if(this->packed & PACKEDBLOCK)
+			rwFree(this);
+		else
+			s_pool.free(this);
 		numAllocated--;
 	}
 }
@@ -130,6 +262,35 @@ struct GeoStreamData
 	int32 numMorphTargets;
 };
 
+static void
+readTriangles(Stream *stream, Triangle *tris, int32 numTris)
+{
+	uint32 tribuf[2];
+#ifndef BIGENDIAN
+	// decode straight from memory if we can
+	uint8 *src = stream->getPointer(stream->tell(), numTris*8);
+	if(src){
+		for(int32 i = 0; i < numTris; i++){
+			memcpy(tribuf, src, 8);
+			src += 8;
+			tris[i].v[0]  = tribuf[0] >> 16;
+			tris[i].v[1]  = tribuf[0];
+			tris[i].v[2]  = tribuf[1] >> 16;
+			tris[i].matId = tribuf[1];
+		}
+		stream->seek(numTris*8);
+		return;
+	}
+#endif
+	for(int32 i = 0; i < numTris; i++){
+		stream->read32(tribuf, 8);
+		tris[i].v[0]  = tribuf[0] >> 16;
+		tris[i].v[1]  = tribuf[0];
+		tris[i].v[2]  = tribuf[1] >> 16;
+		tris[i].matId = tribuf[1];
+	}
+}
+
 Geometry*
 Geometry::streamRead(Stream *stream)
 {
@@ -144,11 +305,18 @@ Geometry::streamRead(Stream *stream)
 		return nil;
 	}
 	stream->read32(&buf, sizeof(buf));
-	Geometry *geo = Geometry::create(buf.numVertices,
-	                                 buf.numTriangles, buf.flags);
+	Geometry *geo;
+	if(packedStreamRead)
+		geo = Geometry::createPacked(buf.numVertices, buf.numTriangles,
+		                             buf.flags, buf.numMorphTargets);
+	else{
+		geo = Geometry::create(buf.numVertices,
+		                       buf.numTriangles, buf.flags);
+		if(geo)
+			geo->addMorphTargets(buf.numMorphTargets-1);
+	}
 	if(geo == nil)
 		return nil;
-	geo->addMorphTargets(buf.numMorphTargets-1);
 	if(version < 0x34000)
 		stream->read32(&surfProps, 12);
 
@@ -158,14 +326,7 @@ Geometry::streamRead(Stream *stream)
 		for(int32 i = 0; i < geo->numTexCoordSets; i++)
 			stream->read32(geo->texCoords[i],
 				    2*geo->numVertices*4);
-		for(int32 i = 0; i < geo->numTriangles; i++){
-			uint32 tribuf[2];
-			stream->read32(tribuf, 8);
-			geo->triangles[i].v[0]  = tribuf[0] >> 16;
-			geo->triangles[i].v[1]  = tribuf[0];
-			geo->triangles[i].v[2]  = tribuf[1] >> 16;
-			geo->triangles[i].matId = tribuf[1];
-		}
+		readTriangles(stream, geo->triangles, geo->numTriangles);
 	}
 
 	for(int32 i = 0; i < geo->numMorphTargets; i++){
@@ -232,7 +393,8 @@ Geometry::streamWrite(Stream *stream)
 	GeoStreamData buf;
 	static float32 fbuf[3] = { 1.0f, 1.0f, 1.0f };
 
-	writeChunkHeader(stream, ID_GEOMETRY, this->streamGetSize());
+	uint32 chunk = beginChunk(stream, ID_GEOMETRY,
+		stream->patchesSizes() ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, geoStructSize(this));
 
 	buf.flags = this->flags | this->numTexCoordSets << 16;
@@ -280,6 +442,7 @@ Geometry::streamWrite(Stream *stream)
 	this->matList.streamWrite(stream);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -300,23 +463,16 @@ Geometry::addMorphTargets(int32 n)
 		return;
 	n += this->numMorphTargets;
 
-	int32 sz;
-	sz = sizeof(MorphTarget);
-	if(!(this->flags & NATIVE)){
-		sz += this->numVertices*sizeof(V3d);
-		if(this->flags & NORMALS)
-			sz += this->numVertices*sizeof(V3d);
-	}
+	int32 sz = morphTargetSize(this);
 
 	// Memory layout: MorphTarget[n]; (vertices and normals)[n]
 	MorphTarget *mts;
 	if(this->numMorphTargets){
-		mts = (MorphTarget*)rwResize(this->morphTargets, n*sz, MEMDUR_EVENT | ID_GEOMETRY);
-		this->morphTargets = mts;
+		mts = resizeMorphTargets(this, n*sz, this->numMorphTargets*sz);
 		// Since we now have more morph targets than before, move the vertex data up
-		uint8 *src = (uint8*)mts + sz*this->numMorphTargets;
-		uint8 *dst = (uint8*)mts + sz*n;
 		uint32 len = (sz-sizeof(MorphTarget))*this->numMorphTargets;
+		uint8 *src = (uint8*)mts + sz*this->numMorphTargets;
+		uint8 *dst = (uint8*)mts + sizeof(MorphTarget)*n + len;
 		while(len--)
 			*--dst = *--src;
 	}else{
@@ -325,27 +481,7 @@ Geometry::addMorphTargets(int32 n)
 	}
 
 	// Set up everything and initialize the bounding sphere for new morph targets
-	V3d *data  = (V3d*)&mts[n];
-	for(int32 i = 0; i < n; i++){
-		mts->parent = this;
-		mts->vertices = nil;
-		mts->normals = nil;
-		if(i >= this->numMorphTargets){
-			mts->boundingSphere.center.x = 0.0f;
-			mts->boundingSphere.center.y = 0.0f;
-			mts->boundingSphere.center.z = 0.0f;
-			mts->boundingSphere.radius = 0.0f;
-		}
-		if(!(this->flags & NATIVE) && this->numVertices){
-			mts->vertices = data;
-			data += this->numVertices;
-			if(this->flags & NORMALS){
-				mts->normals = data;
-				data += this->numVertices;
-			}
-		}
-		mts++;
-	}
+	setupMorphTargets(this, mts, n, this->numMorphTargets);
 	this->numMorphTargets = n;
 }
 
@@ -375,35 +511,17 @@ void
 Geometry::allocateData(void)
 {
 	// Geometry data
-	// Pretty much copy pasted from ::create above
-	int32 sz = this->numTriangles*sizeof(Triangle);
-	if(this->flags & PRELIT)
-		sz += this->numVertices*sizeof(RGBA);
-	sz += this->numTexCoordSets*this->numVertices*sizeof(TexCoords);
-
-	uint8 *data = (uint8*)rwNew(sz, MEMDUR_EVENT | ID_GEOMETRY);
-	this->triangles = (Triangle*)data;
-	data += this->numTriangles*sizeof(Triangle);
-	for(int32 i = 0; i < this->numTriangles; i++)
-		this->triangles[i].matId = 0xFFFF;
-	if(this->flags & PRELIT){
-		this->colors = (RGBA*)data;
-		data += this->numVertices*sizeof(RGBA);
-	}
-	for(int32 i = 0; i < this->numTexCoordSets; i++){
-		this->texCoords[i] = (TexCoords*)data;
-		data += this->numVertices*sizeof(TexCoords);
-	}
+	setupData(this, (uint8*)rwNew(dataSize(this), MEMDUR_EVENT | ID_GEOMETRY));
+	this->packed &= ~PACKEDDATA;
 
 	// MorphTarget data
 	// Bounding sphere is copied by realloc.
-	sz = sizeof(MorphTarget) + this->numVertices*sizeof(V3d);
+	int32 sz = sizeof(MorphTarget) + this->numVertices*sizeof(V3d);
 	if(this->flags & NORMALS)
 		sz += this->numVertices*sizeof(V3d);
 
-	MorphTarget *mt = (MorphTarget*)rwResize(this->morphTargets,
-		sz*this->numMorphTargets, MEMDUR_EVENT | ID_GEOMETRY);
-	this->morphTargets = mt;
+	MorphTarget *mt = resizeMorphTargets(this, sz*this->numMorphTargets,
+		sizeof(MorphTarget)*this->numMorphTargets);
 	V3d *vdata = (V3d*)&mt[this->numMorphTargets];
 	for(int32 i = 0; i < this->numMorphTargets; i++){
 		mt->parent = this;
@@ -525,6 +643,8 @@ Geometry::buildMeshes(void)
 	this->meshHeader = nil;
 	int32 numMeshes = this->matList.numMaterials;
 	if((this->flags & Geometry::TRISTRIP) == 0){
+		if(optimizeMeshes)
+			this->orderTrianglesForCache();
 		int32 *numIndices = rwNewT(int32, numMeshes,
 			MEMDUR_FUNCTION | ID_GEOMETRY);
 		memset(numIndices, 0, numMeshes*sizeof(int32));
@@ -683,6 +803,45 @@ Geometry::removeUnusedMaterials(void)
 	rwFree(map);
 }
 
+//
+// VertexHash
+//
+
+void
+VertexHash::init(int32 maxVertices)
+{
+	uint32 size = 16;
+	while(size < (uint32)maxVertices*2)
+		size *= 2;
+	this->mask = size-1;
+	this->heads = rwNewT(int32, size, MEMDUR_FUNCTION | ID_GEOMETRY);
+	this->links = rwNewT(int32, maxVertices > 0 ? maxVertices : 1, MEMDUR_FUNCTION | ID_GEOMETRY);
+	memset(this->heads, 0xFF, size*sizeof(int32));
+}
+
+void
+VertexHash::deinit(void)
+{
+	rwFree(this->links);
+	rwFree(this->heads);
+	this->heads = nil;
+	this->links = nil;
+}
+
+uint32
+VertexHash::hash(const V3d &p)
+{
+	uint32 x, y, z;
+	// +0.0f turns -0.0 into 0.0, they compare equal
+	float32 f[3] = { p.x + 0.0f, p.y + 0.0f, p.z + 0.0f };
+	memcpy(&x, &f[0], 4);
+	memcpy(&y, &f[1], 4);
+	memcpy(&z, &f[2], 4);
+	uint32 h = x*73856093u ^ y*19349663u ^ z*83492791u;
+	h ^= h >> 16;
+	return h & this->mask;
+}
+
 Sphere
 MorphTarget::calculateBoundingSphere(void) const
 {
@@ -766,6 +925,7 @@ MaterialList*
 MaterialList::streamRead(Stream *stream, MaterialList *matlist)
 {
 	int32 *indices = nil;
+	int32 *indexbuf = nil;
 	int32 numMat;
 	if(!findChunk(stream, ID_STRUCT, nil, nil)){
 		RWERROR((ERR_CHUNK, "STRUCT"));
@@ -780,8 +940,18 @@ MaterialList::streamRead(Stream *stream, MaterialList *matlist)
 		goto fail;
 	matlist->space = numMat;
 
-	indices = (int32*)rwMalloc(numMat*4, MEMDUR_FUNCTION | ID_MATERIAL);
-	stream->read32(indices, numMat*4);
+#ifndef BIGENDIAN
+	// use the indices in place if the stream is in memory
+	indices = (int32*)stream->getPointer(stream->tell(), numMat*4);
+	if(indices && ((uintptr)indices & 3) == 0)
+		stream->seek(numMat*4);
+	else
+#endif
+	{
+		indexbuf = (int32*)rwMalloc(numMat*4, MEMDUR_FUNCTION | ID_MATERIAL);
+		stream->read32(indexbuf, numMat*4);
+		indices = indexbuf;
+	}
 
 	Material *m;
 	for(int32 i = 0; i < numMat; i++){
@@ -800,10 +970,10 @@ MaterialList::streamRead(Stream *stream, MaterialList *matlist)
 		matlist->appendMaterial(m);
 		m->destroy();
 	}
-	rwFree(indices);
+	rwFree(indexbuf);
 	return matlist;
 fail:
-	rwFree(indices);
+	rwFree(indexbuf);
 	matlist->deinit();
 	return nil;
 }
@@ -811,8 +981,8 @@ fail:
 bool
 MaterialList::streamWrite(Stream *stream)
 {
-	uint32 size = this->streamGetSize();
-	writeChunkHeader(stream, ID_MATLIST, size);
+	uint32 size = stream->patchesSizes() ? 0 : this->streamGetSize();
+	uint32 chunk = beginChunk(stream, ID_MATLIST, size);
 	writeChunkHeader(stream, ID_STRUCT, 4 + this->numMaterials*4);
 	stream->writeI32(this->numMaterials);
 
@@ -833,6 +1003,7 @@ MaterialList::streamWrite(Stream *stream)
 		this->materials[i]->streamWrite(stream);
 		found:;
 	}
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -857,7 +1028,7 @@ MaterialList::streamGetSize(void)
 Material*
 Material::create(void)
 {
-	Material *mat = (Material*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_MATERIAL);
+	Material *mat = (Material*)s_pool.alloc();
 	if(mat == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
@@ -892,12 +1063,11 @@ Material::clone(void)
 void
 Material::destroy(void)
 {
-	this->refCount--;
-	if(this->refCount <= 0){
+	if(--this->refCount <= 0){
 		s_plglist.destruct(this);
 		if(this->texture)
 			this->texture->destroy();
-		rwFree(this);
+		s_pool.free(this);
 		numAllocated--;
 	}
 }
@@ -920,7 +1090,8 @@ struct MatStreamData
 	int32 textured;
 };
 
-static uint32 materialRights[2];
+// filled in by the rights plugin while reading, one per loading thread
+static RWTHREADLOCAL uint32 materialRights[2];
 
 Material*
 Material::streamRead(Stream *stream)
@@ -969,7 +1140,8 @@ Material::streamWrite(Stream *stream)
 {
 	MatStreamData buf;
 
-	writeChunkHeader(stream, ID_MATERIAL, this->streamGetSize());
+	uint32 chunk = beginChunk(stream, ID_MATERIAL,
+		stream->patchesSizes() ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, sizeof(MatStreamData)
 		+ (rw::version >= 0x30400 ? 12 : 0));
 
@@ -993,6 +1165,7 @@ Material::streamWrite(Stream *stream)
 		this->texture->streamWrite(stream);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -52,7 +52,9 @@ Geometry::allocateMeshes(int32 numMeshes, uint32 numIndices, bool32 noIndices)
 		this->meshHeader = mh;
 	}
 	mh->numMeshes = numMeshes;
+	lockEngine();
 	mh->serialNum = nextSerialNum++;
+	unlockEngine();
 	mh->totalIndices = numIndices;
 	m = mh->getMeshes();
 	indices = (uint16*)&m[numMeshes];
@@ -231,6 +233,60 @@ MeshHeader::guessNumTriangles(void)
 		return this->totalIndices/3;
 }
 
+// Simulate a FIFO post-transform cache of cacheSize vertices
+// over all meshes. A vertex is in the cache if fewer than cacheSize
+// misses happened since it was last loaded.
+void
+MeshHeader::getCacheStats(MeshCacheStats *stats, int32 cacheSize)
+{
+	int32 *loadTime;
+	int32 numMisses, numVertices;
+	uint32 i, j, n;
+	uint16 *idx;
+	bool32 inStrip;
+	Mesh *m;
+
+	loadTime = rwNewT(int32, 0x10000, MEMDUR_FUNCTION | ID_GEOMETRY);
+	memset(loadTime, 0xFF, 0x10000*sizeof(int32));
+	numMisses = 0;
+	numVertices = 0;
+	stats->numTriangles = 0;
+	stats->numStrips = 0;
+	stats->numStitches = 0;
+
+	m = this->getMeshes();
+	for(i = 0; i < this->numMeshes; i++){
+		for(j = 0; j < m->numIndices; j++){
+			n = m->indices[j];
+			if(loadTime[n] < 0)
+				numVertices++;
+			if(loadTime[n] < 0 || numMisses - loadTime[n] >= cacheSize)
+				loadTime[n] = numMisses++;
+		}
+		if(this->flags == MeshHeader::TRISTRIP){
+			inStrip = 0;
+			for(j = 0; j+2 < m->numIndices; j++){
+				idx = &m->indices[j];
+				if(idx[0] == idx[1] || idx[0] == idx[2] || idx[1] == idx[2]){
+					stats->numStitches++;
+					inStrip = 0;
+				}else{
+					stats->numTriangles++;
+					if(!inStrip)
+						stats->numStrips++;
+					inStrip = 1;
+				}
+			}
+		}else
+			stats->numTriangles += m->numIndices/3;
+		m++;
+	}
+	rwFree(loadTime);
+
+	stats->acmr = stats->numTriangles ? (float32)numMisses/stats->numTriangles : 0.0f;
+	stats->atvr = numVertices ? (float32)numMisses/numVertices : 0.0f;
+}
+
 // Native Data
 
 static void*
@@ -208,12 +208,11 @@ skinUninstanceCB(Geometry *geo, InstanceDataHeader *header)
 	assert(0 && "can't uninstance");
 }
 
-static float skinMatrices[64*16];
-
 void
 uploadSkinMatrices(Atomic *a)
 {
 	int i;
+	float skinMatrices[64*16];
 	Skin *skin = Skin::get(a->geometry);
 	Matrix *m = (Matrix*)skinMatrices;
 	HAnimHierarchy *hier = Skin::getHierarchy(a);
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 #include "rwbase.h"
 #include "rwerror.h"
@@ -62,6 +63,8 @@ HAnimHierarchy::create(int32 numNodes, int32 *nodeFlags, int32 *nodeIDs,
 			hier->nodeInfo[i].flags = 0;
 		hier->nodeInfo[i].frame = nil;
 	}
+	hier->parentIndices = rwNewT(int32, hier->numNodes, MEMDUR_EVENT | ID_HANIM);
+	hier->updateParentIndices();
 	return hier;
 }
 
@@ -71,9 +74,33 @@ HAnimHierarchy::destroy(void)
 	this->interpolator->destroy();
 	rwFree(this->matricesUnaligned);
 	rwFree(this->nodeInfo);
+	rwFree(this->parentIndices);
 	rwFree(this);
 }
 
+// Resolve the PUSH/POP node flags to parent indices, -1 is the root.
+// Call this after changing the node flags.
+void
+HAnimHierarchy::updateParentIndices(void)
+{
+	int32 *sp, stack[64];
+	int32 i, parent;
+
+	sp = stack;
+	parent = -1;
+	*sp++ = parent;
+	for(i = 0; i < this->numNodes; i++){
+		this->parentIndices[i] = parent;
+		if(this->nodeInfo[i].flags & PUSH)
+			*sp++ = parent;
+		parent = i;
+		if(this->nodeInfo[i].flags & POP)
+			parent = *--sp;
+		assert(sp >= stack);
+		assert(sp <= &stack[64]);
+	}
+}
+
 static Frame*
 findById(Frame *f, int32 id)
 {
@@ -148,6 +175,8 @@ HAnimHierarchy::find(Frame *f)
 	return HAnimHierarchy::find(f->child);
 }
 
+static void hanimApplyCB(void *result, void *frame);
+
 void
 HAnimHierarchy::updateMatrices(void)
 {
@@ -168,6 +197,22 @@ HAnimHierarchy::updateMatrices(void)
 		rootMat = *parfrm->getLTM();
 	else
 		rootMat.setIdentity();
+
+	// Fast path for the standard interpolator:
+	// all local matrices at once, then a sweep with the parent indices
+	if(anim->applyCB == hanimApplyCB){
+		HAnimInterpFrame *frames = (HAnimInterpFrame*)anim->getInterpFrame(0);
+		int32 stride = anim->currentInterpKeyFrameSize;
+		Matrix::makeRotations(curMat, &frames->q, this->numNodes, stride);
+		for(i = 0; i < this->numNodes; i++){
+			curMat[i].pos = ((HAnimInterpFrame*)anim->getInterpFrame(i))->t;
+			int32 parent = this->parentIndices[i];
+			Matrix::mult(&animMat, &curMat[i], parent < 0 ? &rootMat : &curMat[parent]);
+			curMat[i] = animMat;
+		}
+		return;
+	}
+
 	parentMat = &rootMat;
 	*sp++ = parentMat;
 	HAnimNodeInfo *node = this->nodeInfo;
@@ -193,6 +238,27 @@ HAnimHierarchy::updateMatrices(void)
 	}
 }
 
+static void
+updateMatricesJob(int32 i, void *data)
+{
+	((HAnimHierarchy**)data)[i]->updateMatrices();
+}
+
+// Update many hierarchies on numThreads threads (0 = all processors)
+void
+HAnimHierarchy::updateMatrices(HAnimHierarchy **hierarchies, int32 num, int32 numThreads)
+{
+	Frame *frm, *parfrm;
+	int32 i;
+	// Sync the parent LTMs here, frame hierarchies may be shared
+	for(i = 0; i < num; i++){
+		frm = hierarchies[i]->parentFrame;
+		if(frm && (parfrm = frm->getParent()) && !(hierarchies[i]->flags&LOCALSPACEMATRICES))
+			parfrm->getLTM();
+	}
+	parallelFor(num, numThreads, updateMatricesJob, hierarchies);
+}
+
 HAnimData*
 HAnimData::get(Frame *f)
 {
@@ -242,6 +308,7 @@ copyHAnim(void *dst, void *src, int32 offset, int32)
 			dsthier->nodeInfo[i].index = srchier->nodeInfo[i].index;
 			dsthier->nodeInfo[i].id = srchier->nodeInfo[i].id;
 		}
+		dsthier->updateParentIndices();
 		dsthanim->hierarchy = dsthier;
 		dsthier->parentFrame = (Frame*)dst;
 	}
@@ -370,6 +437,237 @@ assert(t >= in1->time && t <= in2->time);
 	out->q = slerp(in1->q, in2->q, a);
 }
 
+//
+// Compressed keyframes
+//
+
+static uint16
+floatToHalf(float32 f)
+{
+	union { float32 f; uint32 u; } u;
+	uint32 sign, mant, h;
+	int32 exp;
+	u.f = f;
+	sign = (u.u>>16) & 0x8000;
+	exp = (int32)((u.u>>23) & 0xFF) - 127 + 15;
+	mant = u.u & 0x7FFFFF;
+	if(exp <= 0)
+		return sign;	// flush denormals
+	if(exp >= 31)
+		return sign | 0x7C00;
+	h = sign | exp<<10 | mant>>13;
+	if(mant & 0x1000)	// round, may carry into the exponent
+		h++;
+	return h;
+}
+
+static float32
+halfToFloat(uint16 h)
+{
+	union { float32 f; uint32 u; } u;
+	uint32 exp = (h>>10) & 0x1F;
+	u.u = (h & 0x8000)<<16;
+	if(exp == 31)
+		u.u |= 0x7F800000 | (h&0x3FF)<<13;
+	else if(exp != 0)
+		u.u |= (exp - 15 + 127)<<23 | (h&0x3FF)<<13;
+	return u.f;
+}
+
+// Smallest three: drop the largest component and store the other three
+// in 15 bits each, plus 2 bits for the index of the dropped one.
+#define QUATRANGE 0.70710678f
+#define QUATMAX 32767
+
+static void
+packQuat(uint16 *dst, const Quat &quat)
+{
+	Quat q = normalize(quat);
+	float32 c[4] = { q.x, q.y, q.z, q.w };
+	uint64 bits;
+	int32 i, j, largest;
+	float32 v;
+
+	largest = 0;
+	for(i = 1; i < 4; i++)
+		if(fabsf(c[i]) > fabsf(c[largest]))
+			largest = i;
+	// q and -q are the same rotation, keep the dropped one positive
+	if(c[largest] < 0.0f)
+		for(i = 0; i < 4; i++)
+			c[i] = -c[i];
+	bits = largest;
+	for(i = 0; i < 4; i++){
+		if(i == largest)
+			continue;
+		v = (c[i] + QUATRANGE)/(2.0f*QUATRANGE);
+		j = (int32)(v*QUATMAX + 0.5f);
+		if(j < 0) j = 0;
+		if(j > QUATMAX) j = QUATMAX;
+		bits = bits<<15 | j;
+	}
+	dst[0] = bits;
+	dst[1] = bits>>16;
+	dst[2] = bits>>32;
+}
+
+static Quat
+unpackQuat(const uint16 *src)
+{
+	float32 c[4];
+	uint64 bits;
+	int32 i, largest;
+	float32 sum;
+
+	bits = (uint64)src[0] | (uint64)src[1]<<16 | (uint64)src[2]<<32;
+	largest = (bits>>45) & 3;
+	sum = 0.0f;
+	for(i = 3; i >= 0; i--){
+		if(i == largest)
+			continue;
+		c[i] = (bits & QUATMAX)*(2.0f*QUATRANGE/QUATMAX) - QUATRANGE;
+		sum += c[i]*c[i];
+		bits >>= 15;
+	}
+	c[largest] = sum < 1.0f ? sqrtf(1.0f - sum) : 0.0f;
+	return makeQuat(c[3], c[0], c[1], c[2]);
+}
+
+static void
+decodeTranslation(V3d *t, const uint16 *src, HAnimCompressedCustomData *cust)
+{
+	t->x = halfToFloat(src[0])*cust->scale.x + cust->offset.x;
+	t->y = halfToFloat(src[1])*cust->scale.y + cust->offset.y;
+	t->z = halfToFloat(src[2])*cust->scale.z + cust->offset.z;
+}
+
+static void
+hAnimCompressedFrameRead(Stream *stream, Animation *anim)
+{
+	HAnimCompressedKeyFrame *frames = (HAnimCompressedKeyFrame*)anim->keyframes;
+	for(int32 i = 0; i < anim->numFrames; i++){
+		frames[i].time = stream->readF32();
+		stream->read16(frames[i].q, 3*2);
+		stream->read16(frames[i].t, 3*2);
+		int32 prev = stream->readI32()/0x14;
+		frames[i].prev = &frames[prev];
+	}
+	stream->read32(anim->customData, sizeof(HAnimCompressedCustomData));
+}
+
+static void
+hAnimCompressedFrameWrite(Stream *stream, Animation *anim)
+{
+	HAnimCompressedKeyFrame *frames = (HAnimCompressedKeyFrame*)anim->keyframes;
+	for(int32 i = 0; i < anim->numFrames; i++){
+		stream->writeF32(frames[i].time);
+		stream->write16(frames[i].q, 3*2);
+		stream->write16(frames[i].t, 3*2);
+		stream->writeI32((frames[i].prev - frames)*0x14);
+	}
+	stream->write32(anim->customData, sizeof(HAnimCompressedCustomData));
+}
+
+static uint32
+hAnimCompressedFrameGetSize(Animation *anim)
+{
+	return anim->numFrames*(4 + 3*2 + 3*2 + 4) + sizeof(HAnimCompressedCustomData);
+}
+
+static void
+hanimCompressedInterpCB(void *vout, void *vin1, void *vin2, float32 t, void *custom)
+{
+	HAnimInterpFrame *out = (HAnimInterpFrame*)vout;
+	HAnimCompressedKeyFrame *in1 = (HAnimCompressedKeyFrame*)vin1;
+	HAnimCompressedKeyFrame *in2 = (HAnimCompressedKeyFrame*)vin2;
+	HAnimCompressedCustomData *cust = (HAnimCompressedCustomData*)custom;
+	V3d t1, t2;
+	assert(t >= in1->time && t <= in2->time);
+	float32 a = (t - in1->time)/(in2->time - in1->time);
+	decodeTranslation(&t1, in1->t, cust);
+	decodeTranslation(&t2, in2->t, cust);
+	out->t = lerp(t1, t2, a);
+	out->q = slerp(unpackQuat(in1->q), unpackQuat(in2->q), a);
+}
+
+Animation*
+compressHAnimAnimation(Animation *anim)
+{
+	HAnimKeyFrame *src;
+	HAnimCompressedKeyFrame *dst;
+	HAnimCompressedCustomData *cust;
+	Animation *canim;
+	V3d lo, hi;
+	int32 i;
+
+	if(anim->interpInfo->id != 1){
+		RWERROR((ERR_GENERAL, "not a standard HAnim animation"));
+		return nil;
+	}
+	canim = Animation::create(AnimInterpolatorInfo::find(HANIMCOMPRESSEDID),
+		anim->numFrames, anim->flags, anim->duration);
+	if(canim == nil)
+		return nil;
+	src = (HAnimKeyFrame*)anim->keyframes;
+	dst = (HAnimCompressedKeyFrame*)canim->keyframes;
+	cust = (HAnimCompressedCustomData*)canim->customData;
+
+	// map translations to [-1, 1]
+	lo = hi = anim->numFrames > 0 ? src[0].t : makeV3d(0.0f, 0.0f, 0.0f);
+	for(i = 1; i < anim->numFrames; i++){
+		if(src[i].t.x < lo.x) lo.x = src[i].t.x;
+		if(src[i].t.y < lo.y) lo.y = src[i].t.y;
+		if(src[i].t.z < lo.z) lo.z = src[i].t.z;
+		if(src[i].t.x > hi.x) hi.x = src[i].t.x;
+		if(src[i].t.y > hi.y) hi.y = src[i].t.y;
+		if(src[i].t.z > hi.z) hi.z = src[i].t.z;
+	}
+	cust->offset = scale(add(lo, hi), 0.5f);
+	cust->scale = scale(sub(hi, lo), 0.5f);
+	if(cust->scale.x == 0.0f) cust->scale.x = 1.0f;
+	if(cust->scale.y == 0.0f) cust->scale.y = 1.0f;
+	if(cust->scale.z == 0.0f) cust->scale.z = 1.0f;
+
+	for(i = 0; i < anim->numFrames; i++){
+		dst[i].time = src[i].time;
+		dst[i].prev = src[i].prev ? &dst[src[i].prev - src] : nil;
+		packQuat(dst[i].q, src[i].q);
+		dst[i].t[0] = floatToHalf((src[i].t.x - cust->offset.x)/cust->scale.x);
+		dst[i].t[1] = floatToHalf((src[i].t.y - cust->offset.y)/cust->scale.y);
+		dst[i].t[2] = floatToHalf((src[i].t.z - cust->offset.z)/cust->scale.z);
+	}
+	return canim;
+}
+
+Animation*
+decompressHAnimAnimation(Animation *canim)
+{
+	HAnimCompressedKeyFrame *src;
+	HAnimKeyFrame *dst;
+	HAnimCompressedCustomData *cust;
+	Animation *anim;
+	int32 i;
+
+	if(canim->interpInfo->id != HANIMCOMPRESSEDID){
+		RWERROR((ERR_GENERAL, "not a compressed HAnim animation"));
+		return nil;
+	}
+	anim = Animation::create(AnimInterpolatorInfo::find(1),
+		canim->numFrames, canim->flags, canim->duration);
+	if(anim == nil)
+		return nil;
+	src = (HAnimCompressedKeyFrame*)canim->keyframes;
+	dst = (HAnimKeyFrame*)anim->keyframes;
+	cust = (HAnimCompressedCustomData*)canim->customData;
+	for(i = 0; i < canim->numFrames; i++){
+		dst[i].time = src[i].time;
+		dst[i].prev = src[i].prev ? &dst[src[i].prev - src] : nil;
+		dst[i].q = unpackQuat(src[i].q);
+		decodeTranslation(&dst[i].t, src[i].t, cust);
+	}
+	return anim;
+}
+
 static void*
 hanimOpen(void *object, int32 offset, int32 size)
 {
@@ -387,6 +685,21 @@ hanimOpen(void *object, int32 offset, int32 size)
 	info->streamWrite = hAnimFrameWrite;
 	info->streamGetSize = hAnimFrameGetSize;
 	AnimInterpolatorInfo::registerInterp(info);
+
+	info = rwNewT(AnimInterpolatorInfo, 1, MEMDUR_GLOBAL | ID_HANIM);
+	info->id = HANIMCOMPRESSEDID;
+	info->interpKeyFrameSize = sizeof(HAnimInterpFrame);
+	info->animKeyFrameSize = sizeof(HAnimCompressedKeyFrame);
+	info->customDataSize = sizeof(HAnimCompressedCustomData);
+	info->applyCB = hanimApplyCB;
+	info->blendCB = nil;
+	info->interpCB = hanimCompressedInterpCB;
+	info->addCB = nil;
+	info->mulRecipCB = nil;
+	info->streamRead = hAnimCompressedFrameRead;
+	info->streamWrite = hAnimCompressedFrameWrite;
+	info->streamGetSize = hAnimCompressedFrameGetSize;
+	AnimInterpolatorInfo::registerInterp(info);
 	return object;
 }
 
@@ -394,6 +707,7 @@ static void*
 hanimClose(void *object, int32 offset, int32 size)
 {
 	AnimInterpolatorInfo::unregisterInterp(AnimInterpolatorInfo::find(1));
+	AnimInterpolatorInfo::unregisterInterp(AnimInterpolatorInfo::find(HANIMCOMPRESSEDID));
 	return object;
 }
 
@@ -14,12 +14,13 @@
 #include "d3d/rwxbox.h"
 #include "d3d/rwd3d8.h"
 #include "d3d/rwd3d9.h"
+#include "rwsimdimpl.h"
 
 #define PLUGIN_ID ID_IMAGE
 
 namespace rw {
 
-int32 Image::numAllocated;
+atomic32 Image::numAllocated;
 
 struct FileAssociation
 {
@@ -34,6 +35,14 @@ struct ImageGlobals
 	int numSearchPaths;
 	FileAssociation fileFormats[10];
 	int numFileFormats;
+	int32 numDXTThreads;
+	int32 dxtFit;
+	int32 mipFilter;
+	float32 mipGamma;
+	int32 mipAlphaRef;
+	int32 quantRefine;
+	bool32 quantDither;
+	int32 numQuantThreads;
 };
 int32 imageModuleOffset;
 
@@ -111,216 +120,644 @@ Image::setPixels(uint8 *pixels)
 	this->flags |= 1;
 }
 
-void
-decompressDXT1(uint8 *adst, int32 w, int32 h, uint8 *src)
+//
+// DXT decompression.
+// Blocks are decoded straight into the 32 bit image a row of blocks
+// at a time, big images split their rows across threads.
+// Width and height are multiples of 4 (callers pad small levels).
+//
+
+#define DXTROWSPERJOB 16	// rows of blocks
+#define DXTMINPARALLEL (256*256)	// don't bother with threads below this
+
+// the four colors of a color block as RGBA
+static void
+dxtColors(uint8 c[4][4], uint8 *src, bool32 fourColor)
 {
-	/* j loops through old texels
-	 * x and y loop through new texels */
-	int32 x = 0, y = 0;
-	uint32 c[4][4];
-	uint8 idx[16];
-	uint8 (*dst)[4] = (uint8(*)[4])adst;
-	for(int32 j = 0; j < w*h/2; j += 8){
-		/* calculate colors */
-		uint32 col0 = *((uint16*)&src[j+0]);
-		uint32 col1 = *((uint16*)&src[j+2]);
-		c[0][0] = ((col0>>11) & 0x1F)*0xFF/0x1F;
-		c[0][1] = ((col0>> 5) & 0x3F)*0xFF/0x3F;
-		c[0][2] = ( col0      & 0x1F)*0xFF/0x1F;
-		c[0][3] = 0xFF;
-
-		c[1][0] = ((col1>>11) & 0x1F)*0xFF/0x1F;
-		c[1][1] = ((col1>> 5) & 0x3F)*0xFF/0x3F;
-		c[1][2] = ( col1      & 0x1F)*0xFF/0x1F;
-		c[1][3] = 0xFF;
-		if(col0 > col1){
-			c[2][0] = (2*c[0][0] + 1*c[1][0])/3;
-			c[2][1] = (2*c[0][1] + 1*c[1][1])/3;
-			c[2][2] = (2*c[0][2] + 1*c[1][2])/3;
-			c[2][3] = 0xFF;
-
-			c[3][0] = (1*c[0][0] + 2*c[1][0])/3;
-			c[3][1] = (1*c[0][1] + 2*c[1][1])/3;
-			c[3][2] = (1*c[0][2] + 2*c[1][2])/3;
-			c[3][3] = 0xFF;
-		}else{
-			c[2][0] = (c[0][0] + c[1][0])/2;
-			c[2][1] = (c[0][1] + c[1][1])/2;
-			c[2][2] = (c[0][2] + c[1][2])/2;
-			c[2][3] = 0xFF;
-
-			c[3][0] = 0x00;
-			c[3][1] = 0x00;
-			c[3][2] = 0x00;
-			c[3][3] = 0x00;
-		}
+	uint32 col0 = *((uint16*)&src[0]);
+	uint32 col1 = *((uint16*)&src[2]);
+	c[0][0] = ((col0>>11) & 0x1F)*0xFF/0x1F;
+	c[0][1] = ((col0>> 5) & 0x3F)*0xFF/0x3F;
+	c[0][2] = ( col0      & 0x1F)*0xFF/0x1F;
+	c[0][3] = 0xFF;
+
+	c[1][0] = ((col1>>11) & 0x1F)*0xFF/0x1F;
+	c[1][1] = ((col1>> 5) & 0x3F)*0xFF/0x3F;
+	c[1][2] = ( col1      & 0x1F)*0xFF/0x1F;
+	c[1][3] = 0xFF;
+	if(fourColor || col0 > col1){
+		c[2][0] = (2*c[0][0] + 1*c[1][0])/3;
+		c[2][1] = (2*c[0][1] + 1*c[1][1])/3;
+		c[2][2] = (2*c[0][2] + 1*c[1][2])/3;
+		c[2][3] = 0xFF;
+
+		c[3][0] = (1*c[0][0] + 2*c[1][0])/3;
+		c[3][1] = (1*c[0][1] + 2*c[1][1])/3;
+		c[3][2] = (1*c[0][2] + 2*c[1][2])/3;
+		c[3][3] = 0xFF;
+	}else{
+		c[2][0] = (c[0][0] + c[1][0])/2;
+		c[2][1] = (c[0][1] + c[1][1])/2;
+		c[2][2] = (c[0][2] + c[1][2])/2;
+		c[2][3] = 0xFF;
+
+		c[3][0] = 0x00;
+		c[3][1] = 0x00;
+		c[3][2] = 0x00;
+		c[3][3] = 0x00;
+	}
+}
+
+// the eight alphas of a DXT5 alpha block
+static void
+dxtAlphaRamp(uint8 ramp[8], uint8 a0, uint8 a1)
+{
+	ramp[0] = a0;
+	ramp[1] = a1;
+	if(a0 > a1){
+		ramp[2] = (6*a0 + 1*a1)/7;
+		ramp[3] = (5*a0 + 2*a1)/7;
+		ramp[4] = (4*a0 + 3*a1)/7;
+		ramp[5] = (3*a0 + 4*a1)/7;
+		ramp[6] = (2*a0 + 5*a1)/7;
+		ramp[7] = (1*a0 + 6*a1)/7;
+	}else{
+		ramp[2] = (4*a0 + 1*a1)/5;
+		ramp[3] = (3*a0 + 2*a1)/5;
+		ramp[4] = (2*a0 + 3*a1)/5;
+		ramp[5] = (1*a0 + 4*a1)/5;
+		ramp[6] = 0;
+		ramp[7] = 0xFF;
+	}
+}
 
-		/* make index list */
-		uint32 indices = *((uint32*)&src[j+4]);
-		for(int32 k = 0; k < 16; k++){
-			idx[k] = indices & 0x3;
+// write one 4x4 block, alpha comes from a if not nil
+static void
+dxtWriteBlock(uint8 *dst, int32 stride, uint8 c[4][4], uint32 indices, uint8 *a)
+{
+#if defined(RW_SIMD) && !defined(BIGENDIAN)
+	// select all four pixels of a row at once by comparing their indices
+	static const uint32 idxMask[4] = { 3, 3<<2, 3<<4, 3<<6 };
+	static const uint32 idx1[4] = { 1, 1<<2, 1<<4, 1<<6 };
+	static const uint32 idx2[4] = { 2, 2<<2, 2<<4, 2<<6 };
+	static const uint32 idx3[4] = { 3, 3<<2, 3<<4, 3<<6 };
+	ivec4 m = iload(idxMask);
+	ivec4 i1 = iload(idx1);
+	ivec4 i2 = iload(idx2);
+	ivec4 i3 = iload(idx3);
+	ivec4 c0 = isplat(*(uint32*)c[0]);
+	ivec4 c1 = isplat(*(uint32*)c[1]);
+	ivec4 c2 = isplat(*(uint32*)c[2]);
+	ivec4 c3 = isplat(*(uint32*)c[3]);
+	ivec4 zero = isplat(0);
+	ivec4 rgb = isplat(0xFFFFFF);
+	for(int32 l = 0; l < 4; l++){
+		ivec4 i = iand(isplat(indices >> l*8), m);
+		ivec4 px = ior(ior(iand(icmpeq(i, zero), c0), iand(icmpeq(i, i1), c1)),
+		               ior(iand(icmpeq(i, i2), c2), iand(icmpeq(i, i3), c3)));
+		if(a)
+			px = ior(iand(px, rgb), ibytestop(&a[l*4]));
+		istore(dst + l*stride, px);
+	}
+#else
+	for(int32 l = 0; l < 4; l++)
+		for(int32 k = 0; k < 4; k++){
+			uint8 *col = c[indices & 3];
+			dst[l*stride + k*4 + 0] = col[0];
+			dst[l*stride + k*4 + 1] = col[1];
+			dst[l*stride + k*4 + 2] = col[2];
+			dst[l*stride + k*4 + 3] = a ? a[l*4+k] : col[3];
 			indices >>= 2;
 		}
+#endif
+}
+
+// decode one row of blocks
+static void
+dxtDecodeRow(int32 type, uint8 *dst, int32 w, uint8 *src)
+{
+	uint8 c[4][4];
+	uint8 a[16];
+	uint8 ramp[8];
+	int32 stride = w*4;
+	int32 k;
+
+	for(int32 x = 0; x < w; x += 4, dst += 16){
+		switch(type){
+		case 1:
+			dxtColors(c, src, 0);
+			dxtWriteBlock(dst, stride, c, *((uint32*)&src[4]), nil);
+			src += 8;
+			break;
+
+		case 3: {
+			dxtColors(c, src+8, 1);
+			for(k = 0; k < 8; k++){
+				a[k*2+0] = (src[k] & 0xF)*17;
+				a[k*2+1] = (src[k] >> 4)*17;
+			}
+			dxtWriteBlock(dst, stride, c, *((uint32*)&src[12]), a);
+			src += 16;
+			break;
+		}
 
-		/* write bytes */
-		for(uint32 l = 0; l < 4; l++)
-			for(uint32 k = 0; k < 4; k++){
-				dst[(y+l)*w + x+k][0] = c[idx[l*4+k]][0];
-				dst[(y+l)*w + x+k][1] = c[idx[l*4+k]][1];
-				dst[(y+l)*w + x+k][2] = c[idx[l*4+k]][2];
-				dst[(y+l)*w + x+k][3] = c[idx[l*4+k]][3];
+		case 5: {
+			dxtColors(c, src+8, 0);
+			dxtAlphaRamp(ramp, src[0], src[1]);
+			// only 6 bytes of indices
+			uint64 alphas = *((uint64*)&src[2]);
+			for(k = 0; k < 16; k++){
+				a[k] = ramp[alphas & 0x7];
+				alphas >>= 3;
 			}
-		x += 4;
-		if(x >= w){
-			y += 4;
-			x = 0;
+			dxtWriteBlock(dst, stride, c, *((uint32*)&src[12]), a);
+			src += 16;
+			break;
+		}
 		}
 	}
 }
 
+struct DXTJob
+{
+	int32 type;
+	uint8 *dst;
+	int32 w, h;
+	uint8 *src;
+};
+
+static void
+dxtDecodeJob(int32 i, void *data)
+{
+	DXTJob *job = (DXTJob*)data;
+	int32 blockSize = job->type == 1 ? 8 : 16;
+	int32 srcStride = job->w/4 * blockSize;
+	int32 rows = job->h/4;
+	int32 row = i*DXTROWSPERJOB;
+	int32 end = row + DXTROWSPERJOB;
+	if(end > rows)
+		end = rows;
+	for(; row < end; row++)
+		dxtDecodeRow(job->type, job->dst + row*4*job->w*4, job->w, job->src + row*srcStride);
+}
+
+static void
+decompressDXT(int32 type, uint8 *dst, int32 w, int32 h, uint8 *src)
+{
+	DXTJob job;
+	int32 numThreads;
+
+	job.type = type;
+	job.dst = dst;
+	job.w = w;
+	job.h = h;
+	job.src = src;
+	numThreads = w*h < DXTMINPARALLEL ? 1 : IMAGEGLOBAL(numDXTThreads);
+	parallelFor((h/4 + DXTROWSPERJOB-1)/DXTROWSPERJOB, numThreads, dxtDecodeJob, &job);
+}
+
+void
+decompressDXT1(uint8 *adst, int32 w, int32 h, uint8 *src)
+{
+	decompressDXT(1, adst, w, h, src);
+}
+
 void
 decompressDXT3(uint8 *adst, int32 w, int32 h, uint8 *src)
 {
-	/* j loops through old texels
-	 * x and y loop through new texels */
-	int32 x = 0, y = 0;
-	uint32 c[4][4];
-	uint8 idx[16];
+	decompressDXT(3, adst, w, h, src);
+}
+
+void
+decompressDXT5(uint8 *adst, int32 w, int32 h, uint8 *src)
+{
+	decompressDXT(5, adst, w, h, src);
+}
+
+//
+// DXT compression.
+// Range fit puts the endpoints at the extreme colors along the principal
+// axis of a block, cluster fit tries every ordered split of the colors over
+// the palette entries and solves for the endpoints of each split.
+// Either way the indices are fit against the palette as it decodes.
+//
+
+struct DXTBlock
+{
+	float32 r[16], g[16], b[16];
 	uint8 a[16];
-	uint8 (*dst)[4] = (uint8(*)[4])adst;
-	for(int32 j = 0; j < w*h; j += 16){
-		/* calculate colors */
-		uint32 col0 = *((uint16*)&src[j+8]);
-		uint32 col1 = *((uint16*)&src[j+10]);
-		c[0][0] = ((col0>>11) & 0x1F)*0xFF/0x1F;
-		c[0][1] = ((col0>> 5) & 0x3F)*0xFF/0x3F;
-		c[0][2] = ( col0      & 0x1F)*0xFF/0x1F;
-
-		c[1][0] = ((col1>>11) & 0x1F)*0xFF/0x1F;
-		c[1][1] = ((col1>> 5) & 0x3F)*0xFF/0x3F;
-		c[1][2] = ( col1      & 0x1F)*0xFF/0x1F;
+	uint32 transparent;	// DXT1 pixels that get index 3, one bit each
+};
 
-		c[2][0] = (2*c[0][0] + 1*c[1][0])/3;
-		c[2][1] = (2*c[0][1] + 1*c[1][1])/3;
-		c[2][2] = (2*c[0][2] + 1*c[1][2])/3;
+struct DXTEncodeJob
+{
+	int32 type;
+	int32 fit;
+	Image *img;
+	uint8 *dst;
+};
 
-		c[3][0] = (1*c[0][0] + 2*c[1][0])/3;
-		c[3][1] = (1*c[0][1] + 2*c[1][1])/3;
-		c[3][2] = (1*c[0][2] + 2*c[1][2])/3;
+// principal axis of the points by power iteration on their covariance
+static void
+dxtPrincipalAxis(float32 (*pts)[3], int32 n, float32 axis[3])
+{
+	float32 mean[3] = { 0.0f, 0.0f, 0.0f };
+	float32 cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	float32 d[3], v[3], m;
+	int32 i;
 
-		/* make index list */
-		uint32 indices = *((uint32*)&src[j+12]);
-		for(int32 k = 0; k < 16; k++){
-			idx[k] = indices & 0x3;
-			indices >>= 2;
+	for(i = 0; i < n; i++){
+		mean[0] += pts[i][0];
+		mean[1] += pts[i][1];
+		mean[2] += pts[i][2];
+	}
+	mean[0] /= n;
+	mean[1] /= n;
+	mean[2] /= n;
+	for(i = 0; i < n; i++){
+		d[0] = pts[i][0] - mean[0];
+		d[1] = pts[i][1] - mean[1];
+		d[2] = pts[i][2] - mean[2];
+		cov[0] += d[0]*d[0];
+		cov[1] += d[0]*d[1];
+		cov[2] += d[0]*d[2];
+		cov[3] += d[1]*d[1];
+		cov[4] += d[1]*d[2];
+		cov[5] += d[2]*d[2];
+	}
+	axis[0] = axis[1] = axis[2] = 1.0f;
+	for(i = 0; i < 8; i++){
+		v[0] = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+		v[1] = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+		v[2] = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+		m = fabsf(v[0]);
+		if(fabsf(v[1]) > m) m = fabsf(v[1]);
+		if(fabsf(v[2]) > m) m = fabsf(v[2]);
+		// all points are the same
+		if(m < 1.0e-6f)
+			break;
+		axis[0] = v[0]/m;
+		axis[1] = v[1]/m;
+		axis[2] = v[2]/m;
+	}
+}
+
+static int32
+dxtQuantize(float32 x, int32 max)
+{
+	if(x <= 0.0f) return 0;
+	if(x >= 255.0f) return max;
+	return (int32)(x*max/255.0f + 0.5f);
+}
+
+static uint32
+dxtTo565(float32 *c)
+{
+	return dxtQuantize(c[0], 31)<<11 | dxtQuantize(c[1], 63)<<5 | dxtQuantize(c[2], 31);
+}
+
+// nearest of the first numEntries colors for every pixel, returns the error
+static float32
+dxtFitIndices(DXTBlock *blk, uint8 c[4][4], int32 numEntries, uint32 *pIndices)
+{
+	float32 best[16], idx[16];
+	float32 err;
+	uint32 indices;
+	int32 i, k;
+
+#ifdef RW_SIMD
+	// four pixels at a time
+	for(i = 0; i < 16; i += 4){
+		vec4 r = vload(&blk->r[i]);
+		vec4 g = vload(&blk->g[i]);
+		vec4 b = vload(&blk->b[i]);
+		vec4 vbest = vzero();
+		vec4 vidx = vzero();
+		for(k = 0; k < numEntries; k++){
+			vec4 dr = vsub(r, vsplat(c[k][0]));
+			vec4 dg = vsub(g, vsplat(c[k][1]));
+			vec4 db = vsub(b, vsplat(c[k][2]));
+			vec4 d = vadd(vadd(vmul(dr, dr), vmul(dg, dg)), vmul(db, db));
+			if(k == 0){
+				vbest = d;
+				continue;
+			}
+			vec4 m = vcmplt(d, vbest);
+			vbest = vsel(m, d, vbest);
+			vidx = vsel(m, vsplat(k), vidx);
 		}
-		uint64 alphas = *((uint64*)&src[j+0]);
-		for(int32 k = 0; k < 16; k++){
-			a[k] = (alphas & 0xF)*17;
-			alphas >>= 4;
+		vstore(&best[i], vbest);
+		vstore(&idx[i], vidx);
+	}
+#else
+	for(i = 0; i < 16; i++){
+		for(k = 0; k < numEntries; k++){
+			float32 dr = blk->r[i] - c[k][0];
+			float32 dg = blk->g[i] - c[k][1];
+			float32 db = blk->b[i] - c[k][2];
+			float32 d = dr*dr + dg*dg + db*db;
+			if(k == 0 || d < best[i]){
+				best[i] = d;
+				idx[i] = k;
+			}
 		}
+	}
+#endif
 
-		/* write bytes */
-		for(uint32 l = 0; l < 4; l++)
-			for(uint32 k = 0; k < 4; k++){
-				dst[(y+l)*w + x+k][0] = c[idx[l*4+k]][0];
-				dst[(y+l)*w + x+k][1] = c[idx[l*4+k]][1];
-				dst[(y+l)*w + x+k][2] = c[idx[l*4+k]][2];
-				dst[(y+l)*w + x+k][3] = a[l*4+k];
-			}
-		x += 4;
-		if(x >= w){
-			y += 4;
-			x = 0;
+	err = 0.0f;
+	indices = 0;
+	for(i = 0; i < 16; i++){
+		if(blk->transparent & 1<<i){
+			indices |= 3 << i*2;
+			continue;
 		}
+		indices |= (uint32)idx[i] << i*2;
+		err += best[i];
 	}
+	*pIndices = indices;
+	return err;
 }
 
-void
-decompressDXT5(uint8 *adst, int32 w, int32 h, uint8 *src)
+// Write the color block for two endpoints and return its error.
+// Three color mode is needed for transparent pixels in DXT1.
+static float32
+dxtTryColors(uint8 *dst, DXTBlock *blk, int32 type, uint32 e0, uint32 e1, bool32 threeColor)
 {
-	/* j loops through old texels
-	 * x and y loop through new texels */
-	int32 x = 0, y = 0;
-	uint32 c[4][4];
-	uint32 a[8];
-	uint8 idx[16];
-	uint8 aidx[16];
-	uint8 (*dst)[4] = (uint8(*)[4])adst;
-	for(int32 j = 0; j < w*h; j += 16){
-		/* calculate colors */
-		uint32 col0 = *((uint16*)&src[j+8]);
-		uint32 col1 = *((uint16*)&src[j+10]);
-		c[0][0] = ((col0>>11) & 0x1F)*0xFF/0x1F;
-		c[0][1] = ((col0>> 5) & 0x3F)*0xFF/0x3F;
-		c[0][2] = ( col0      & 0x1F)*0xFF/0x1F;
-
-		c[1][0] = ((col1>>11) & 0x1F)*0xFF/0x1F;
-		c[1][1] = ((col1>> 5) & 0x3F)*0xFF/0x3F;
-		c[1][2] = ( col1      & 0x1F)*0xFF/0x1F;
-		if(col0 > col1){
-			c[2][0] = (2*c[0][0] + 1*c[1][0])/3;
-			c[2][1] = (2*c[0][1] + 1*c[1][1])/3;
-			c[2][2] = (2*c[0][2] + 1*c[1][2])/3;
-
-			c[3][0] = (1*c[0][0] + 2*c[1][0])/3;
-			c[3][1] = (1*c[0][1] + 2*c[1][1])/3;
-			c[3][2] = (1*c[0][2] + 2*c[1][2])/3;
-		}else{
-			c[2][0] = (c[0][0] + c[1][0])/2;
-			c[2][1] = (c[0][1] + c[1][1])/2;
-			c[2][2] = (c[0][2] + c[1][2])/2;
+	uint8 c[4][4];
+	uint32 indices, t;
+	float32 err;
+
+	// DXT3 always decodes four colors
+	if(type == 3)
+		threeColor = 0;
+	if(threeColor ? e0 > e1 : e0 < e1){
+		t = e0;
+		e0 = e1;
+		e1 = t;
+	}
+	*(uint16*)&dst[0] = e0;
+	*(uint16*)&dst[2] = e1;
+	dxtColors(c, dst, type == 3);
+	// the fourth DXT1 color is transparent in three color mode
+	err = dxtFitIndices(blk, c, type != 1 || e0 > e1 ? 4 : 3, &indices);
+	*(uint32*)&dst[4] = indices;
+	return err;
+}
 
-			c[3][0] = 0x00;
-			c[3][1] = 0x00;
-			c[3][2] = 0x00;
-		}
+// Endpoints for the best split of the points, sorted along the axis,
+// into runs that map to the palette entries in order.
+// Leaves start and end alone if no split is better.
+static void
+dxtClusterFit(float32 (*pts)[3], int32 n, int32 numColors, float32 start[3], float32 end[3])
+{
+	float32 sums[17][3];
+	float32 a[3], b[3];
+	float32 alpha2, beta2, ab, det, ax, bx, err, bestErr;
+	float32 s0, s1, s2, s3;
+	int32 i, j, k, c;
+
+	sums[0][0] = sums[0][1] = sums[0][2] = 0.0f;
+	for(i = 0; i < n; i++){
+		sums[i+1][0] = sums[i][0] + pts[i][0];
+		sums[i+1][1] = sums[i][1] + pts[i][1];
+		sums[i+1][2] = sums[i][2] + pts[i][2];
+	}
 
-		a[0] = src[j+0];
-		a[1] = src[j+1];
-		if(a[0] > a[1]){
-			a[2] = (6*a[0] + 1*a[1])/7;
-			a[3] = (5*a[0] + 2*a[1])/7;
-			a[4] = (4*a[0] + 3*a[1])/7;
-			a[5] = (3*a[0] + 4*a[1])/7;
-			a[6] = (2*a[0] + 5*a[1])/7;
-			a[7] = (1*a[0] + 6*a[1])/7;
+	bestErr = 1.0e30f;
+	for(i = 0; i <= n; i++)
+	for(j = i; j <= n; j++)
+	for(k = numColors == 4 ? j : n; k <= n; k++){
+		// runs [0,i) [i,j) [j,k) [k,n) weigh start by 1, 2/3, 1/3, 0
+		// or with three colors [0,i) [i,j) [j,n) by 1, 1/2, 0
+		if(numColors == 4){
+			alpha2 = i + (j-i)*(4.0f/9.0f) + (k-j)*(1.0f/9.0f);
+			beta2 = (n-k) + (k-j)*(4.0f/9.0f) + (j-i)*(1.0f/9.0f);
+			ab = (k-i)*(2.0f/9.0f);
 		}else{
-			a[2] = (4*a[0] + 1*a[1])/5;
-			a[3] = (3*a[0] + 2*a[1])/5;
-			a[4] = (2*a[0] + 3*a[1])/5;
-			a[5] = (1*a[0] + 4*a[1])/5;
-			a[6] = 0;
-			a[7] = 0xFF;
+			alpha2 = i + (j-i)*0.25f;
+			beta2 = (n-j) + (j-i)*0.25f;
+			ab = (j-i)*0.25f;
+		}
+		det = alpha2*beta2 - ab*ab;
+		// everything in one run
+		if(det < 1.0e-3f)
+			continue;
+		err = 0.0f;
+		for(c = 0; c < 3; c++){
+			s0 = sums[i][c];
+			s1 = sums[j][c] - sums[i][c];
+			s2 = sums[k][c] - sums[j][c];
+			s3 = sums[n][c] - sums[k][c];
+			if(numColors == 4){
+				ax = s0 + s1*(2.0f/3.0f) + s2*(1.0f/3.0f);
+				bx = s3 + s2*(2.0f/3.0f) + s1*(1.0f/3.0f);
+			}else{
+				ax = s0 + s1*0.5f;
+				bx = s3 + s1*0.5f;
+			}
+			a[c] = (ax*beta2 - bx*ab)/det;
+			b[c] = (bx*alpha2 - ax*ab)/det;
+			err += a[c]*a[c]*alpha2 + b[c]*b[c]*beta2 + 2.0f*a[c]*b[c]*ab -
+				2.0f*(a[c]*ax + b[c]*bx);
+		}
+		if(err < bestErr){
+			bestErr = err;
+			start[0] = a[0]; start[1] = a[1]; start[2] = a[2];
+			end[0] = b[0]; end[1] = b[1]; end[2] = b[2];
 		}
+	}
+}
 
-		/* make index list */
-		uint32 indices = *((uint32*)&src[j+12]);
-		for(int32 k = 0; k < 16; k++){
-			idx[k] = indices & 0x3;
-			indices >>= 2;
+static void
+dxtCompressColors(uint8 *dst, DXTBlock *blk, int32 type, int32 fit)
+{
+	float32 pts[16][3], sorted[16][3];
+	float32 proj[16];
+	float32 axis[3], start[3], end[3], start3[3], end3[3];
+	float32 err, bestErr, p;
+	int32 order[16];
+	uint8 tmp[8];
+	bool32 threeColor;
+	int32 i, j, n, lo, hi, t;
+
+	n = 0;
+	for(i = 0; i < 16; i++)
+		if((blk->transparent & 1<<i) == 0){
+			pts[n][0] = blk->r[i];
+			pts[n][1] = blk->g[i];
+			pts[n][2] = blk->b[i];
+			n++;
 		}
-		// only 6 indices
-		uint64 alphas = *((uint64*)&src[j+2]);
-		for(int32 k = 0; k < 16; k++){
-			aidx[k] = alphas & 0x7;
-			alphas >>= 3;
+	if(n == 0){
+		*(uint16*)&dst[0] = 0;
+		*(uint16*)&dst[2] = 0;
+		*(uint32*)&dst[4] = 0xFFFFFFFF;
+		return;
+	}
+	threeColor = blk->transparent != 0;
+
+	dxtPrincipalAxis(pts, n, axis);
+	lo = hi = 0;
+	for(i = 0; i < n; i++){
+		proj[i] = pts[i][0]*axis[0] + pts[i][1]*axis[1] + pts[i][2]*axis[2];
+		if(proj[i] < proj[lo]) lo = i;
+		if(proj[i] > proj[hi]) hi = i;
+	}
+	memcpy(start, pts[hi], sizeof(start));
+	memcpy(end, pts[lo], sizeof(end));
+	bestErr = dxtTryColors(dst, blk, type, dxtTo565(start), dxtTo565(end), threeColor);
+	if(fit != Image::DXTCLUSTERFIT || bestErr == 0.0f)
+		return;
+
+	// sort along the axis, start end first
+	for(i = 0; i < n; i++){
+		p = proj[i];
+		for(j = i; j > 0 && proj[order[j-1]] < p; j--)
+			order[j] = order[j-1];
+		order[j] = i;
+	}
+	for(i = 0; i < n; i++){
+		t = order[i];
+		sorted[i][0] = pts[t][0];
+		sorted[i][1] = pts[t][1];
+		sorted[i][2] = pts[t][2];
+	}
+	memcpy(start3, start, sizeof(start));
+	memcpy(end3, end, sizeof(end));
+	if(!threeColor){
+		dxtClusterFit(sorted, n, 4, start, end);
+		err = dxtTryColors(tmp, blk, type, dxtTo565(start), dxtTo565(end), 0);
+		if(err < bestErr){
+			bestErr = err;
+			memcpy(dst, tmp, 8);
 		}
+	}
+	// opaque DXT1 blocks can do better with three colors too
+	if(type == 1){
+		dxtClusterFit(sorted, n, 3, start3, end3);
+		err = dxtTryColors(tmp, blk, type, dxtTo565(start3), dxtTo565(end3), 1);
+		if(err < bestErr)
+			memcpy(dst, tmp, 8);
+	}
+}
+
+static void
+dxtCompressAlpha3(uint8 *dst, uint8 *a)
+{
+	for(int32 k = 0; k < 8; k++)
+		dst[k] = (a[k*2+0]+8)/17 | (a[k*2+1]+8)/17 << 4;
+}
 
-		/* write bytes */
-		for(uint32 l = 0; l < 4; l++)
-			for(uint32 k = 0; k < 4; k++){
-				dst[(y+l)*w + x+k][0] = c[idx[l*4+k]][0];
-				dst[(y+l)*w + x+k][1] = c[idx[l*4+k]][1];
-				dst[(y+l)*w + x+k][2] = c[idx[l*4+k]][2];
-				dst[(y+l)*w + x+k][3] = a[aidx[l*4+k]];
+// write the DXT5 alpha block for two endpoints, returns the error
+static int32
+dxtTryAlpha(uint8 *dst, uint8 *a, int32 a0, int32 a1)
+{
+	uint8 ramp[8];
+	uint64 indices;
+	int32 i, k, d, best, bestd, err;
+
+	dxtAlphaRamp(ramp, a0, a1);
+	indices = 0;
+	err = 0;
+	for(i = 0; i < 16; i++){
+		best = 0;
+		bestd = abs(a[i] - ramp[0]);
+		for(k = 1; k < 8; k++){
+			d = abs(a[i] - ramp[k]);
+			if(d < bestd){
+				best = k;
+				bestd = d;
 			}
-		x += 4;
-		if(x >= w){
-			y += 4;
-			x = 0;
+		}
+		indices |= (uint64)best << i*3;
+		err += bestd*bestd;
+	}
+	dst[0] = a0;
+	dst[1] = a1;
+	for(i = 0; i < 6; i++)
+		dst[2+i] = indices >> i*8;
+	return err;
+}
+
+static void
+dxtCompressAlpha5(uint8 *dst, uint8 *a, int32 fit)
+{
+	uint8 tmp[8];
+	int32 i, lo, hi, lo6, hi6;
+	bool32 extremes;
+
+	lo = lo6 = 255;
+	hi = hi6 = 0;
+	extremes = 0;
+	for(i = 0; i < 16; i++){
+		if(a[i] < lo) lo = a[i];
+		if(a[i] > hi) hi = a[i];
+		if(a[i] == 0 || a[i] == 255)
+			extremes = 1;
+		else{
+			if(a[i] < lo6) lo6 = a[i];
+			if(a[i] > hi6) hi6 = a[i];
 		}
 	}
+	// eight alphas between the extremes
+	if(dxtTryAlpha(dst, a, hi, lo) == 0 || fit != Image::DXTCLUSTERFIT || !extremes)
+		return;
+	// or six and explicit 0 and 255
+	if(lo6 > hi6)
+		lo6 = hi6 = 0;
+	if(dxtTryAlpha(tmp, a, lo6, hi6) < dxtTryAlpha(dst, a, hi, lo))
+		memcpy(dst, tmp, 8);
+}
+
+static void
+dxtEncodeJob(int32 i, void *data)
+{
+	DXTEncodeJob *job = (DXTEncodeJob*)data;
+	Image *img = job->img;
+	DXTBlock blk;
+	uint8 *dst, *p;
+	int32 bw = (img->width+3)/4;
+	int32 bh = (img->height+3)/4;
+	int32 blockSize = job->type == 1 ? 8 : 16;
+	int32 bx, by, x, y, l, k, j;
+
+	int32 end = (i+1)*DXTROWSPERJOB;
+	if(end > bh)
+		end = bh;
+	for(by = i*DXTROWSPERJOB; by < end; by++)
+		for(bx = 0; bx < bw; bx++){
+			dst = job->dst + (by*bw + bx)*blockSize;
+			blk.transparent = 0;
+			for(l = 0; l < 4; l++)
+				for(k = 0; k < 4; k++){
+					// repeat the last row and column in partial blocks
+					x = bx*4 + k;
+					y = by*4 + l;
+					if(x >= img->width) x = img->width-1;
+					if(y >= img->height) y = img->height-1;
+					p = img->pixels + y*img->stride + x*4;
+					j = l*4 + k;
+					blk.r[j] = p[0];
+					blk.g[j] = p[1];
+					blk.b[j] = p[2];
+					blk.a[j] = p[3];
+					if(job->type == 1 && p[3] < 128)
+						blk.transparent |= 1<<j;
+				}
+			switch(job->type){
+			case 1:
+				dxtCompressColors(dst, &blk, 1, job->fit);
+				break;
+			case 3:
+				dxtCompressAlpha3(dst, blk.a);
+				dxtCompressColors(dst+8, &blk, 3, job->fit);
+				break;
+			case 5:
+				dxtCompressAlpha5(dst, blk.a, job->fit);
+				dxtCompressColors(dst+8, &blk, 5, job->fit);
+				break;
+			}
+		}
 }
 
 // not strictly image but related
@@ -559,6 +996,444 @@ Image::setPixelsDXT(int32 type, uint8 *pixels)
 	}
 }
 
+// Compress into DXT blocks
+void
+Image::getPixelsDXT(int32 type, uint8 *pixels)
+{
+	DXTEncodeJob job;
+	Image *img;
+	int32 numThreads;
+
+	img = this;
+	if(this->depth != 32){
+		img = Image::create(this->width, this->height, this->depth);
+		img->pixels = this->pixels;
+		img->stride = this->stride;
+		img->palette = this->palette;
+		img->convertTo32();
+	}
+	job.type = type;
+	job.fit = IMAGEGLOBAL(dxtFit);
+	job.img = img;
+	job.dst = pixels;
+	numThreads = img->width*img->height < DXTMINPARALLEL ? 1 : IMAGEGLOBAL(numDXTThreads);
+	parallelFor(((img->height+3)/4 + DXTROWSPERJOB-1)/DXTROWSPERJOB, numThreads, dxtEncodeJob, &job);
+	if(img != this)
+		img->destroy();
+}
+
+void Image::setNumDXTThreads(int32 n) { IMAGEGLOBAL(numDXTThreads) = n; }
+int32 Image::getNumDXTThreads(void) { return IMAGEGLOBAL(numDXTThreads); }
+void Image::setDXTFit(int32 fit) { IMAGEGLOBAL(dxtFit) = fit; }
+int32 Image::getDXTFit(void) { return IMAGEGLOBAL(dxtFit); }
+
+//
+// Mipmap generation.
+// Each level is filtered from the one above it in floating point.
+// Color is gamma decoded and weighted by alpha so transparent texels
+// don't bleed into their neighbours, the small floor on the weight
+// keeps the color of regions that are transparent altogether.
+// The filter is separable, a horizontal pass over the rows followed
+// by a vertical pass that blends whole rows.
+//
+
+#define MIPKAISERWIDTH 3.0f	// kernel radius in destination pixels
+#define MIPKAISERALPHA 4.0f
+#define MIPALPHAFLOOR (1.0f/256.0f)
+
+struct MipTaps
+{
+	int32 numTaps;
+	int32 *index;	// numTaps per destination pixel, clamped to the edge
+	float32 *weight;
+};
+
+static float32
+besselI0(float32 x)
+{
+	float32 sum, term;
+	sum = term = 1.0f;
+	for(int32 k = 1; k < 32 && term > sum*1e-7f; k++){
+		term *= (x/(2*k))*(x/(2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+static float32
+mipKernelWidth(int32 filter)
+{
+	switch(filter){
+	case Image::MIPBOX: return 0.5f;
+	case Image::MIPTRIANGLE: return 1.0f;
+	default: return MIPKAISERWIDTH;
+	}
+}
+
+static float32
+mipKernel(int32 filter, float32 x)
+{
+	float32 t, sinc;
+	if(x < 0.0f) x = -x;
+	switch(filter){
+	case Image::MIPBOX:
+		return x <= 0.5f ? 1.0f : 0.0f;
+	case Image::MIPTRIANGLE:
+		return x < 1.0f ? 1.0f - x : 0.0f;
+	default:
+		if(x >= MIPKAISERWIDTH)
+			return 0.0f;
+		t = x/MIPKAISERWIDTH;
+		sinc = x < 1e-5f ? 1.0f : sinf((float32)M_PI*x)/((float32)M_PI*x);
+		return sinc * besselI0(MIPKAISERALPHA*sqrtf(1.0f - t*t))/besselI0(MIPKAISERALPHA);
+	}
+}
+
+static void
+mipMakeTaps(MipTaps *taps, int32 filter, int32 srcN, int32 dstN)
+{
+	int32 i, k, first, idx;
+	float32 scale, support, center, sum;
+	float32 *w;
+
+	scale = (float32)srcN/dstN;
+	support = mipKernelWidth(filter)*scale;
+	taps->numTaps = (int32)ceilf(2.0f*support) + 1;
+	taps->index = rwNewT(int32, dstN*taps->numTaps, MEMDUR_FUNCTION | ID_IMAGE);
+	taps->weight = rwNewT(float32, dstN*taps->numTaps, MEMDUR_FUNCTION | ID_IMAGE);
+	for(i = 0; i < dstN; i++){
+		center = (i+0.5f)*scale - 0.5f;
+		first = (int32)ceilf(center - support);
+		w = &taps->weight[i*taps->numTaps];
+		sum = 0.0f;
+		for(k = 0; k < taps->numTaps; k++){
+			w[k] = mipKernel(filter, (first+k - center)/scale);
+			sum += w[k];
+			idx = first+k;
+			if(idx < 0) idx = 0;
+			if(idx >= srcN) idx = srcN-1;
+			taps->index[i*taps->numTaps + k] = idx;
+		}
+		for(k = 0; k < taps->numTaps; k++)
+			w[k] /= sum;
+	}
+}
+
+static void
+mipFreeTaps(MipTaps *taps)
+{
+	rwFree(taps->weight);
+	rwFree(taps->index);
+}
+
+// filter each row of src (srcW wide) into dst (dstW wide)
+static void
+mipFilterRows(float32 *dst, float32 *src, int32 srcW, int32 h, int32 dstW, MipTaps *taps)
+{
+	int32 x, y, k;
+	int32 *idx;
+	float32 *w;
+	for(y = 0; y < h; y++){
+		idx = taps->index;
+		w = taps->weight;
+		for(x = 0; x < dstW; x++){
+#ifdef RW_SIMD
+			vec4 acc = vzero();
+			for(k = 0; k < taps->numTaps; k++)
+				acc = vadd(acc, vmul(vload(&src[idx[k]*4]), vsplat(w[k])));
+			vstore(dst, acc);
+#else
+			dst[0] = dst[1] = dst[2] = dst[3] = 0.0f;
+			for(k = 0; k < taps->numTaps; k++){
+				dst[0] += src[idx[k]*4+0]*w[k];
+				dst[1] += src[idx[k]*4+1]*w[k];
+				dst[2] += src[idx[k]*4+2]*w[k];
+				dst[3] += src[idx[k]*4+3]*w[k];
+			}
+#endif
+			idx += taps->numTaps;
+			w += taps->numTaps;
+			dst += 4;
+		}
+		src += srcW*4;
+	}
+}
+
+// blend whole rows of src (w wide) into the rows of dst
+static void
+mipFilterColumns(float32 *dst, float32 *src, int32 w, int32 dstH, MipTaps *taps)
+{
+	int32 x, y, k, n;
+	float32 *s;
+	float32 wt;
+	n = w*4;
+	for(y = 0; y < dstH; y++){
+		memset(dst, 0, n*sizeof(float32));
+		for(k = 0; k < taps->numTaps; k++){
+			wt = taps->weight[y*taps->numTaps + k];
+			if(wt == 0.0f)
+				continue;
+			s = &src[taps->index[y*taps->numTaps + k]*n];
+#ifdef RW_SIMD
+			vec4 vw = vsplat(wt);
+			for(x = 0; x < n; x += 4)
+				vstore(&dst[x], vadd(vload(&dst[x]), vmul(vload(&s[x]), vw)));
+#else
+			for(x = 0; x < n; x++)
+				dst[x] += s[x]*wt;
+#endif
+		}
+		dst += n;
+	}
+}
+
+#define MIPLINEARSTEPS 4096
+
+struct MipGamma
+{
+	float32 toLinear[256];
+	uint8 lower[MIPLINEARSTEPS+1];	// first value at or above each step
+};
+
+static void
+mipMakeGamma(MipGamma *gam, float32 gamma)
+{
+	int32 i, j;
+	for(i = 0; i < 256; i++)
+		gam->toLinear[i] = powf(i/255.0f, gamma);
+	i = 0;
+	for(j = 0; j <= MIPLINEARSTEPS; j++){
+		while(i < 255 && gam->toLinear[i] < (float32)j/MIPLINEARSTEPS)
+			i++;
+		gam->lower[j] = i;
+	}
+}
+
+// nearest 8 bit value of a linear one
+static uint8
+mipFromLinear(MipGamma *gam, float32 c)
+{
+	int32 i;
+	if(c <= 0.0f) return 0;
+	if(c >= 1.0f) return 255;
+	i = gam->lower[(int32)(c*MIPLINEARSTEPS)];
+	while(i < 255 && gam->toLinear[i] < c)
+		i++;
+	if(i > 0 && c - gam->toLinear[i-1] < gam->toLinear[i] - c)
+		i--;
+	return i;
+}
+
+static void
+mipStore32(Image *img, float32 *src, MipGamma *gam)
+{
+	int32 x, y;
+	uint8 *line;
+	float32 a, wt;
+	for(y = 0; y < img->height; y++){
+		line = img->pixels + y*img->stride;
+		for(x = 0; x < img->width; x++){
+			a = src[3];
+			wt = a + MIPALPHAFLOOR;
+			if(wt < MIPALPHAFLOOR) wt = MIPALPHAFLOOR;
+			line[0] = mipFromLinear(gam, src[0]/wt);
+			line[1] = mipFromLinear(gam, src[1]/wt);
+			line[2] = mipFromLinear(gam, src[2]/wt);
+			line[3] = a <= 0.0f ? 0 : a >= 1.0f ? 255 : (uint8)(a*255.0f + 0.5f);
+			line += 4;
+			src += 4;
+		}
+	}
+}
+
+static int32
+mipCountAlpha(Image *img, int32 ref)
+{
+	int32 x, y, n;
+	n = 0;
+	for(y = 0; y < img->height; y++)
+		for(x = 0; x < img->width; x++)
+			n += img->pixels[y*img->stride + x*4 + 3] >= ref;
+	return n;
+}
+
+// scale alpha so the same fraction of texels passes the alpha test at ref
+static void
+mipScaleAlpha(Image *img, int32 ref, float32 coverage)
+{
+	int32 hist[256];
+	int32 x, y, t, n, target;
+	uint8 *a;
+
+	target = (int32)(coverage*img->width*img->height + 0.5f);
+	if(target == 0)
+		return;
+	memset(hist, 0, sizeof(hist));
+	for(y = 0; y < img->height; y++)
+		for(x = 0; x < img->width; x++)
+			hist[img->pixels[y*img->stride + x*4 + 3]]++;
+	n = 0;
+	for(t = 255; t > 0; t--){
+		n += hist[t];
+		if(n >= target)
+			break;
+	}
+	if(t == 0 || t == ref)
+		return;
+	for(y = 0; y < img->height; y++)
+		for(x = 0; x < img->width; x++){
+			a = &img->pixels[y*img->stride + x*4 + 3];
+			n = *a*ref/t;
+			*a = n > 255 ? 255 : n;
+		}
+}
+
+static int32
+mipFindColor(uint8 *palette, int32 numColors, uint8 *c)
+{
+	int32 i, best, dist, bestDist, d;
+	best = 0;
+	bestDist = 0x7FFFFFFF;
+	for(i = 0; i < numColors; i++){
+		d = palette[i*4+0] - c[0]; dist = d*d;
+		d = palette[i*4+1] - c[1]; dist += d*d;
+		d = palette[i*4+2] - c[2]; dist += d*d;
+		d = palette[i*4+3] - c[3]; dist += d*d;
+		if(dist < bestDist){
+			bestDist = dist;
+			best = i;
+		}
+	}
+	return best;
+}
+
+// convert a 32 bit level back to the depth of the top level
+static Image*
+mipConvert(Image *img, Image *top)
+{
+	Image *dst;
+	int32 x, y;
+	uint8 *in, *out;
+
+	if(top->depth == 32)
+		return img;
+	dst = Image::create(img->width, img->height, top->depth);
+	dst->allocate();
+	if(top->depth <= 8)
+		memcpy(dst->palette, top->palette, (1<<top->depth)*4);
+	for(y = 0; y < img->height; y++){
+		in = img->pixels + y*img->stride;
+		out = dst->pixels + y*dst->stride;
+		for(x = 0; x < img->width; x++){
+			switch(top->depth){
+			case 24:
+				out[0] = in[0];
+				out[1] = in[1];
+				out[2] = in[2];
+				break;
+			case 16:
+				out[0] = (in[1]&0xF8)<<2 | in[2]>>3;
+				out[1] = (in[3]&0x80) | (in[0]&0xF8)>>1 | in[1]>>6;
+				break;
+			default:
+				out[0] = mipFindColor(dst->palette, 1<<top->depth, in);
+				break;
+			}
+			in += 4;
+			out += dst->bpp;
+		}
+	}
+	img->destroy();
+	return dst;
+}
+
+int32
+Image::makeMipmaps(Image **levels, int32 maxLevels)
+{
+	ImageGlobals *g = PLUGINOFFSET(ImageGlobals, engine, imageModuleOffset);
+	MipGamma gam;
+	MipTaps htaps, vtaps;
+	Image *top, *img;
+	float32 *cur, *tmp, *next, *p;
+	float32 a, wt, coverage;
+	int32 numLevels, i, x, y, w, h, dw, dh;
+	uint8 *line;
+
+	levels[0] = this;
+	numLevels = Raster::calculateNumLevels(this->width, this->height);
+	if(numLevels > maxLevels)
+		numLevels = maxLevels;
+	if(numLevels <= 1)
+		return numLevels;
+
+	top = this;
+	if(this->depth != 32){
+		top = Image::create(this->width, this->height, this->depth);
+		top->pixels = this->pixels;
+		top->stride = this->stride;
+		top->palette = this->palette;
+		top->convertTo32();
+	}
+	mipMakeGamma(&gam, g->mipGamma);
+	coverage = 0.0f;
+	if(g->mipAlphaRef > 0 && this->hasAlpha() && this->hasCutoutAlpha())
+		coverage = (float32)mipCountAlpha(top, g->mipAlphaRef)/(top->width*top->height);
+
+	w = this->width;
+	h = this->height;
+	cur = rwNewT(float32, w*h*4, MEMDUR_FUNCTION | ID_IMAGE);
+	p = cur;
+	for(y = 0; y < h; y++){
+		line = top->pixels + y*top->stride;
+		for(x = 0; x < w; x++){
+			a = line[3]/255.0f;
+			wt = a + MIPALPHAFLOOR;
+			p[0] = gam.toLinear[line[0]]*wt;
+			p[1] = gam.toLinear[line[1]]*wt;
+			p[2] = gam.toLinear[line[2]]*wt;
+			p[3] = a;
+			line += 4;
+			p += 4;
+		}
+	}
+	if(top != this)
+		top->destroy();
+
+	for(i = 1; i < numLevels; i++){
+		dw = w > 1 ? w/2 : 1;
+		dh = h > 1 ? h/2 : 1;
+		mipMakeTaps(&htaps, g->mipFilter, w, dw);
+		mipMakeTaps(&vtaps, g->mipFilter, h, dh);
+		tmp = rwNewT(float32, dw*h*4, MEMDUR_FUNCTION | ID_IMAGE);
+		next = rwNewT(float32, dw*dh*4, MEMDUR_FUNCTION | ID_IMAGE);
+		mipFilterRows(tmp, cur, w, h, dw, &htaps);
+		mipFilterColumns(next, tmp, dw, dh, &vtaps);
+		rwFree(tmp);
+		mipFreeTaps(&vtaps);
+		mipFreeTaps(&htaps);
+		rwFree(cur);
+		cur = next;
+		w = dw;
+		h = dh;
+
+		img = Image::create(w, h, 32);
+		img->allocate();
+		mipStore32(img, cur, &gam);
+		if(coverage > 0.0f)
+			mipScaleAlpha(img, g->mipAlphaRef, coverage);
+		levels[i] = mipConvert(img, this);
+	}
+	rwFree(cur);
+	return numLevels;
+}
+
+void Image::setMipmapFilter(int32 filter) { IMAGEGLOBAL(mipFilter) = filter; }
+int32 Image::getMipmapFilter(void) { return IMAGEGLOBAL(mipFilter); }
+void Image::setMipmapGamma(float32 gamma) { IMAGEGLOBAL(mipGamma) = gamma; }
+float32 Image::getMipmapGamma(void) { return IMAGEGLOBAL(mipGamma); }
+void Image::setMipmapAlphaRef(int32 ref) { IMAGEGLOBAL(mipAlphaRef) = ref; }
+int32 Image::getMipmapAlphaRef(void) { return IMAGEGLOBAL(mipAlphaRef); }
+
 void
 Image::setPalette(uint8 *palette)
 {
@@ -622,6 +1497,27 @@ Image::hasAlpha(void)
 	return ret != 0xFF;
 }
 
+bool32
+Image::hasCutoutAlpha(void)
+{
+	uint8 a;
+	uint8 *pixels = this->pixels;
+	if(this->depth == 32 || this->depth <= 8){
+		for(int y = 0; y < this->height; y++){
+			uint8 *line = pixels;
+			for(int x = 0; x < this->width; x++){
+				a = this->depth == 32 ? line[3] : this->palette[*line*4+3];
+				if(a != 0 && a != 0xFF)
+					return 0;
+				line += this->bpp;
+			}
+			pixels += this->stride;
+		}
+	}
+	// 16 bit alpha is one bit anyway
+	return 1;
+}
+
 void
 Image::convertTo32(void)
 {
@@ -678,15 +1574,17 @@ Image::palettize(int32 depth)
 	uint8 *newpixels;
 	uint32 newstride;
 
+	memset(colors, 0, sizeof(colors));
 	quant.init();
 	quant.addImage(this);
 	assert(depth <= 8);
 	quant.makePalette(1<<depth, colors);
+	if(IMAGEGLOBAL(quantRefine) > 0)
+		quant.refinePalette(this, IMAGEGLOBAL(quantRefine), colors);
 
 	newstride = this->width;
 	newpixels = rwNewT(uint8, newstride*this->height, MEMDUR_EVENT | ID_IMAGE);
-	// TODO: maybe do floyd-steinberg dithering?
-	quant.matchImage(newpixels, newstride, this);
+	quant.matchImage(newpixels, newstride, this, IMAGEGLOBAL(quantDither));
 
 	this->free();
 	this->depth = depth;
@@ -701,6 +1599,13 @@ Image::palettize(int32 depth)
 	quant.destroy();
 }
 
+void Image::setPalettizeRefine(int32 numPasses) { IMAGEGLOBAL(quantRefine) = numPasses; }
+int32 Image::getPalettizeRefine(void) { return IMAGEGLOBAL(quantRefine); }
+void Image::setPalettizeDither(bool32 dither) { IMAGEGLOBAL(quantDither) = dither; }
+bool32 Image::getPalettizeDither(void) { return IMAGEGLOBAL(quantDither); }
+void Image::setNumPalettizeThreads(int32 n) { IMAGEGLOBAL(numQuantThreads) = n; }
+int32 Image::getNumPalettizeThreads(void) { return IMAGEGLOBAL(numQuantThreads); }
+
 void
 Image::unpalettize(bool forceAlpha)
 {
@@ -899,12 +1804,14 @@ Image::setSearchPath(const char *path)
 {
 	char *p, *end;
 	ImageGlobals *g = PLUGINOFFSET(ImageGlobals, engine, imageModuleOffset);
+	lockEngine();
 	rwFree(g->searchPaths);
 	g->numSearchPaths = 0;
 	if(path)
 		g->searchPaths = p = rwStrdup(path, MEMDUR_EVENT);
 	else{
 		g->searchPaths = nil;
+		unlockEngine();
 		return;
 	}
 	while(p && *p){
@@ -914,6 +1821,7 @@ Image::setSearchPath(const char *path)
 		g->numSearchPaths++;
 		p = end;
 	}
+	unlockEngine();
 }
 
 void
@@ -927,10 +1835,9 @@ Image::printSearchPath(void)
 	}
 }
 
-char*
-Image::getFilename(const char *name)
+static char*
+searchFile(ImageGlobals *g, const char *name)
 {
-	ImageGlobals *g = PLUGINOFFSET(ImageGlobals, engine, imageModuleOffset);
 	void *f;
 	char *s, *p = g->searchPaths;
 	size_t len = strlen(name)+1;
@@ -967,6 +1874,18 @@ Image::getFilename(const char *name)
 	return nil;
 }
 
+char*
+Image::getFilename(const char *name)
+{
+	ImageGlobals *g = PLUGINOFFSET(ImageGlobals, engine, imageModuleOffset);
+	char *s;
+	// keep setSearchPath from changing the paths under us
+	lockEngine();
+	s = searchFile(g, name);
+	unlockEngine();
+	return s;
+}
+
 Image*
 Image::readMasked(const char *imageName, const char *maskName)
 {
@@ -1042,6 +1961,14 @@ imageOpen(void *object, int32 offset, int32 size)
 	g->searchPaths = nil;
 	g->numSearchPaths = 0;
 	g->numFileFormats = 0;
+	g->numDXTThreads = 1;
+	g->dxtFit = Image::DXTRANGEFIT;
+	g->mipFilter = Image::MIPBOX;
+	g->mipGamma = 2.2f;
+	g->mipAlphaRef = 128;
+	g->quantRefine = 0;
+	g->quantDither = 0;
+	g->numQuantThreads = 1;
 	return object;
 }
 
@@ -1098,23 +2025,26 @@ makeTreeAddr(RGBA color)
 	return addr;
 }
 
-void
-ColorQuant::Node::destroy(void)
-{
-	int i;
-	for(i = 0; i < 16; i++)
-		if(this->children[i])
-			this->children[i]->destroy();
-	if(this->link.next)
-		this->link.remove();
-	rwFree(this);
-}
+// Nodes come from blocks that are only freed with the whole tree.
+// The first node of a block links the blocks.
+#define QUANTBLOCKNODES 1024
 
 ColorQuant::Node*
 ColorQuant::createNode(int32 level)
 {
 	int i;
-	ColorQuant::Node *node = rwNewT(ColorQuant::Node, 1, MEMDUR_EVENT | ID_IMAGE);
+	ColorQuant::Node *node;
+	if(this->freeNodes == nil){
+		Node *block = rwNewT(ColorQuant::Node, QUANTBLOCKNODES, MEMDUR_EVENT | ID_IMAGE);
+		block->parent = this->nodeBlocks;
+		this->nodeBlocks = block;
+		for(i = 1; i < QUANTBLOCKNODES; i++){
+			block[i].parent = this->freeNodes;
+			this->freeNodes = &block[i];
+		}
+	}
+	node = this->freeNodes;
+	this->freeNodes = node->parent;
 	node->parent = nil;
 	for(i = 0; i < 16; i++)
 		node->children[i] = nil;
@@ -1125,12 +2055,29 @@ ColorQuant::createNode(int32 level)
 	node->numPixels = 0;
 	node->link.init();
 
-	if(level == 0)
+	if(level == 0){
 		this->leaves.append(&node->link);
+		this->numLeaves++;
+	}
 
 	return node;
 }
 
+void
+ColorQuant::destroyNode(Node *node)
+{
+	int i;
+	for(i = 0; i < 16; i++)
+		if(node->children[i])
+			this->destroyNode(node->children[i]);
+	if(node->link.next){
+		node->link.remove();
+		this->numLeaves--;
+	}
+	node->parent = this->freeNodes;
+	this->freeNodes = node;
+}
+
 ColorQuant::Node*
 ColorQuant::getNode(ColorQuant::Node *root, uint32 addr, int32 level)
 {
@@ -1171,12 +2118,13 @@ ColorQuant::reduceNode(Node *node)
 			node->b += node->children[i]->b;
 			node->a += node->children[i]->a;
 			node->numPixels += node->children[i]->numPixels;
-			node->children[i]->destroy();
+			this->destroyNode(node->children[i]);
 			node->children[i] = nil;
 		}
 	assert(node->link.next == nil);
 	assert(node->link.prev == nil);
 	this->leaves.append(&node->link);
+	this->numLeaves++;
 }
 
 void
@@ -1193,13 +2141,24 @@ void
 ColorQuant::init(void)
 {
 	this->leaves.init();
+	this->numLeaves = 0;
+	this->freeNodes = nil;
+	this->nodeBlocks = nil;
+	this->numColors = 0;
 	this->root = this->createNode(QUANTDEPTH);
 }
 
 void
 ColorQuant::destroy(void)
 {
-	this->root->destroy();
+	Node *block, *next;
+	for(block = this->nodeBlocks; block; block = next){
+		next = block->parent;
+		rwFree(block);
+	}
+	this->nodeBlocks = nil;
+	this->freeNodes = nil;
+	this->root = nil;
 }
 
 void
@@ -1218,36 +2177,41 @@ ColorQuant::findColor(RGBA color)
 	return node->numPixels;
 }
 
-void
-ColorQuant::addImage(Image *img)
+static RGBA
+quantGetColor(Image *img, uint8 *p)
 {
 	RGBA col;
 	uint8 rgba[4];
+	switch(img->depth){
+	case 4: case 8:
+		conv_RGBA8888_from_RGBA8888(rgba, &img->palette[p[0]*4]);
+		break;
+	case 32:
+		conv_RGBA8888_from_RGBA8888(rgba, p);
+		break;
+	case 24:
+		conv_RGBA8888_from_RGB888(rgba, p);
+		break;
+	case 16:
+		conv_RGBA8888_from_ARGB1555(rgba, p);
+		break;
+	default: assert(0 && "invalid depth");
+	}
+	col.red = rgba[0];
+	col.green = rgba[1];
+	col.blue = rgba[2];
+	col.alpha = rgba[3];
+	return col;
+}
+
+void
+ColorQuant::addImage(Image *img)
+{
 	uint8 *pixels = img->pixels;
 	for(int y = 0; y < img->height; y++){
 		uint8 *line = pixels;
 		for(int x = 0; x < img->width; x++){
-			uint8 *p = line;
-			switch(img->depth){
-			case 4: case 8:
-				conv_RGBA8888_from_RGBA8888(rgba, &img->palette[p[0]*4]);
-				break;
-			case 32:
-				conv_RGBA8888_from_RGBA8888(rgba, p);
-				break;
-			case 24:
-				conv_RGBA8888_from_RGB888(rgba, p);
-				break;
-			case 16:
-				conv_RGBA8888_from_ARGB1555(rgba, p);
-				break;
-			default: assert(0 && "invalid depth");
-			}
-			col.red = rgba[0];
-			col.green = rgba[1];
-			col.blue = rgba[2];
-			col.alpha = rgba[3];
-			this->addColor(col);
+			this->addColor(quantGetColor(img, line));
 			line += img->bpp;
 		}
 		pixels += img->stride;
@@ -1257,7 +2221,7 @@ ColorQuant::addImage(Image *img)
 void
 ColorQuant::makePalette(int32 numColors, RGBA *colors)
 {
-	while(this->leaves.count() > numColors){
+	while(this->numLeaves > numColors){
 		Node *n = LLLinkGetData(this->leaves.link.next, Node, link);
 		this->reduceNode(n->parent);
 	}
@@ -1273,52 +2237,279 @@ ColorQuant::makePalette(int32 numColors, RGBA *colors)
 		colors[i].green = n->g;
 		colors[i].blue = n->b;
 		colors[i].alpha = n->a;
+		this->palette[i] = colors[i];
 		n->numPixels = i++;
 	}
+	this->numColors = i;
 }
 
-void
-ColorQuant::matchImage(uint8 *dstPixels, uint32 dstStride, Image *img)
+//
+// Nearest palette color search.
+// The palette is kept as four channel arrays padded to a multiple
+// of four entries so four distances are computed at once.
+// Every job has a small direct mapped cache of colors it has matched.
+//
+
+#define QUANTCACHEBITS 10
+#define QUANTROWSPERJOB 16
+#define QUANTMINPARALLEL (128*128)	// don't bother with threads below this
+
+struct QuantPalette
+{
+	float32 r[256], g[256], b[256], a[256];
+	int32 numEntries;	// padded
+};
+
+struct QuantCache
+{
+	uint32 keys[1<<QUANTCACHEBITS];
+	uint8 indices[1<<QUANTCACHEBITS];
+};
+
+static void
+quantMakePalette(QuantPalette *pal, RGBA *colors, int32 numColors)
+{
+	int32 i;
+	for(i = 0; i < numColors; i++){
+		pal->r[i] = colors[i].red;
+		pal->g[i] = colors[i].green;
+		pal->b[i] = colors[i].blue;
+		pal->a[i] = colors[i].alpha;
+	}
+	// never closest
+	for(; i & 3; i++)
+		pal->r[i] = pal->g[i] = pal->b[i] = pal->a[i] = 1.0e6f;
+	pal->numEntries = i;
+}
+
+static uint8
+quantNearest(QuantPalette *pal, RGBA c)
+{
+	int32 i, best;
+#ifdef RW_SIMD
+	static const float32 firstIdx[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+	float32 dists[4], indices[4];
+	vec4 r = vsplat(c.red);
+	vec4 g = vsplat(c.green);
+	vec4 b = vsplat(c.blue);
+	vec4 a = vsplat(c.alpha);
+	vec4 four = vsplat(4.0f);
+	vec4 idx = vload(firstIdx);
+	vec4 bestDist = vsplat(1.0e30f);
+	vec4 bestIdx = vzero();
+	vec4 d, dist, m;
+	for(i = 0; i < pal->numEntries; i += 4){
+		d = vsub(vload(&pal->r[i]), r);
+		dist = vmul(d, d);
+		d = vsub(vload(&pal->g[i]), g);
+		dist = vadd(dist, vmul(d, d));
+		d = vsub(vload(&pal->b[i]), b);
+		dist = vadd(dist, vmul(d, d));
+		d = vsub(vload(&pal->a[i]), a);
+		dist = vadd(dist, vmul(d, d));
+		m = vcmplt(dist, bestDist);
+		bestDist = vsel(m, dist, bestDist);
+		bestIdx = vsel(m, idx, bestIdx);
+		idx = vadd(idx, four);
+	}
+	vstore(dists, bestDist);
+	vstore(indices, bestIdx);
+	// lowest index on a tie, same as the scalar search
+	best = 0;
+	for(i = 1; i < 4; i++)
+		if(dists[i] < dists[best] ||
+		   (dists[i] == dists[best] && indices[i] < indices[best]))
+			best = i;
+	return (uint8)indices[best];
+#else
+	float32 d, dist, bestDist;
+	best = 0;
+	bestDist = 1.0e30f;
+	for(i = 0; i < pal->numEntries; i++){
+		d = pal->r[i] - c.red;
+		dist = d*d;
+		d = pal->g[i] - c.green;
+		dist += d*d;
+		d = pal->b[i] - c.blue;
+		dist += d*d;
+		d = pal->a[i] - c.alpha;
+		dist += d*d;
+		if(dist < bestDist){
+			bestDist = dist;
+			best = i;
+		}
+	}
+	return best;
+#endif
+}
+
+static void
+quantInitCache(QuantCache *cache, QuantPalette *pal)
+{
+	RGBA black = { 0, 0, 0, 0 };
+	memset(cache->keys, 0, sizeof(cache->keys));
+	memset(cache->indices, quantNearest(pal, black), sizeof(cache->indices));
+}
+
+static uint8
+quantLookup(QuantCache *cache, QuantPalette *pal, RGBA c)
+{
+	uint32 key = c.red | c.green<<8 | c.blue<<16 | (uint32)c.alpha<<24;
+	uint32 h = (key*0x9E3779B1u) >> (32-QUANTCACHEBITS);
+	if(cache->keys[h] != key){
+		cache->keys[h] = key;
+		cache->indices[h] = quantNearest(pal, c);
+	}
+	return cache->indices[h];
+}
+
+struct QuantMatchJob
+{
+	QuantPalette *pal;
+	uint8 *dstPixels;
+	uint32 dstStride;
+	Image *img;
+};
+
+static void
+quantMatchJob(int32 i, void *data)
+{
+	QuantMatchJob *job = (QuantMatchJob*)data;
+	Image *img = job->img;
+	QuantCache cache;
+	int32 x, y, y1;
+	uint8 *line, *dline;
+
+	quantInitCache(&cache, job->pal);
+	y1 = (i+1)*QUANTROWSPERJOB;
+	if(y1 > img->height) y1 = img->height;
+	for(y = i*QUANTROWSPERJOB; y < y1; y++){
+		line = img->pixels + y*img->stride;
+		dline = job->dstPixels + y*job->dstStride;
+		for(x = 0; x < img->width; x++){
+			*dline++ = quantLookup(&cache, job->pal, quantGetColor(img, line));
+			line += img->bpp;
+		}
+	}
+}
+
+static int32
+quantClamp(int32 x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+// Floyd-Steinberg on the color channels, alpha is matched as it is.
+// Error runs down the whole image so this can't be split into jobs.
+static void
+quantMatchDither(QuantMatchJob *job, RGBA *colors)
 {
+	Image *img = job->img;
+	QuantCache cache;
+	int32 x, y, c, k;
+	int32 *err, *cur, *next, *tmp;
+	int32 e[3];
+	uint8 *line, *dline;
 	RGBA col;
-	uint8 rgba[4];
-	uint8 *pixels = img->pixels;
-	for(int y = 0; y < img->height; y++){
-		uint8 *line = pixels;
-		uint8 *dline = dstPixels;
-		for(int x = 0; x < img->width; x++){
-			uint8 *p = line;
-			uint8 *d = dline;
-			switch(img->depth){
-			case 4: case 8:
-				conv_RGBA8888_from_RGBA8888(rgba, &img->palette[p[0]*4]);
-				break;
-			case 32:
-				conv_RGBA8888_from_RGBA8888(rgba, p);
-				break;
-			case 24:
-				conv_RGBA8888_from_RGB888(rgba, p);
-				break;
-			case 16:
-				conv_RGBA8888_from_ARGB1555(rgba, p);
-				break;
-			default: assert(0 && "invalid depth");
-			}
-			
-			col.red = rgba[0];
-			col.green = rgba[1];
-			col.blue = rgba[2];
-			col.alpha = rgba[3];
-			*d = this->findColor(col);
 
+	quantInitCache(&cache, job->pal);
+	// one pixel of padding on either side
+	err = rwNewT(int32, 2*(img->width+2)*3, MEMDUR_FUNCTION | ID_IMAGE);
+	memset(err, 0, 2*(img->width+2)*3*sizeof(int32));
+	cur = err;
+	next = err + (img->width+2)*3;
+	for(y = 0; y < img->height; y++){
+		line = img->pixels + y*img->stride;
+		dline = job->dstPixels + y*job->dstStride;
+		for(x = 0; x < img->width; x++){
+			col = quantGetColor(img, line);
+			int32 *ce = &cur[(x+1)*3];
+			col.red = quantClamp(col.red + ce[0]/16);
+			col.green = quantClamp(col.green + ce[1]/16);
+			col.blue = quantClamp(col.blue + ce[2]/16);
+			k = quantLookup(&cache, job->pal, col);
+			*dline++ = k;
+			e[0] = col.red - colors[k].red;
+			e[1] = col.green - colors[k].green;
+			e[2] = col.blue - colors[k].blue;
+			for(c = 0; c < 3; c++){
+				ce[3+c] += e[c]*7;
+				next[x*3+c] += e[c]*3;
+				next[(x+1)*3+c] += e[c]*5;
+				next[(x+2)*3+c] += e[c];
+			}
 			line += img->bpp;
-			dline++;
 		}
-		pixels += img->stride;
-		dstPixels += dstStride;
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		memset(next, 0, (img->width+2)*3*sizeof(int32));
 	}
+	rwFree(err);
 }
 
+void
+ColorQuant::matchImage(uint8 *dstPixels, uint32 dstStride, Image *img, bool32 dither)
+{
+	QuantPalette pal;
+	QuantMatchJob job;
+	int32 numThreads;
+
+	quantMakePalette(&pal, this->palette, this->numColors);
+	job.pal = &pal;
+	job.dstPixels = dstPixels;
+	job.dstStride = dstStride;
+	job.img = img;
+	if(dither){
+		quantMatchDither(&job, this->palette);
+		return;
+	}
+	numThreads = img->width*img->height < QUANTMINPARALLEL ? 1 : IMAGEGLOBAL(numQuantThreads);
+	parallelFor((img->height + QUANTROWSPERJOB-1)/QUANTROWSPERJOB, numThreads, quantMatchJob, &job);
+}
+
+// k-means: move every color to the mean of the pixels that match it
+void
+ColorQuant::refinePalette(Image *img, int32 numPasses, RGBA *colors)
+{
+	uint8 *indices, *line;
+	uint64 *sums, *s, n;	// 32 bits overflow at 16M pixels of one color
+	int32 pass, x, y, i;
+	RGBA col;
 
+	indices = rwNewT(uint8, img->width*img->height, MEMDUR_FUNCTION | ID_IMAGE);
+	sums = rwNewT(uint64, this->numColors*5, MEMDUR_FUNCTION | ID_IMAGE);
+	for(pass = 0; pass < numPasses; pass++){
+		this->matchImage(indices, img->width, img);
+		memset(sums, 0, this->numColors*5*sizeof(uint64));
+		for(y = 0; y < img->height; y++){
+			line = img->pixels + y*img->stride;
+			for(x = 0; x < img->width; x++){
+				col = quantGetColor(img, line);
+				s = &sums[indices[y*img->width + x]*5];
+				s[0] += col.red;
+				s[1] += col.green;
+				s[2] += col.blue;
+				s[3] += col.alpha;
+				s[4]++;
+				line += img->bpp;
+			}
+		}
+		for(i = 0; i < this->numColors; i++){
+			s = &sums[i*5];
+			n = s[4];
+			// unused colors stay where they are
+			if(n == 0)
+				continue;
+			this->palette[i].red = (s[0] + n/2)/n;
+			this->palette[i].green = (s[1] + n/2)/n;
+			this->palette[i].blue = (s[2] + n/2)/n;
+			this->palette[i].alpha = (s[3] + n/2)/n;
+		}
+	}
+	memcpy(colors, this->palette, this->numColors*sizeof(RGBA));
+	rwFree(sums);
+	rwFree(indices);
+}
 
 }
@@ -13,7 +13,7 @@
 
 namespace rw {
 
-int32 Light::numAllocated;
+atomic32 Light::numAllocated;
 
 PluginList Light::s_plglist(sizeof(Light));
 
@@ -136,7 +136,8 @@ bool
 Light::streamWrite(Stream *stream)
 {
 	LightChunkData buf;
-	writeChunkHeader(stream, ID_LIGHT, this->streamGetSize());
+	uint32 chunk = beginChunk(stream, ID_LIGHT,
+		stream->patchesSizes() ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, sizeof(LightChunkData));
 	buf.radius = this->radius;
 	buf.red   = this->color.red;
@@ -151,6 +152,7 @@ Light::streamWrite(Stream *stream)
 	stream->write32(&buf, sizeof(LightChunkData));
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
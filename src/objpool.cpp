@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#define PLUGIN_ID 0
+
+// Slab pools for the plugin extended core objects.
+// A slab is a 16 byte header followed by slotsPerSlab slots.
+// Free slots are linked through their first word.
+
+namespace rw {
+
+#define MAXPOOLS 16
+#define SLABSIZE (64*1024)
+#define SLABHEADER 16
+#define MINSLOTS 16
+#define CACHESIZE 32	// a thread keeps at most this many, moves half at a time
+
+#define NEXT(p) (*(void**)(p))
+
+static ObjPool *pools[MAXPOOLS];
+static int32 numPools;
+static uint32 poolGeneration;
+#ifdef RW_PS2
+static bool32 threadCaches = 0;
+#else
+static bool32 threadCaches = 1;
+#endif
+
+struct PoolCache
+{
+	void *slots;
+	int32 numSlots;
+	uint32 generation;
+};
+
+// gives the slots back when the thread exits
+struct PoolCaches
+{
+	PoolCache caches[MAXPOOLS];
+	~PoolCaches(void);
+};
+static RWTHREADLOCAL PoolCaches poolCaches;
+
+PoolCaches::~PoolCaches(void)
+{
+	void *p;
+	for(int32 i = 0; i < numPools; i++){
+		PoolCache *c = &this->caches[i];
+		ObjPool *pool = pools[i];
+		if(c->slots == nil || c->generation != pool->generation)
+			continue;
+		lockEngine();
+		while(p = c->slots, p){
+			c->slots = NEXT(p);
+			NEXT(p) = pool->freeList;
+			pool->freeList = p;
+		}
+		unlockEngine();
+		c->numSlots = 0;
+	}
+}
+
+static PoolCache*
+getCache(ObjPool *pool)
+{
+	PoolCache *c = &poolCaches.caches[pool->index];
+	// slots of released slabs are gone
+	if(c->generation != pool->generation){
+		c->slots = nil;
+		c->numSlots = 0;
+		c->generation = pool->generation;
+	}
+	return c;
+}
+
+// engine lock must be held
+static void*
+takeSlot(ObjPool *pool)
+{
+	void *p;
+	if(pool->freeList == nil){
+		uint8 *slab = (uint8*)rwMalloc(SLABHEADER + pool->slotsPerSlab*pool->slotSize,
+			MEMDUR_GLOBAL | pool->id);
+		if(slab == nil)
+			return nil;
+		NEXT(slab) = pool->slabs;
+		pool->slabs = slab;
+		pool->numSlabs++;
+		// lowest address first
+		for(int32 i = pool->slotsPerSlab-1; i >= 0; i--){
+			p = slab + SLABHEADER + i*pool->slotSize;
+			NEXT(p) = pool->freeList;
+			pool->freeList = p;
+		}
+	}
+	p = pool->freeList;
+	pool->freeList = NEXT(p);
+	return p;
+}
+
+ObjPool::ObjPool(PluginList *plglist, uint32 id)
+{
+	this->plglist = plglist;
+	this->id = id;
+	this->slotSize = 0;
+	this->slotsPerSlab = 0;
+	this->freeList = nil;
+	this->slabs = nil;
+	this->numSlabs = 0;
+	this->generation = 0;
+	this->numLive = 0;
+	this->numAllocs = 0;
+	assert(numPools < MAXPOOLS);
+	this->index = numPools;
+	pools[numPools++] = this;
+}
+
+void
+ObjPool::init(void)
+{
+	int32 size = (this->plglist->size + 15) & ~15;
+	lockEngine();
+	if(size != this->slotSize && this->numLive == 0){
+		this->release();
+		this->slotSize = size;
+		this->slotsPerSlab = (SLABSIZE - SLABHEADER) / size;
+		if(this->slotsPerSlab < MINSLOTS)
+			this->slotsPerSlab = MINSLOTS;
+		this->generation = ++poolGeneration;
+	}
+	// can't resize while objects are alive, alloc fails then
+	if(size > this->slotSize)
+		RWERROR((ERR_GENERAL, "object pool too small for its plugins"));
+	unlockEngine();
+}
+
+void
+ObjPool::release(void)
+{
+	void *slab, *next;
+	lockEngine();
+	// objects still alive are leaked along with their slabs
+	if(this->numLive == 0)
+		for(slab = this->slabs; slab; slab = next){
+			next = NEXT(slab);
+			rwFree(slab);
+		}
+	this->slabs = nil;
+	this->freeList = nil;
+	this->numSlabs = 0;
+	this->numLive = 0;
+	this->slotSize = 0;
+	this->generation = ++poolGeneration;
+	unlockEngine();
+}
+
+void*
+ObjPool::alloc(void)
+{
+	PoolCache *c;
+	void *p;
+
+	if(this->slotSize == 0)
+		this->init();
+	if(this->plglist->size > this->slotSize)
+		return nil;
+	if(threadCaches){
+		c = getCache(this);
+		if(c->slots == nil){
+			lockEngine();
+			while(c->numSlots < CACHESIZE/2 && (p = takeSlot(this))){
+				NEXT(p) = c->slots;
+				c->slots = p;
+				c->numSlots++;
+			}
+			unlockEngine();
+		}
+		if(p = c->slots, p){
+			c->slots = NEXT(p);
+			c->numSlots--;
+		}
+	}else{
+		lockEngine();
+		p = takeSlot(this);
+		unlockEngine();
+	}
+	if(p){
+		this->numLive++;
+		this->numAllocs++;
+	}
+	return p;
+}
+
+void
+ObjPool::free(void *p)
+{
+	PoolCache *c;
+	void *q;
+
+	if(p == nil)
+		return;
+	this->numLive--;
+	if(threadCaches){
+		c = getCache(this);
+		NEXT(p) = c->slots;
+		c->slots = p;
+		if(++c->numSlots > CACHESIZE){
+			lockEngine();
+			while(c->numSlots > CACHESIZE/2){
+				q = c->slots;
+				c->slots = NEXT(q);
+				NEXT(q) = this->freeList;
+				this->freeList = q;
+				c->numSlots--;
+			}
+			unlockEngine();
+		}
+	}else{
+		lockEngine();
+		NEXT(p) = this->freeList;
+		this->freeList = p;
+		unlockEngine();
+	}
+}
+
+void
+ObjPool::getStats(ObjPoolStats *stats)
+{
+	lockEngine();
+	stats->slotSize = this->slotSize;
+	stats->numSlabs = this->numSlabs;
+	stats->numSlots = this->numSlabs*this->slotsPerSlab;
+	stats->numLive = this->numLive;
+	stats->numAllocs = this->numAllocs;
+	unlockEngine();
+}
+
+void
+initObjPools(void)
+{
+	for(int32 i = 0; i < numPools; i++)
+		pools[i]->init();
+}
+
+void
+releaseObjPools(void)
+{
+	for(int32 i = 0; i < numPools; i++)
+		pools[i]->release();
+}
+
+bool32
+objPoolSized(PluginList *plglist)
+{
+	for(int32 i = 0; i < numPools; i++)
+		if(pools[i]->plglist == plglist && pools[i]->slotSize != 0)
+			return 1;
+	return 0;
+}
+
+void
+setObjPoolThreadCaches(bool32 enable)
+{
+#ifndef RW_PS2
+	threadCaches = enable;
+#endif
+}
+
+}
@@ -12,6 +12,8 @@
 #include "rwobjects.h"
 #include "rwengine.h"
 
+#define PLUGIN_ID 0
+
 namespace rw {
 
 static void *defCtor(void *object, int32, int32) { return object; }
@@ -22,6 +24,56 @@ static LinkList allPlugins;
 
 #define PLG(lnk) LLLinkGetData(lnk, Plugin, inParentList)
 
+// Extension chunk of a lazy plugin, the data follows
+struct LazyChunk
+{
+	LazyChunk *next;
+	Plugin *plugin;
+	int32 length;
+};
+#define LAZYCHUNKS(l, object) PLUGINOFFSET(LazyChunk*, object, (l)->lazyOffset)
+
+static uint32
+hashId(uint32 id)
+{
+	return (id * 0x9E3779B1u) >> 7;
+}
+
+// called whenever a plugin is added, that doesn't happen often
+static void
+rebuildIdTable(PluginList *l)
+{
+	uint32 size, n, h;
+
+	n = 0;
+	FORLIST(lnk, l->plugins)
+		n++;
+	size = 16;
+	while(size < n*2)
+		size *= 2;
+	rwFree(l->idTable);
+	l->idTable = rwNewT(Plugin*, size, MEMDUR_GLOBAL);
+	memset(l->idTable, 0, size*sizeof(Plugin*));
+	l->idMask = size-1;
+	// in list order, so the first plugin with an id wins
+	FORLIST(lnk, l->plugins){
+		Plugin *p = PLG(lnk);
+		for(h = hashId(p->id) & l->idMask; l->idTable[h]; h = (h+1) & l->idMask);
+		l->idTable[h] = p;
+	}
+}
+
+static LazyChunk*
+findLazyChunk(PluginList *l, void *object, Plugin *p)
+{
+	if(l->lazyOffset < 0 || !p->lazy)
+		return nil;
+	for(LazyChunk *c = *LAZYCHUNKS(l, object); c; c = c->next)
+		if(c->plugin == p)
+			return c;
+	return nil;
+}
+
 void
 PluginList::open(void)
 {
@@ -39,8 +91,13 @@ PluginList::close(void)
 		p->inParentList.remove();
 		p->inGlobalList.remove();
 		rwFree(p);
-		if(l->plugins.isEmpty())
+		if(l->plugins.isEmpty()){
 			l->size = l->defaultSize;
+			rwFree(l->idTable);
+			l->idTable = nil;
+			l->idMask = 0;
+			l->lazyOffset = -1;
+		}
 	}
 	assert(allPlugins.isEmpty());
 }
@@ -48,6 +105,9 @@ PluginList::close(void)
 void
 PluginList::construct(void *object)
 {
+	this->numObjects++;
+	if(this->lazyOffset >= 0)
+		*LAZYCHUNKS(this, object) = nil;
 	FORLIST(lnk, this->plugins){
 		Plugin *p = PLG(lnk);
 		p->constructor(object, p->offset, p->size);
@@ -61,6 +121,15 @@ PluginList::destruct(void *object)
 		Plugin *p = PLG(lnk);
 		p->destructor(object, p->offset, p->size);
 	}
+	if(this->lazyOffset >= 0){
+		LazyChunk *c, *next;
+		for(c = *LAZYCHUNKS(this, object); c; c = next){
+			next = c->next;
+			rwFree(c);
+		}
+		*LAZYCHUNKS(this, object) = nil;
+	}
+	this->numObjects--;
 }
 
 void
@@ -70,6 +139,20 @@ PluginList::copy(void *dst, void *src)
 		Plugin *p = PLG(lnk);
 		p->copy(dst, src, p->offset, p->size);
 	}
+	if(this->lazyOffset >= 0){
+		LazyChunk **dstp = LAZYCHUNKS(this, dst);
+		for(LazyChunk *c = *LAZYCHUNKS(this, src); c; c = c->next){
+			LazyChunk *nc = (LazyChunk*)rwMalloc(sizeof(LazyChunk)+c->length, MEMDUR_EVENT);
+			if(nc == nil){
+				RWERROR((ERR_ALLOC, sizeof(LazyChunk)+c->length));
+				break;
+			}
+			memcpy(nc, c, sizeof(LazyChunk)+c->length);
+			nc->next = nil;
+			*dstp = nc;
+			dstp = &nc->next;
+		}
+	}
 }
 
 bool
@@ -83,23 +166,34 @@ PluginList::streamRead(Stream *stream, void *object)
 		if(!readChunkHeaderInfo(stream, &header))
 			return false;
 		length -= 12;
-		FORLIST(lnk, this->plugins){
-			Plugin *p = PLG(lnk);
-			if(p->id == header.type && p->read){
-				p->read(stream, header.length,
-				        object, p->offset, p->size);
-				goto cont;
+		Plugin *p = this->findPlugin(header.type);
+		if(p && p->read && p->lazy && this->lazyOffset >= 0){
+			// keep the bytes, parseLazy reads them later
+			LazyChunk *c = (LazyChunk*)rwMalloc(sizeof(LazyChunk)+header.length, MEMDUR_EVENT);
+			if(c == nil){
+				RWERROR((ERR_ALLOC, sizeof(LazyChunk)+header.length));
+				return false;
 			}
-		}
-		stream->seek(header.length);
-cont:
+			c->plugin = p;
+			c->length = header.length;
+			if(stream->read8(c+1, header.length) != header.length){
+				rwFree(c);
+				return false;
+			}
+			c->next = *LAZYCHUNKS(this, object);
+			*LAZYCHUNKS(this, object) = c;
+		}else if(p && p->read)
+			p->read(stream, header.length,
+			        object, p->offset, p->size);
+		else
+			stream->seek(header.length);
 		length -= header.length;
 	}
 
-	// now the always callbacks
+	// now the always callbacks, lazy plugins get theirs when parsed
 	FORLIST(lnk, this->plugins){
 		Plugin *p = PLG(lnk);
-		if(p->alwaysCallback)
+		if(p->alwaysCallback && findLazyChunk(this, object, p) == nil)
 			p->alwaysCallback(object, p->offset, p->size);
 	}
 	return true;
@@ -108,16 +202,23 @@ cont:
 void
 PluginList::streamWrite(Stream *stream, void *object)
 {
-	int size = this->streamGetSize(object);
-	writeChunkHeader(stream, ID_EXTENSION, size);
+	int size = stream->patchesSizes() ? 0 : this->streamGetSize(object);
+	uint32 chunk = beginChunk(stream, ID_EXTENSION, size);
 	FORLIST(lnk, this->plugins){
 		Plugin *p = PLG(lnk);
+		LazyChunk *c = findLazyChunk(this, object, p);
+		if(c){
+			writeChunkHeader(stream, p->id, c->length);
+			stream->write8(c+1, c->length);
+			continue;
+		}
 		if(p->getSize == nil ||
 		   (size = p->getSize(object, p->offset, p->size)) <= 0)
 			continue;
 		writeChunkHeader(stream, p->id, size);
 		p->write(stream, size, object, p->offset, p->size);
 	}
+	endChunk(stream, chunk);
 }
 
 int
@@ -127,7 +228,10 @@ PluginList::streamGetSize(void *object)
 	int32 plgsize;
 	FORLIST(lnk, this->plugins){
 		Plugin *p = PLG(lnk);
-		if(p->getSize &&
+		LazyChunk *c = findLazyChunk(this, object, p);
+		if(c)
+			size += 12 + c->length;
+		else if(p->getSize &&
 		   (plgsize = p->getSize(object, p->offset, p->size)) > 0)
 			size += 12 + plgsize;
 	}
@@ -152,15 +256,9 @@ PluginList::streamSkip(Stream *stream)
 void
 PluginList::assertRights(void *object, uint32 pluginID, uint32 data)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->id == pluginID){
-			if(p->rightsCallback)
-				p->rightsCallback(object,
-				                  p->offset, p->size, data);
-			return;
-		}
-	}
+	Plugin *p = this->findPlugin(pluginID);
+	if(p && p->rightsCallback)
+		p->rightsCallback(object, p->offset, p->size, data);
 }
 
 
@@ -168,6 +266,11 @@ int32
 PluginList::registerPlugin(int32 size, uint32 id,
 	Constructor ctor, Destructor dtor, CopyConstructor copy)
 {
+	// objects that exist already can't grow and nobody checks the offset
+	if(this->numObjects != 0 || objPoolSized(this)){
+		fprintf(stderr, "Error: plugin %X registered after objects were created\n", id);
+		exit(1);
+	}
 	Plugin *p = (Plugin*)rwMalloc(sizeof(Plugin), MEMDUR_GLOBAL);
 	p->offset = this->size;
 	this->size += size;
@@ -184,9 +287,11 @@ PluginList::registerPlugin(int32 size, uint32 id,
 	p->getSize = nil;
 	p->rightsCallback = nil;
 	p->alwaysCallback = nil;
+	p->lazy = 0;
 	p->parentList = this;
 	this->plugins.append(&p->inParentList);
 	allPlugins.append(&p->inGlobalList);
+	rebuildIdTable(this);
 	return p->offset;
 }
 
@@ -194,53 +299,97 @@ int32
 PluginList::registerStream(uint32 id,
 	StreamRead read, StreamWrite write, StreamGetSize getSize)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->id == id){
-			p->read = read;
-			p->write = write;
-			p->getSize = getSize;
-			return p->offset;
-		}
-	}
-	return -1;
+	Plugin *p = this->findPlugin(id);
+	if(p == nil)
+		return -1;
+	p->read = read;
+	p->write = write;
+	p->getSize = getSize;
+	return p->offset;
 }
 
 int32
 PluginList::setStreamRightsCallback(uint32 id, RightsCallback cb)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->id == id){
-			p->rightsCallback = cb;
-			return p->offset;
-		}
-	}
-	return -1;
+	Plugin *p = this->findPlugin(id);
+	if(p == nil)
+		return -1;
+	p->rightsCallback = cb;
+	return p->offset;
 }
 
 int32
 PluginList::setStreamAlwaysCallback(uint32 id, AlwaysCallback cb)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
-		if(p->id == id){
-			p->alwaysCallback = cb;
-			return p->offset;
-		}
+	Plugin *p = this->findPlugin(id);
+	if(p == nil)
+		return -1;
+	p->alwaysCallback = cb;
+	return p->offset;
+}
+
+int32
+PluginList::setStreamLazy(uint32 id, bool32 lazy)
+{
+	Plugin *p = this->findPlugin(id);
+	if(p == nil)
+		return -1;
+	// existing objects would have the wrong size or lose their chunks
+	if(this->numObjects != 0 || objPoolSized(this)){
+		RWERROR((ERR_GENERAL, "plugin made lazy after objects were created"));
+		return -1;
+	}
+	if(lazy && this->lazyOffset < 0){
+		// room for the chunk list at the end of the object
+		this->lazyOffset = this->size;
+		this->size += sizeof(LazyChunk*);
+		int32 round = sizeof(void*)-1;
+		this->size = (this->size + round)&~round;
+	}
+	p->lazy = lazy;
+	return p->offset;
+}
+
+void
+PluginList::parseLazy(void *object, uint32 id)
+{
+	LazyChunk **cp, *c;
+	StreamMemory s;
+	Plugin *p;
+
+	if(this->lazyOffset < 0)
+		return;
+	for(cp = LAZYCHUNKS(this, object); c = *cp, c; cp = &c->next){
+		p = c->plugin;
+		if(p->id != id)
+			continue;
+		*cp = c->next;
+		s.open((uint8*)(c+1), c->length);
+		p->read(&s, c->length, object, p->offset, p->size);
+		rwFree(c);
+		if(p->alwaysCallback)
+			p->alwaysCallback(object, p->offset, p->size);
+		return;
 	}
-	return -1;
 }
 
 int32
 PluginList::getPluginOffset(uint32 id)
 {
-	FORLIST(lnk, this->plugins){
-		Plugin *p = PLG(lnk);
+	Plugin *p = this->findPlugin(id);
+	return p ? p->offset : -1;
+}
+
+Plugin*
+PluginList::findPlugin(uint32 id)
+{
+	Plugin *p;
+	if(this->idTable == nil)
+		return nil;
+	for(uint32 h = hashId(id) & this->idMask; p = this->idTable[h], p; h = (h+1) & this->idMask)
 		if(p->id == id)
-			return p->offset;
-	}
-	return -1;
+			return p;
+	return nil;
 }
 
 }
@@ -888,6 +888,8 @@ objUninstance(rw::ObjPipeline *rwpipe, Atomic *atomic)
 	uint32 *flags = rwNewT(uint32, geo->numVertices,
 		MEMDUR_FUNCTION | ID_GEOMETRY);
 	memset(flags, 0, 4*geo->numVertices);
+	VertexHash hash;
+	hash.init(geo->numVertices);
 	memset(geo->meshHeader->getMeshes()->indices, 0, 2*geo->meshHeader->totalIndices);
 	for(uint32 i = 0; i < header->numMeshes; i++){
 		Mesh *mesh = &geo->meshHeader->getMeshes()[i];
@@ -912,9 +914,10 @@ objUninstance(rw::ObjPipeline *rwpipe, Atomic *atomic)
 		uint8 *data[nelem(m->attribs)] = { nil };
 		uint8 *raw = m->collectData(geo, instance, mesh, data);
 		assert(m->uninstanceCB);
-		m->uninstanceCB(m, geo, flags, mesh, data);
+		m->uninstanceCB(m, geo, flags, &hash, mesh, data);
 		rwFree(raw);
 	}
+	hash.deinit();
 	for(uint32 i = 0; i < header->numMeshes; i++){
 		Mesh *mesh = &geo->meshHeader->getMeshes()[i];
 		MatPipeline *m;
@@ -990,7 +993,7 @@ genericPreCB(MatPipeline *pipe, Geometry *geo)
 }
 
 void
-genericUninstanceCB(MatPipeline *pipe, Geometry *geo, uint32 flags[], Mesh *mesh, uint8 *data[])
+genericUninstanceCB(MatPipeline *pipe, Geometry *geo, uint32 flags[], VertexHash *hash, Mesh *mesh, uint8 *data[])
 {
 	float32 *xyz = nil, *xyzw = nil;
 	float32 *uv = nil, *uv2 = nil;
@@ -1051,9 +1054,12 @@ genericUninstanceCB(MatPipeline *pipe, Geometry *geo, uint32 flags[], Mesh *mesh
 				if(v.i[j]) v.i[j]--;
 				if(v.w[j] == 0.0f) v.i[j] = 0;
 			}
-		int32 idx = findVertexSkin(geo, flags, mask, &v);
-		if(idx < 0)
+		int32 idx = findVertexSkin(geo, flags, mask, &v, hash);
+		if(idx < 0){
 			idx = geo->numVertices++;
+			if(hash)
+				hash->add(idx, v.p);
+		}
 		mesh->indices[i] = idx;
 		if(adc)
 			adc[i] = xyzw[3] != 0.0f;
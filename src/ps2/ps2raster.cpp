@@ -1367,49 +1367,117 @@ swizzle(uint32 x, uint32 y, uint32 logw)
 	return n | nx<<2 | ny<<(logw-1+2);
 }
 
+// Swizzling permutes a strip of 4 rows at a time. A strip is cut into
+// columns of 16 pixels which land as 32 pixels in each half of the
+// swizzled strip, so one table per strip parity moves whole columns.
+// Entries are pixel offsets into the linear strip.
+static void
+makeSwizzleTable(int32 *tab, int32 y, int32 w, int32 logw)
+{
+	uint32 mask = (1<<(logw+2))-1;
+	uint32 s;
+	int32 x, i;
+	for(i = 0; i < 4; i++)
+		for(x = 0; x < 16; x++){
+			s = swizzle(x, y+i, logw)&mask;
+			tab[(s >= (uint32)(2*w) ? 32 : 0) + (s&31)] = i*w + x;
+		}
+}
+
+static void
+swizzleStrip(uint8 *dst, uint8 *src, int32 *tab, int32 w)
+{
+	int32 x, k;
+	uint8 *d0 = dst;
+	uint8 *d1 = dst + 2*w;
+	for(x = 0; x < w; x += 16){
+		for(k = 0; k < 32; k++){
+			d0[k] = src[tab[k] + x];
+			d1[k] = src[tab[32+k] + x];
+		}
+		d0 += 32;
+		d1 += 32;
+	}
+}
+
+static void
+unswizzleStrip(uint8 *dst, uint8 *src, int32 *tab, int32 w)
+{
+	int32 x, k;
+	uint8 *s0 = src;
+	uint8 *s1 = src + 2*w;
+	for(x = 0; x < w; x += 16){
+		for(k = 0; k < 32; k++){
+			dst[tab[k] + x] = s0[k];
+			dst[tab[32+k] + x] = s1[k];
+		}
+		s0 += 32;
+		s1 += 32;
+	}
+}
+
+// 4 bit strips are permuted one nibble per byte
+static void
+expandNibbles(uint8 *dst, uint8 *src, int32 n)
+{
+	int32 i;
+	for(i = 0; i < n; i++){
+		dst[2*i] = src[i] & 0xF;
+		dst[2*i+1] = src[i] >> 4;
+	}
+}
+
+static void
+packNibbles(uint8 *dst, uint8 *src, int32 n)
+{
+	int32 i;
+	for(i = 0; i < n; i++)
+		dst[i] = src[2*i] | src[2*i+1]<<4;
+}
+
+static void
+swizzleDimensions(Raster *raster, int32 *pw, int32 *ph, int32 *plogw)
+{
+	Ps2Raster *natras = GETPS2RASTEREXT(raster);
+	int32 minw, minh, i;
+	transferMinSize(raster->format & Raster::PAL4 ? PSMT4 : PSMT8, natras->flags, &minw, &minh);
+	*pw = max(raster->width, minw);
+	*ph = max(raster->height, minh);
+	*plogw = 0;
+	for(i = 1; i < *pw; i *= 2) (*plogw)++;
+}
+
 void
 unswizzleRaster(Raster *raster)
 {
 	uint8 tmpbuf[1024*4];	// 1024x4px, maximum possible width
-	uint32 mask;
-	int32 x, y, w, h;
-	int32 i;
+	uint8 nibbuf[1024*4];
+	int32 tab[2][64];
+	int32 y, w, h;
 	int32 logw;
 	Ps2Raster *natras = GETPS2RASTEREXT(raster);
-	uint8 *px;
+	uint8 *strip;
 
 	if((raster->format & (Raster::PAL4|Raster::PAL8)) == 0)
 		return;
 
-	int minw, minh;
-	transferMinSize(raster->format & Raster::PAL4 ? PSMT4 : PSMT8, natras->flags, &minw, &minh);
-	w = max(raster->width, minw);
-	h = max(raster->height, minh);
-	px = raster->pixels;
-	logw = 0;
-	for(i = 1; i < w; i *= 2) logw++;
-	mask = (1<<(logw+2))-1;
-
+	swizzleDimensions(raster, &w, &h, &logw);
 	if(raster->format & Raster::PAL4 && natras->flags & Ps2Raster::SWIZZLED4){
+		makeSwizzleTable(tab[0], 0, w, logw);
+		makeSwizzleTable(tab[1], 4, w, logw);
 		for(y = 0; y < h; y += 4){
-			memcpy(tmpbuf, &px[y<<(logw-1)], 2*w);
-			for(i = 0; i < 4; i++)
-				for(x = 0; x < w; x++){
-					uint32 a = ((y+i)<<logw)+x;
-					uint32 s = swizzle(x, y+i, logw)&mask;
-					uint8 c = s & 1 ? tmpbuf[s>>1] >> 4 : tmpbuf[s>>1] & 0xF;
-					px[a>>1] = a & 1 ? (px[a>>1]&0xF) | c<<4 : (px[a>>1]&0xF0) | c;
-				}
+			strip = &raster->pixels[y<<(logw-1)];
+			expandNibbles(tmpbuf, strip, 2*w);
+			unswizzleStrip(nibbuf, tmpbuf, tab[(y>>2)&1], w);
+			packNibbles(strip, nibbuf, 2*w);
 		}
 	}else if(raster->format & Raster::PAL8 && natras->flags & Ps2Raster::SWIZZLED8){
+		makeSwizzleTable(tab[0], 0, w, logw);
+		makeSwizzleTable(tab[1], 4, w, logw);
 		for(y = 0; y < h; y += 4){
-			memcpy(tmpbuf, &px[y<<logw], 4*w);
-			for(i = 0; i < 4; i++)
-				for(x = 0; x < w; x++){
-					uint32 a = ((y+i)<<logw)+x;
-					uint32 s = swizzle(x, y+i, logw)&mask;
-					px[a] = tmpbuf[s];
-				}
+			strip = &raster->pixels[y<<logw];
+			memcpy(tmpbuf, strip, 4*w);
+			unswizzleStrip(strip, tmpbuf, tab[(y>>2)&1], w);
 		}
 	}
 }
@@ -1418,45 +1486,33 @@ void
 swizzleRaster(Raster *raster)
 {
 	uint8 tmpbuf[1024*4];	// 1024x4px, maximum possible width
-	uint32 mask;
-	int32 x, y, w, h;
-	int32 i;
+	uint8 nibbuf[1024*4];
+	int32 tab[2][64];
+	int32 y, w, h;
 	int32 logw;
 	Ps2Raster *natras = GETPS2RASTEREXT(raster);
-	uint8 *px;
+	uint8 *strip;
 
 	if((raster->format & (Raster::PAL4|Raster::PAL8)) == 0)
 		return;
 
-	int minw, minh;
-	transferMinSize(raster->format & Raster::PAL4 ? PSMT4 : PSMT8, natras->flags, &minw, &minh);
-	w = max(raster->width, minw);
-	h = max(raster->height, minh);
-	px = raster->pixels;
-	logw = 0;
-	for(i = 1; i < raster->width; i *= 2) logw++;
-	mask = (1<<(logw+2))-1;
-
+	swizzleDimensions(raster, &w, &h, &logw);
 	if(raster->format & Raster::PAL4 && natras->flags & Ps2Raster::SWIZZLED4){
+		makeSwizzleTable(tab[0], 0, w, logw);
+		makeSwizzleTable(tab[1], 4, w, logw);
 		for(y = 0; y < h; y += 4){
-			for(i = 0; i < 4; i++)
-				for(x = 0; x < w; x++){
-					uint32 a = ((y+i)<<logw)+x;
-					uint32 s = swizzle(x, y+i, logw)&mask;
-					uint8 c = a & 1 ? px[a>>1] >> 4 : px[a>>1] & 0xF;
-					tmpbuf[s>>1] = s & 1 ? (tmpbuf[s>>1]&0xF) | c<<4 : (tmpbuf[s>>1]&0xF0) | c;
-				}
-			memcpy(&px[y<<(logw-1)], tmpbuf, 2*w);
+			strip = &raster->pixels[y<<(logw-1)];
+			expandNibbles(tmpbuf, strip, 2*w);
+			swizzleStrip(nibbuf, tmpbuf, tab[(y>>2)&1], w);
+			packNibbles(strip, nibbuf, 2*w);
 		}
 	}else if(raster->format & Raster::PAL8 && natras->flags & Ps2Raster::SWIZZLED8){
+		makeSwizzleTable(tab[0], 0, w, logw);
+		makeSwizzleTable(tab[1], 4, w, logw);
 		for(y = 0; y < h; y += 4){
-			for(i = 0; i < 4; i++)
-				for(x = 0; x < w; x++){
-					uint32 a = ((y+i)<<logw)+x;
-					uint32 s = swizzle(x, y+i, logw)&mask;
-					tmpbuf[s] = px[a];
-				}
-			memcpy(&px[y<<logw], tmpbuf, 4*w);
+			strip = &raster->pixels[y<<logw];
+			swizzleStrip(tmpbuf, strip, tab[(y>>2)&1], w);
+			memcpy(strip, tmpbuf, 4*w);
 		}
 	}
 }
@@ -1616,24 +1672,25 @@ bool32
 rasterFromImage(Raster *raster, Image *image)
 {
 	Ps2Raster *natras = GETPS2RASTEREXT(raster);
+	int32 format = raster->format & (Raster::PAL4 | Raster::PAL8 | 0xF00);
 
 	int32 pallength = 0;
 	switch(image->depth){
 	case 24:
 	case 32:
-		if(raster->format != Raster::C8888 &&
-		   raster->format != Raster::C888)	// unsafe already
+		if(format != Raster::C8888 &&
+		   format != Raster::C888)	// unsafe already
 			goto err;
 		break;
 	case 16:
-		if(raster->format != Raster::C1555) goto err;
+		if(format != Raster::C1555) goto err;
 		break;
 	case 8:
-		if(raster->format != (Raster::PAL8 | Raster::C8888)) goto err;
+		if(format != (Raster::PAL8 | Raster::C8888)) goto err;
 		pallength = 256;
 		break;
 	case 4:
-		if(raster->format != (Raster::PAL4 | Raster::C8888)) goto err;
+		if(format != (Raster::PAL4 | Raster::C8888)) goto err;
 		pallength = 16;
 		break;
 	default:
@@ -1665,7 +1722,13 @@ rasterFromImage(Raster *raster, Image *image)
 	transferMinSize(image->depth == 4 ? PSMT4 : PSMT8, natras->flags, &minw, &minh);
 	tw = max(image->width, minw);
 	uint8 *src = image->pixels;
-	out = raster->lock(0, Raster::LOCKWRITE|Raster::LOCKNOFETCH);
+	// write to the level that is locked, the top one otherwise
+	bool unlock = false;
+	if((raster->privateFlags & Raster::PRIVATELOCK_WRITE) == 0){
+		raster->lock(0, Raster::LOCKWRITE|Raster::LOCKNOFETCH);
+		unlock = true;
+	}
+	out = raster->pixels;
 	if(image->depth == 4){
 		compressPal4(out, tw/2, src, image->stride, image->width, image->height);
 	}else if(image->depth == 8){
@@ -1699,7 +1762,8 @@ rasterFromImage(Raster *raster, Image *image)
 			src += image->stride;
 		}
 	}
-	raster->unlock(0);
+	if(unlock)
+		raster->unlock(0);
 	return 1;
 }
 
@@ -194,52 +194,54 @@ skinInstanceCB(MatPipeline *, Geometry *g, Mesh *m, uint8 **data)
 	instanceSkinData(g, m, skin, (uint32*)data[4]);
 }
 
-// TODO: call base function perhaps?
-int32
-findVertexSkin(Geometry *g, uint32 flags[], uint32 mask, Vertex *v)
+static bool32
+vertexMatches(Geometry *g, Skin *skin, uint32 flag, uint32 mask, int32 i, Vertex *v)
 {
-	Skin *skin = Skin::get(g);
-	float32 *wghts = nil;
-	uint8 *inds = nil;
-	if(skin){
-		wghts = skin->weights;
-		inds = skin->indices;
-	}
-
-	V3d *verts = g->morphTargets[0].vertices;
-	TexCoords *tex = g->texCoords[0];
-	TexCoords *tex1 = g->texCoords[1];
-	V3d *norms = g->morphTargets[0].normals;
-	RGBA *cols = g->colors;
-
-	for(int32 i = 0; i < g->numVertices; i++){
-		uint32 flag = flags ? flags[i] : ~0;
-		if(mask & flag & 0x1 && !equal(*verts, v->p))
-			goto cont;
-		if(mask & flag & 0x10 && !equal(*norms, v->n))
-			goto cont;
-		if(mask & flag & 0x100 && !equal(*cols, v->c))
-			goto cont;
-		if(mask & flag & 0x1000 && !equal(*tex, v->t))
-			goto cont;
-		if(mask & flag & 0x2000 && !equal(*tex1, v->t1))
-			goto cont;
-		if(mask & flag & 0x10000 &&
-		   !(wghts[0] == v->w[0] && wghts[1] == v->w[1] &&
+	if(mask & flag & 0x1 && !equal(g->morphTargets[0].vertices[i], v->p))
+		return 0;
+	if(mask & flag & 0x10 && !equal(g->morphTargets[0].normals[i], v->n))
+		return 0;
+	if(mask & flag & 0x100 && !equal(g->colors[i], v->c))
+		return 0;
+	if(mask & flag & 0x1000 && !equal(g->texCoords[0][i], v->t))
+		return 0;
+	if(mask & flag & 0x2000 && !equal(g->texCoords[1][i], v->t1))
+		return 0;
+	if(mask & flag & 0x10000){
+		float32 *wghts = &skin->weights[i*4];
+		uint8 *inds = &skin->indices[i*4];
+		if(!(wghts[0] == v->w[0] && wghts[1] == v->w[1] &&
 		     wghts[2] == v->w[2] && wghts[3] == v->w[3] &&
 		     inds[0] == v->i[0] && inds[1] == v->i[1] &&
 		     inds[2] == v->i[2] && inds[3] == v->i[3]))
-			goto cont;
-		return i;
-	cont:
-		verts++;
-		tex++;
-		tex1++;
-		norms++;
-		cols++;
-		wghts += 4;
-		inds += 4;
+			return 0;
+	}
+	return 1;
+}
+
+// Returns the first vertex that matches v in all attributes
+// that both have, or -1.
+// With a hash only vertices at the same position are looked at.
+int32
+findVertexSkin(Geometry *g, uint32 flags[], uint32 mask, Vertex *v, VertexHash *hash)
+{
+	Skin *skin = Skin::get(g);
+	if(skin == nil)
+		mask &= ~0x10000;
+
+	if(hash){
+		// the hash only finds vertices by position
+		assert(mask & 0x1);
+		// chains are newest first, we want the oldest match
+		int32 found = -1;
+		for(int32 i = hash->first(v->p); i >= 0; i = hash->next(i))
+			if(vertexMatches(g, skin, flags ? flags[i] : ~0, mask, i, v))
+				found = i;
+		return found;
 	}
+	for(int32 i = 0; i < g->numVertices; i++)
+		if(vertexMatches(g, skin, flags ? flags[i] : ~0, mask, i, v))
+			return i;
 	return -1;
 }
 
@@ -144,7 +144,8 @@ public:
 	uint32 triStripCount, triListCount;
 	PipeAttribute *attribs[10];
 	void (*instanceCB)(MatPipeline*, Geometry*, Mesh*, uint8**);
-	void (*uninstanceCB)(MatPipeline*, Geometry*, uint32*, Mesh*, uint8**);
+	// the hash has the positions of all vertices uninstanced so far
+	void (*uninstanceCB)(MatPipeline*, Geometry*, uint32*, VertexHash*, Mesh*, uint8**);
 	void (*preUninstCB)(MatPipeline*, Geometry*);
 	void (*postUninstCB)(MatPipeline*, Geometry*);
 	// RW has more:
@@ -199,7 +200,7 @@ void insertVertex(Geometry *geo, int32 i, uint32 mask, Vertex *v);
 extern ObjPipeline *defaultObjPipe;
 extern MatPipeline *defaultMatPipe;
 
-void genericUninstanceCB(MatPipeline *pipe, Geometry *geo, uint32 flags[], Mesh *mesh, uint8 *data[]);
+void genericUninstanceCB(MatPipeline *pipe, Geometry *geo, uint32 flags[], VertexHash *hash, Mesh *mesh, uint8 *data[]);
 void genericPreCB(MatPipeline *pipe, Geometry *geo);	// skin and ADC
 //void defaultUninstanceCB(MatPipeline *pipe, Geometry *geo, uint32 flags[], Mesh *mesh, uint8 *data[]);
 void skinInstanceCB(MatPipeline *, Geometry *g, Mesh *m, uint8 **data);
@@ -281,6 +282,10 @@ void registerNativeRaster(void);
 Texture *readNativeTexture(Stream *stream);
 void writeNativeTexture(Texture *tex, Stream *stream);
 uint32 getSizeNativeTexture(Texture *tex);
+// In place between linear and GS order, for PAL8/PAL4 rasters
+// with the matching SWIZZLED flag. Nothing happens otherwise.
+void swizzleRaster(Raster *raster);
+void unswizzleRaster(Raster *raster);
 
 
 
@@ -12,7 +12,7 @@ void initSkin(void);
 ObjPipeline *makeSkinPipeline(void);
 
 void insertVertexSkin(Geometry *geo, int32 i, uint32 mask, Vertex *v);
-int32 findVertexSkin(Geometry *g, uint32 flags[], uint32 mask, Vertex *v);
+int32 findVertexSkin(Geometry *g, uint32 flags[], uint32 mask, Vertex *v, VertexHash *hash = nil);
 
 Stream *readNativeSkin(Stream *stream, int32, void *object, int32 offset);
 Stream *writeNativeSkin(Stream *stream, int32 len, void *object, int32 offset);
@@ -20,7 +20,7 @@
 
 namespace rw {
 
-int32 Raster::numAllocated;
+atomic32 Raster::numAllocated;
 
 struct RasterGlobals
 {
@@ -157,12 +157,37 @@ Raster::imageFindRasterFormat(Image *image, int32 type,
 		image, type, pWidth, pHeight, pDepth, pFormat);
 }
 
+// Fill the lower levels from the image when the driver doesn't
+// generate them itself (such rasters report only one level).
+static void
+fillMipmaps(Raster *raster, Driver *drv, Image *image)
+{
+	Image *levels[32];
+	int32 i, numLevels;
+
+	numLevels = raster->getNumLevels();
+	if(numLevels <= 1)
+		return;
+	numLevels = image->makeMipmaps(levels, numLevels);
+	for(i = 1; i < numLevels; i++){
+		raster->lock(i, Raster::LOCKWRITE|Raster::LOCKNOFETCH);
+		drv->rasterFromImage(raster, levels[i]);
+		raster->unlock(i);
+		levels[i]->destroy();
+	}
+}
+
 Raster*
 Raster::setFromImage(Image *image, int32 platform)
 {
-	if(engine->driver[platform ? platform : rw::platform]->rasterFromImage(this, image))
-		return this;
-	return nil;
+	Driver *drv = engine->driver[platform ? platform : rw::platform];
+	// a locked raster is being filled one level at a time
+	bool32 wholeRaster = (this->privateFlags & (PRIVATELOCK_READ|PRIVATELOCK_WRITE)) == 0;
+	if(!drv->rasterFromImage(this, image))
+		return nil;
+	if(wholeRaster && (this->format & (MIPMAP|AUTOMIPMAP)) == (MIPMAP|AUTOMIPMAP))
+		fillMipmaps(this, drv, image);
+	return this;
 }
 
 Raster*
@@ -58,11 +58,15 @@ struct Animation
 	float32  duration;
 	void    *keyframes;
 	void    *customData;
+	int32   *keyFrameNodes;	// node index of every keyframe
+	int32   *nodeKeyFrames;	// keyframes of every node in order
+	int32   *nodeKeyStart;	// of each node in nodeKeyFrames, numNodes+1
 
 	static Animation *create(AnimInterpolatorInfo*, int32 numFrames,
 	                         int32 flags, float duration);
 	void destroy(void);
 	int32 getNumNodes(void);
+	void updateKeyFrameNodes(int32 numNodes);
 	KeyFrameHeader *getAnimFrame(int32 n){
 		return (KeyFrameHeader*)((uint8*)this->keyframes +
 		                         n*this->interpInfo->animKeyFrameSize);
@@ -95,6 +99,7 @@ struct AnimInterpolator
 	void destroy(void);
 	bool32 setCurrentAnim(Animation *anim);
 	void addTime(float32 t);
+	void setCurrentTime(float32 t);
 	void *getFrames(void){ return this+1;}
 	InterpFrameHeader *getInterpFrame(int32 n){
 		return (InterpFrameHeader*)((uint8*)getFrames() +
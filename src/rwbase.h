@@ -1,5 +1,6 @@
 #ifndef RW_PS2
 #include <stdint.h>
+#include <atomic>
 #endif
 #include <math.h>
 #ifndef M_PI
@@ -70,6 +71,15 @@ typedef int32 bool32;
 typedef uint8 byte;
 typedef uint32 uint;
 
+// For state shared between loading threads. The PS2 has no threads.
+#ifdef RW_PS2
+typedef int32 atomic32;
+#define RWTHREADLOCAL
+#else
+typedef std::atomic<int32> atomic32;
+#define RWTHREADLOCAL thread_local
+#endif
+
 #ifndef nil
 #define nil NULL
 #endif
@@ -389,12 +399,18 @@ struct Matrix
 	static Matrix *invertGeneral(Matrix *dst, const Matrix *src);
 	static void makeRotation(Matrix *dst, const V3d *axis, float32 angle);
 	static void makeRotation(Matrix *dst, const Quat &q);
+	static void makeRotations(Matrix *dst, const Quat *q, int32 n, int32 stride);
 private:
 	float32 normalError(void);
 	float32 orthogonalError(void);
 	float32 identityError(void);
 };
 
+// Use the SSE2/NEON versions of the matrix and transform functions
+// when built with them. Off means the scalar reference code.
+void setSimdMath(bool32 b);	// default: true
+bool32 getSimdMath(void);
+
 inline void convMatrix(Matrix *dst, RawMatrix *src){
 	*dst = *(Matrix*)src;
 	dst->optimize();
@@ -482,6 +498,8 @@ inline void memLittle16(void *data, uint32 size) { }
  */
 
 void makePath(char *filename);
+// forget cached directory listings used by makePath
+void flushPathCache(void);
 
 class Stream
 {
@@ -493,6 +511,11 @@ public:
 	virtual void seek(int32 offset, int32 whence = 1) = 0;
 	virtual uint32 tell(void) = 0;
 	virtual bool eof(void) = 0;
+	// Direct access to the stream's bytes if they are in memory,
+	// nil otherwise. Data is little endian as in the file.
+	virtual uint8 *getPointer(uint32 offset, uint32 length);
+	// Whether endChunk patches in chunk sizes, see beginChunk.
+	virtual bool32 patchesSizes(void) { return 0; }
 	uint32  write32(const void *data, uint32 length);
 	uint32  write16(const void *data, uint32 length);
 	uint32  read32(void *data, uint32 length);
@@ -520,6 +543,8 @@ public:
 	uint32 length;
 	uint32 capacity;
 	uint32 position;
+	bool32 growable;	// data is ours and grows on write
+	bool32 patchSizes;
 
 	void close(void);
 	uint32 write8(const void *data, uint32 length);
@@ -527,7 +552,13 @@ public:
 	void seek(int32 offset, int32 whence = 1);
 	uint32 tell(void);
 	bool eof(void);
+	uint8 *getPointer(uint32 offset, uint32 length);
+	bool32 patchesSizes(void) { return this->patchSizes; }
 	StreamMemory *open(uint8 *data, uint32 length, uint32 capacity = 0);
+	// Empty stream that allocates its own memory and doubles it when
+	// full. Freed by close. With patchSizes chunk sizes are filled
+	// in by endChunk so writers don't have to size objects first.
+	StreamMemory *openGrowable(uint32 capacity = 0, bool32 patchSizes = 1);
 	uint32 getLength(void);
 
 	enum {
@@ -535,6 +566,19 @@ public:
 	};
 };
 
+// Read-only stream over a whole file mapped into memory.
+// Falls back to reading the file into memory if mapping isn't possible.
+// NB: mapping bypasses engine->filefuncs
+class StreamMapped : public StreamMemory
+{
+public:
+	bool32 mapped;
+	StreamMapped(void) { data = nil; length = capacity = position = 0; growable = patchSizes = 0; mapped = 0; }
+	void close(void);
+	uint32 write8(const void *data, uint32 length);
+	StreamMapped *open(const char *path);
+};
+
 class StreamFile : public Stream
 {
 public:
@@ -732,9 +776,48 @@ struct ChunkHeaderInfo
 
 // TODO?: make these methods of ChunkHeaderInfo?
 bool writeChunkHeader(Stream *s, int32 type, int32 size);
+// Writes a chunk header and returns where it starts.
+// If the stream patches sizes, size is ignored and endChunk
+// fills in the real one, otherwise size has to be right.
+uint32 beginChunk(Stream *s, int32 type, int32 size);
+void endChunk(Stream *s, uint32 start);
 bool readChunkHeaderInfo(Stream *s, ChunkHeaderInfo *header);
 bool findChunk(Stream *s, uint32 type, uint32 *length, uint32 *version);
 
+// Table of all chunks in a stream for random access.
+// Chunks whose data parses as a sequence of chunks with the same
+// library ID are indexed recursively, everything else is a leaf.
+struct ChunkIndex
+{
+	struct Entry
+	{
+		uint32 type;
+		uint32 length;
+		uint32 version, build;
+		uint32 offset;	// of the chunk header
+		int32 parent;	// -1 for top level chunks
+		int32 next;	// next sibling, -1 for last
+	};
+	int32 numEntries;
+	int32 space;
+	Entry *entries;
+	uint32 streamSize;	// length of the indexed stream
+
+	static ChunkIndex *create(void);
+	void destroy(void);
+	bool32 build(Stream *stream);
+	// returns index of n-th child of parent with type (any type if 0)
+	int32 findChild(int32 parent, uint32 type, int32 n = 0);
+	int32 getFirstChild(int32 parent);
+	// position stream at the data of an entry, i.e. just after its header
+	bool32 seek(Stream *stream, int32 entry);
+	// sidecar files, reading fails if data isn't the indexed stream
+	static ChunkIndex *streamRead(Stream *stream, Stream *data);
+	bool32 streamWrite(Stream *stream);
+	static ChunkIndex *read(const char *filename, Stream *data);
+	bool32 write(const char *filename);
+};
+
 int32 findPointer(void *p, void **list, int32 num);
 uint8 *getFileContents(const char *name, uint32 *len);
 }
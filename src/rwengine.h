@@ -211,7 +211,7 @@ extern Engine *engine;
 #define RWTOSTR(X) RWTOSTR_(X)
 #define RWHERE "file: " __FILE__ " line: " RWTOSTR(__LINE__)
 
-extern const char *allocLocation;
+extern RWTHREADLOCAL const char *allocLocation;
 
 inline void *malloc_LOC(size_t sz, uint32 hint, const char *here) { allocLocation = here; return rw::Engine::memfuncs.rwmalloc(sz,hint); }
 inline void *realloc_LOC(void *p, size_t sz, uint32 hint, const char *here) { allocLocation = here; return rw::Engine::memfuncs.rwrealloc(p,sz,hint); }
@@ -235,6 +235,53 @@ extern MemoryFunctions defaultMemfuncs;
 extern MemoryFunctions managedMemfuncs;
 void printleaks(void);	// when using managed mem funcs
 
+// Allocator that honours MemHint durations, see arena.cpp.
+// FRAME allocations are only valid until resetFrameArena.
+struct MemoryStats
+{
+	uint32 id;
+	int32 numBlocks;	// live blocks
+	size_t bytes;		// live bytes
+	size_t peakBytes;
+	uint32 numAllocs;	// total number of allocations
+};
+extern MemoryFunctions arenaMemfuncs;
+void setArenaSizes(size_t functionSize, size_t frameSize);	// before Engine::init
+void resetFrameArena(void);
+void releaseArenas(void);	// after Engine::term
+const MemoryStats *getMemDurationStats(uint32 memdur);
+const MemoryStats *getMemIdStats(uint32 id);	// nil if never allocated
+void printMemStats(void);
+
+// Threads. On platforms without threads everything runs on the calling thread.
+typedef void (*JobFunc)(int32 i, void *data);
+int32 getNumProcessors(void);
+void parallelFor(int32 n, int32 numThreads, JobFunc func, void *data);
+// Jobs that run on worker threads while the caller produces more.
+struct JobQueue;
+JobQueue *createJobQueue(int32 numThreads, JobFunc func, void *data);
+void pushJob(JobQueue *q, int32 i);	// blocks while too many are pending
+void finishJobs(JobQueue *q);	// waits for all and destroys q
+void stopJobThreads(void);
+void lockEngine(void);
+void unlockEngine(void);
+
+struct TexDictionary;
+
+// State of a thread that loads objects while another one renders.
+// Frames dirtied on that thread go to its own list, so it has to call
+// Frame::syncDirty before handing objects over. TexDictionary::setCurrent
+// and getCurrent use the context's dictionary.
+struct LoaderContext
+{
+	LinkList frameDirtyList;
+	TexDictionary *currentTexDict;
+
+	void init(void) { this->frameDirtyList.init(); this->currentTexDict = nil; }
+};
+void setLoaderContext(LoaderContext *ctx);	// nil to use the engine's state again
+LoaderContext *getLoaderContext(void);
+
 namespace null {
 	void beginUpdate(Camera*);
 	void endUpdate(Camera*);
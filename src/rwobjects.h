@@ -54,8 +54,10 @@ struct Frame
 	Frame *child;
 	Frame *next;
 	Frame *root;
+	struct FrameHierarchy *hierarchy;	// flattened hierarchy, only in root
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+	static ObjPool s_pool;
 
 	static Frame *create(void);
 	Frame *cloneHierarchy(void);
@@ -87,6 +89,9 @@ struct Frame
 	static void registerModule(void);
 #endif
 	static void syncDirty(void);
+	// sync LTMs of dirty hierarchies on n threads (0 = all processors)
+	static void setNumSyncThreads(int32 n);	// default: 1
+	static int32 getNumSyncThreads(void);
 };
 
 struct FrameList_
@@ -133,7 +138,17 @@ struct Image
 	uint8 *pixels;
 	uint8 *palette;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+
+	enum DXTFit {
+		DXTRANGEFIT,	// fast
+		DXTCLUSTERFIT	// slower, better quality
+	};
+	enum MipFilter {
+		MIPBOX,
+		MIPTRIANGLE,
+		MIPKAISER	// sharpest
+	};
 
 	static Image *create(int32 width, int32 height, int32 depth);
 	void destroy(void);
@@ -141,11 +156,31 @@ struct Image
 	void free(void);
 	void setPixels(uint8 *pixels);
 	void setPixelsDXT(int32 type, uint8 *pixels);
+	void getPixelsDXT(int32 type, uint8 *pixels);
+	static void setNumDXTThreads(int32 n);	// default: 1
+	static int32 getNumDXTThreads(void);
+	static void setDXTFit(int32 fit);	// default: DXTRANGEFIT
+	static int32 getDXTFit(void);
+	// levels[0] is this image, the caller destroys the others
+	int32 makeMipmaps(Image **levels, int32 maxLevels);
+	static void setMipmapFilter(int32 filter);	// default: MIPBOX
+	static int32 getMipmapFilter(void);
+	static void setMipmapGamma(float32 gamma);	// default: 2.2, 1 filters without gamma
+	static float32 getMipmapGamma(void);
+	static void setMipmapAlphaRef(int32 ref);	// default: 128, cut-out alpha only, 0 turns it off
+	static int32 getMipmapAlphaRef(void);
 	void setPalette(uint8 *palette);
 	void compressPalette(void);	// turn 8 bit into 4 bit if possible
 	bool32 hasAlpha(void);
+	bool32 hasCutoutAlpha(void);	// alpha is only ever 0 or 255
 	void convertTo32(void);
 	void palettize(int32 depth);
+	static void setPalettizeRefine(int32 numPasses);	// default: 0, k-means passes
+	static int32 getPalettizeRefine(void);
+	static void setPalettizeDither(bool32 dither);	// default: 0
+	static bool32 getPalettizeDither(void);
+	static void setNumPalettizeThreads(int32 n);	// default: 1
+	static int32 getNumPalettizeThreads(void);
 	void unpalettize(bool forceAlpha = false);
 	void makeMask(void);
 	void applyMask(Image *mask);
@@ -186,17 +221,22 @@ struct ColorQuant
 		Node *children[16];
 		LLLink link;
 
-		void destroy(void);
 		void addColor(RGBA color);
 		bool isLeaf(void) { for(int32 i = 0; i < 16; i++) if(this->children[i]) return false; return true; }
 	};
 
 	Node *root;
 	LinkList leaves;
+	int32 numLeaves;
+	Node *freeNodes;
+	Node *nodeBlocks;
+	RGBA palette[256];
+	int32 numColors;
 
 	void init(void);
 	void destroy(void);
 	Node *createNode(int32 level);
+	void destroyNode(Node *node);
 	Node *getNode(Node *root, uint32 addr, int32 level);
 	Node *findNode(Node *root, uint32 addr, int32 level);
 	void reduceNode(Node *node);
@@ -204,7 +244,9 @@ struct ColorQuant
 	uint8 findColor(RGBA color);
 	void addImage(Image *img);
 	void makePalette(int32 numColors, RGBA *colors);
-	void matchImage(uint8 *dstPixels, uint32 dstStride, Image *src);
+	void refinePalette(Image *img, int32 numPasses, RGBA *colors);
+	// nearest palette color, in parallel unless dithering
+	void matchImage(uint8 *dstPixels, uint32 dstStride, Image *src, bool32 dither = 0);
 };
 
 // used to emulate d3d and xbox textures
@@ -243,7 +285,7 @@ struct Raster
 	Raster *parent;
 	int32 offsetX, offsetY;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
 
 	static Raster *create(int32 width, int32 height, int32 depth,
 	                      int32 format, int32 platform = 0);
@@ -297,6 +339,7 @@ struct Raster
 		CAMERA        = 0x02,
 		TEXTURE       = 0x04,
 		CAMERATEXTURE = 0x05,
+		COMPRESSED    = 0x40,	// DXT texture, d3d8, d3d9 and xbox only
 		DONTALLOCATE  = 0x80
 	};
 	enum LockMode {
@@ -371,15 +414,19 @@ struct Texture
 	char name[32];
 	char mask[32];
 	uint32 filterAddressing; // VVVVUUUU FFFFFFFF
-	int32 refCount;
+	atomic32 refCount;
 
 	LLLink inGlobalList;	// actually not in RW
+	uint32 nameHash;	// name hash chain, not in RW either
+	Texture *hashNext;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+	static ObjPool s_pool;
 
 	static Texture *create(Raster *raster);
 	void addRef(void) { this->refCount++; }
 	void destroy(void);
+	void setName(const char *name);	// keeps the dictionary hash valid
 	static Texture *fromDict(LLLink *lnk){
 		return LLLinkGetData(lnk, Texture, inDict); }
 	FilterMode getFilter(void) { return (FilterMode)(filterAddressing & 0xFF); }
@@ -400,6 +447,7 @@ struct Texture
 	static Texture *(*readCB)(const char *name, const char *mask);
 	static void setLoadTextures(bool32);	// default: true
 	static void setCreateDummies(bool32);	// default: false
+	static void setFindInAllDicts(bool32);	// default: false
 	static void setMipmapping(bool32);	// default: false
 	static void setAutoMipmapping(bool32);	// default: false
 	static bool32 getMipmapping(void);
@@ -432,9 +480,10 @@ struct Material
 	RGBA color;
 	SurfaceProperties surfaceProps;
 	Pipeline *pipeline;
-	int32 refCount;
+	atomic32 refCount;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+	static ObjPool s_pool;
 
 	static Material *create(void);
 	void addRef(void) { this->refCount++; }
@@ -455,6 +504,16 @@ struct Mesh
 	Material *material;
 };
 
+// Post-transform vertex cache statistics, see MeshHeader::getCacheStats
+struct MeshCacheStats
+{
+	float32 acmr;	// transformed vertices per triangle
+	float32 atvr;	// transformed vertices per referenced vertex
+	int32 numTriangles;	// not counting degenerate ones
+	int32 numStrips;	// runs of non-degenerate strip triangles
+	int32 numStitches;	// degenerate strip triangles
+};
+
 struct MeshHeader
 {
 	enum {
@@ -470,6 +529,7 @@ struct MeshHeader
 	Mesh *getMeshes(void) { return (Mesh*)(this+1); }
 	void setupIndices(void);
 	uint32 guessNumTriangles(void);
+	void getCacheStats(MeshCacheStats *stats, int32 cacheSize = 16);
 };
 
 struct Geometry;
@@ -510,6 +570,24 @@ struct MaterialList
 	uint32 streamGetSize(void);
 };
 
+// Finds vertices with the same position quickly, for welding
+// vertices when rebuilding indexed geometry on uninstance.
+// A chain holds all vertices whose positions fall into the same
+// bucket, newest first; callers compare the actual attributes.
+struct VertexHash
+{
+	int32 *heads;
+	int32 *links;
+	uint32 mask;
+
+	void init(int32 maxVertices);
+	void deinit(void);
+	void add(int32 i, const V3d &p) { uint32 h = hash(p); links[i] = heads[h]; heads[h] = i; }
+	int32 first(const V3d &p) { return heads[hash(p)]; }
+	int32 next(int32 i) { return links[i]; }
+	uint32 hash(const V3d &p);
+};
+
 struct Geometry
 {
 	PLUGINBASE
@@ -517,6 +595,7 @@ struct Geometry
 	Object object;
 	uint32 flags;
 	uint16 lockedSinceInst;
+	uint16 packed;		// parts allocated together with the geometry
 	int32 numTriangles;
 	int32 numVertices;
 	int32 numMorphTargets;
@@ -532,11 +611,19 @@ struct Geometry
 	MeshHeader *meshHeader;
 	InstanceDataHeader *instData;
 
-	int32 refCount;
+	atomic32 refCount;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+	static ObjPool s_pool;
 
 	static Geometry *create(int32 numVerts, int32 numTris, uint32 flags);
+	// everything but the meshes in a single allocation
+	static Geometry *createPacked(int32 numVerts, int32 numTris, uint32 flags, int32 numMorphTargets);
+	static void setPackedStreamRead(bool32 b);	// default: on
+	static bool32 getPackedStreamRead(void);
+	// order triangle lists built by buildMeshes for the vertex cache
+	static void setOptimizeMeshes(bool32 b);	// default: off
+	static bool32 getOptimizeMeshes(void);
 	void addRef(void) { this->refCount++; }
 	void destroy(void);
 	void lock(int32 lockFlags);
@@ -549,6 +636,9 @@ struct Geometry
 	void generateTriangles(int8 *adc = nil);
 	void buildMeshes(void);
 	void buildTristrips(void);	// private, used by buildMeshes
+	void optimizeTriangleOrder(void);
+	void orderTrianglesForCache(void);	// private, used by buildMeshes
+	void optimizeVertexOrder(uint16 *remap = nil);
 	void correctTristripWinding(void);
 	void removeUnusedMaterials(void);
 	static Geometry *streamRead(Stream *stream);
@@ -577,6 +667,13 @@ struct Geometry
 		NATIVEINSTANCE = 0x02000000
 	};
 
+	enum PackedFlags
+	{
+		PACKEDDATA   = 0x0001,	// triangles, colors and tex coords
+		PACKEDMORPHS = 0x0002,	// morph targets with their vertices
+		PACKEDBLOCK  = 0x0004	// the block itself, not from the pool
+	};
+
 	enum LockFlags
 	{
 		LOCKPOLYGONS     = 0x0001,
@@ -632,7 +729,8 @@ struct Atomic
 	World *world;
 	ObjectWithFrame::Sync originalSync;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+	static ObjPool s_pool;
 
 	static Atomic *create(void);
 	Atomic *clone(void);
@@ -685,7 +783,7 @@ struct Light
 	World *world;
 	ObjectWithFrame::Sync originalSync;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
 
 	static Light *create(int32 type);
 	void destroy(void);
@@ -773,7 +871,7 @@ struct Camera
 	void (*originalBeginUpdate)(Camera*);
 	void (*originalEndUpdate)(Camera*);
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
 
 	static Camera *create(void);
 	Camera *clone(void);
@@ -812,7 +910,8 @@ struct Clump
 	World *world;
 	LLLink inWorld;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
+	static ObjPool s_pool;
 
 	static Clump *create(void);
 	Clump *clone(void);
@@ -859,7 +958,7 @@ struct World
 	LinkList globalLights;	// these do not (type < 0x80)
 	LinkList clumps;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
 
 	static World *create(BBox *bbox = nil);	// TODO: should probably make this non-optional
 	void destroy(void);
@@ -884,7 +983,7 @@ struct TexDictionary
 	LinkList textures;
 	LLLink inGlobalList;
 
-	static int32 numAllocated;
+	static atomic32 numAllocated;
 
 	static TexDictionary *create(void);
 	static TexDictionary *fromLink(LLLink *lnk){
@@ -895,12 +994,16 @@ struct TexDictionary
 	void addFront(Texture *t);
 	void remove(Texture *t);
 	Texture *find(const char *name);
+	static Texture *findAny(const char *name);
 	static TexDictionary *streamRead(Stream *stream);
 	void streamWrite(Stream *stream);
 	uint32 streamGetSize(void);
 
 	static void setCurrent(TexDictionary *txd);
 	static TexDictionary *getCurrent(void);
+	// read native textures on n threads (0 = all processors)
+	static void setNumReadThreads(int32 n);	// default: 1
+	static int32 getNumReadThreads(void);
 };
 
 }
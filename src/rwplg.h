@@ -12,15 +12,22 @@ typedef int32 (*StreamGetSize)(void *object, int32 offset, int32 size);
 typedef void (*RightsCallback)(void *object, int32 offset, int32 size, uint32 data);
 typedef void (*AlwaysCallback)(void *object, int32 offset, int32 size);
 
+struct Plugin;
+
 struct PluginList
 {
 	int32 size;
 	int32 defaultSize;
 	LinkList plugins;
+	Plugin **idTable;	// plugins hashed by id
+	uint32 idMask;
+	int32 lazyOffset;	// unparsed extension chunks per object, -1 if none
+	atomic32 numObjects;	// constructed and not yet destructed
 
-	PluginList(void) {}
+	PluginList(void) : idTable(nil), idMask(0), lazyOffset(-1), numObjects(0) {}
 	PluginList(int32 defSize)
-	 : size(defSize), defaultSize(defSize)
+	 : size(defSize), defaultSize(defSize),
+	   idTable(nil), idMask(0), lazyOffset(-1), numObjects(0)
 	{ plugins.init(); }
 
 	static void open(void);
@@ -40,7 +47,15 @@ struct PluginList
 	int32 registerStream(uint32 id, StreamRead, StreamWrite, StreamGetSize);
 	int32 setStreamRightsCallback(uint32 id, RightsCallback cb);
 	int32 setStreamAlwaysCallback(uint32 id, AlwaysCallback cb);
+	// Lazy plugins keep their extension chunk as raw bytes when read.
+	// It is parsed by parseLazy and written back unchanged until then,
+	// so the plugin has to call parseLazy before touching its data.
+	// Set before Engine::open, when no objects exist and the pools
+	// aren't sized yet.
+	int32 setStreamLazy(uint32 id, bool32 lazy);
+	void parseLazy(void *object, uint32 id);
 	int32 getPluginOffset(uint32 id);
+	Plugin *findPlugin(uint32 id);
 };
 
 struct Plugin
@@ -56,11 +71,53 @@ struct Plugin
 	StreamGetSize getSize;
 	RightsCallback rightsCallback;
 	AlwaysCallback alwaysCallback;
+	bool32 lazy;
 	PluginList *parentList;
 	LLLink inParentList;
 	LLLink inGlobalList;
 };
 
+struct ObjPoolStats
+{
+	int32 slotSize;
+	int32 numSlabs;
+	int32 numSlots;		// in all slabs
+	int32 numLive;
+	uint32 numAllocs;	// total
+};
+
+// Fixed size slots for the objects of one PluginList, carved out of
+// slabs. The slot size is the list's size when the pool is set up,
+// at Engine::open or the first alloc, so all plugins must be
+// registered by then. Free slots are kept on an intrusive free list.
+// With thread caches each thread keeps some slots of its own and only
+// takes the engine lock to move a batch of them.
+struct ObjPool
+{
+	PluginList *plglist;
+	uint32 id;		// MemHint id of the slabs
+	int32 index;
+	int32 slotSize;
+	int32 slotsPerSlab;
+	void *freeList;
+	void *slabs;
+	int32 numSlabs;
+	uint32 generation;	// changes when slabs are released
+	atomic32 numLive;
+	atomic32 numAllocs;
+
+	ObjPool(PluginList *plglist, uint32 id);
+	void init(void);
+	void release(void);
+	void *alloc(void);
+	void free(void *p);
+	void getStats(ObjPoolStats *stats);
+};
+void initObjPools(void);
+void releaseObjPools(void);	// live objects are leaked
+void setObjPoolThreadCaches(bool32 enable);
+bool32 objPoolSized(PluginList *plglist);	// whether the slot size is fixed
+
 #define PLUGINBASE \
 	static PluginList s_plglist;						    \
 	static int32 registerPlugin(int32 size, uint32 id, Constructor ctor, 	    \
@@ -77,6 +134,9 @@ struct Plugin
 	static int32 setStreamAlwaysCallback(uint32 id, AlwaysCallback cb){	    \
 		return s_plglist.setStreamAlwaysCallback(id, cb);		    \
 	}									    \
+	static int32 setStreamLazy(uint32 id, bool32 lazy){			    \
+		return s_plglist.setStreamLazy(id, lazy);			    \
+	}									    \
 	static int32 getPluginOffset(uint32 id){				    \
 		return s_plglist.getPluginOffset(id);				    \
 	}
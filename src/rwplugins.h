@@ -20,6 +20,25 @@ struct HAnimInterpFrame
 	V3d            t;
 };
 
+// Compressed keyframe, interpolator HANIMCOMPRESSEDID.
+// Rotation is stored smallest-three in 48 bits,
+// translation as half floats relative to the custom data.
+// This is not RW's RtCompressedKeyFrame (id 2), so it has a private id.
+#define HANIMCOMPRESSEDID 0x1E02
+struct HAnimCompressedKeyFrame
+{
+	HAnimCompressedKeyFrame *prev;
+	float32        time;
+	uint16         q[3];
+	uint16         t[3];
+};
+
+struct HAnimCompressedCustomData
+{
+	V3d offset;
+	V3d scale;
+};
+
 struct HAnimNodeInfo
 {
 	int32 id;
@@ -38,6 +57,7 @@ struct HAnimHierarchy
 	Frame *parentFrame;
 	HAnimHierarchy *parentHierarchy;	// mostly unused
 	AnimInterpolator *interpolator;
+	int32 *parentIndices;	// from node flags
 
 	static HAnimHierarchy *create(int32 numNodes, int32 *nodeFlags,
 			int32 *nodeIDs, int32 flags, int32 maxKeySize);
@@ -46,7 +66,9 @@ struct HAnimHierarchy
 	void attach(void);
 	int32 getIndex(int32 id);
 	int32 getIndex(Frame *f);
+	void updateParentIndices(void);
 	void updateMatrices(void);
+	static void updateMatrices(HAnimHierarchy **hierarchies, int32 num, int32 numThreads = 0);
 
 	static HAnimHierarchy *get(Frame *f);
 	static HAnimHierarchy *get(Clump *c){
@@ -78,6 +100,9 @@ struct HAnimData
 extern int32 hAnimOffset;
 extern bool32 hAnimDoStream;
 void registerHAnimPlugin(void);
+// convert between standard and compressed keyframes, returns a new animation
+Animation *compressHAnimAnimation(Animation *anim);
+Animation *decompressHAnimAnimation(Animation *anim);
 
 
 /*
@@ -228,6 +253,7 @@ struct Skin
 	void findUsedBones(int32 numVertices);
 
 	static void setPipeline(Atomic *a, int32 type);
+	static bool32 skinVertices(Atomic *a, V3d *verts, V3d *normals, int32 numThreads = 1);
 	static Skin *get(const Geometry *geo){
 		return *PLUGINOFFSET(Skin*, geo, skinGlobals.geoOffset);
 	}
@@ -0,0 +1,142 @@
+// Private to librw: thin wrappers around the SSE2/NEON intrinsics.
+// Defines RW_SIMD when one of them is available.
+
+// SSE2 and NEON are part of the base x86-64/AArch64 ISAs,
+// so they are simply picked at build time. RW_NOSIMD turns them off.
+#ifndef RW_NOSIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RW_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RW_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(RW_SSE2) || defined(RW_NEON)
+#define RW_SIMD
+
+namespace rw {
+
+#ifdef RW_SSE2
+typedef __m128 vec4;
+static inline vec4 vload(const float32 *p) { return _mm_loadu_ps(p); }
+static inline void vstore(float32 *p, vec4 v) { _mm_storeu_ps(p, v); }
+static inline vec4 vdup(const float32 *p) { return _mm_set1_ps(*p); }
+static inline vec4 vadd(vec4 a, vec4 b) { return _mm_add_ps(a, b); }
+static inline vec4 vsub(vec4 a, vec4 b) { return _mm_sub_ps(a, b); }
+static inline vec4 vmul(vec4 a, vec4 b) { return _mm_mul_ps(a, b); }
+static inline vec4 vzero(void) { return _mm_setzero_ps(); }
+static inline float32 vgetx(vec4 v) { return _mm_cvtss_f32(v); }
+static inline vec4 vsplat(float32 x) { return _mm_set1_ps(x); }
+// all bits set where a < b
+static inline vec4 vcmplt(vec4 a, vec4 b) { return _mm_cmplt_ps(a, b); }
+// a where the mask is set, b elsewhere
+static inline vec4 vsel(vec4 m, vec4 a, vec4 b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+// xyz from a, w from b
+static inline vec4 vselxyz(vec4 a, vec4 b) {
+	const vec4 m = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+static inline vec4 vyzx(vec4 v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,0,2,1)); }
+static inline vec4 vzxy(vec4 v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,1,0,2)); }
+static inline void
+vtranspose(vec4 &r0, vec4 &r1, vec4 &r2, vec4 &r3)
+{
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+}
+// store the xyz of four vectors as 12 packed floats
+static inline void
+vstore3x4(float32 *p, vec4 r0, vec4 r1, vec4 r2, vec4 r3)
+{
+	vec4 t;
+	t = _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(0,0,2,2));
+	vstore(p, _mm_shuffle_ps(r0, t, _MM_SHUFFLE(2,0,1,0)));
+	vstore(p+4, _mm_shuffle_ps(r1, r2, _MM_SHUFFLE(1,0,2,1)));
+	t = _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(0,0,2,2));
+	vstore(p+8, _mm_shuffle_ps(t, r3, _MM_SHUFFLE(2,1,2,0)));
+}
+#endif
+
+#ifdef RW_NEON
+typedef float32x4_t vec4;
+static inline vec4 vload(const float32 *p) { return vld1q_f32(p); }
+static inline void vstore(float32 *p, vec4 v) { vst1q_f32(p, v); }
+static inline vec4 vdup(const float32 *p) { return vld1q_dup_f32(p); }
+static inline vec4 vadd(vec4 a, vec4 b) { return vaddq_f32(a, b); }
+static inline vec4 vsub(vec4 a, vec4 b) { return vsubq_f32(a, b); }
+static inline vec4 vmul(vec4 a, vec4 b) { return vmulq_f32(a, b); }
+static inline vec4 vzero(void) { return vdupq_n_f32(0.0f); }
+static inline float32 vgetx(vec4 v) { return vgetq_lane_f32(v, 0); }
+static inline vec4 vsplat(float32 x) { return vdupq_n_f32(x); }
+static inline vec4 vcmplt(vec4 a, vec4 b) { return vreinterpretq_f32_u32(vcltq_f32(a, b)); }
+static inline vec4 vsel(vec4 m, vec4 a, vec4 b) { return vbslq_f32(vreinterpretq_u32_f32(m), a, b); }
+static inline vec4 vselxyz(vec4 a, vec4 b) {
+	static const uint32 m[4] = { ~0u, ~0u, ~0u, 0 };
+	return vbslq_f32(vld1q_u32(m), a, b);
+}
+static inline vec4 vyzx(vec4 v) {
+	float32x2_t lo = vget_low_f32(v), hi = vget_high_f32(v);
+	return vcombine_f32(vext_f32(lo, hi, 1), lo);
+}
+static inline vec4 vzxy(vec4 v) {
+	float32x2_t lo = vget_low_f32(v), hi = vget_high_f32(v);
+	return vcombine_f32(vset_lane_f32(vget_lane_f32(lo, 0), hi, 1), vrev64_f32(lo));
+}
+static inline void
+vtranspose(vec4 &r0, vec4 &r1, vec4 &r2, vec4 &r3)
+{
+	float32x4x2_t t01 = vtrnq_f32(r0, r1);
+	float32x4x2_t t23 = vtrnq_f32(r2, r3);
+	r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+	r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+	r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+	r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+}
+static inline void
+vstore3x4(float32 *p, vec4 r0, vec4 r1, vec4 r2, vec4 r3)
+{
+	vstore(p, vsetq_lane_f32(vgetq_lane_f32(r1, 0), r0, 3));
+	vstore(p+4, vcombine_f32(vget_low_f32(vextq_f32(r1, r1, 1)), vget_low_f32(r2)));
+	vstore(p+8, vsetq_lane_f32(vgetq_lane_f32(r2, 2), vextq_f32(r3, r3, 3), 0));
+}
+#endif
+
+// 32 bit integer lanes
+#ifdef RW_SSE2
+typedef __m128i ivec4;
+static inline ivec4 iload(const void *p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void istore(void *p, ivec4 v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline ivec4 isplat(uint32 x) { return _mm_set1_epi32(x); }
+static inline ivec4 iand(ivec4 a, ivec4 b) { return _mm_and_si128(a, b); }
+static inline ivec4 ior(ivec4 a, ivec4 b) { return _mm_or_si128(a, b); }
+static inline ivec4 icmpeq(ivec4 a, ivec4 b) { return _mm_cmpeq_epi32(a, b); }
+// four bytes into the top byte of each lane
+static inline ivec4 ibytestop(const uint8 *p) {
+	ivec4 z = _mm_setzero_si128();
+	ivec4 b = _mm_cvtsi32_si128(*(const int32*)p);
+	return _mm_unpacklo_epi16(z, _mm_unpacklo_epi8(z, b));
+}
+#endif
+
+#ifdef RW_NEON
+typedef uint32x4_t ivec4;
+static inline ivec4 iload(const void *p) { return vreinterpretq_u32_u8(vld1q_u8((const uint8*)p)); }
+static inline void istore(void *p, ivec4 v) { vst1q_u8((uint8*)p, vreinterpretq_u8_u32(v)); }
+static inline ivec4 isplat(uint32 x) { return vdupq_n_u32(x); }
+static inline ivec4 iand(ivec4 a, ivec4 b) { return vandq_u32(a, b); }
+static inline ivec4 ior(ivec4 a, ivec4 b) { return vorrq_u32(a, b); }
+static inline ivec4 icmpeq(ivec4 a, ivec4 b) { return vceqq_u32(a, b); }
+static inline ivec4 ibytestop(const uint8 *p) {
+	uint8x8_t b = vreinterpret_u8_u32(vdup_n_u32(*(const uint32*)p));
+	return vshlq_n_u32(vmovl_u16(vget_low_u16(vmovl_u8(b))), 24);
+}
+#endif
+
+static inline vec4 vcross(vec4 a, vec4 b) {
+	return vsub(vmul(vyzx(a), vzxy(b)), vmul(vzxy(a), vyzx(b)));
+}
+
+}
+
+#endif
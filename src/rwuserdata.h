@@ -90,5 +90,8 @@ struct UserDataGlobals
 extern UserDataGlobals userDataGlobals;
 
 void registerUserDataPlugin(void);
+// Keep user data as raw bytes until it is accessed.
+// Call after registerUserDataPlugin, before creating objects.
+void setUserDataLazy(bool32 lazy);
 
 }
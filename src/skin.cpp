@@ -19,6 +19,7 @@
 #include "gl/rwwdgl.h"
 #include "gl/rwgl3.h"
 #include "gl/rwgl3plg.h"
+#include "rwsimdimpl.h"
 
 #define PLUGIN_ID ID_SKIN
 
@@ -293,6 +294,7 @@ readSkinLegacy(Stream *stream, int32 len, void *object, int32, int32)
 //			0.0f, 0.0f, 0.0f, 1.0f,
 //			mat.flags);
 	}
+	hier->updateParentIndices();
 	Frame *frame = atomic->getFrame()->child;
 	assert(frame->next == nil);	// in old files atomic is above hierarchy it seems
 	assert(frame->count() == numBones);	// assuming one frame per node this should also be true
@@ -476,6 +478,217 @@ Skin::findUsedBones(int32 numVertices)
 			this->usedBones[this->numUsedBones++] = i;
 }
 
+//
+// CPU skinning
+//
+
+// Bone matrices in atomic space, the same ones the GPU pipelines upload.
+// Only the used bones are calculated, the rest stay zero.
+static void
+calcSkinMatrices(Atomic *a, Skin *skin, HAnimHierarchy *hier, Matrix *mats)
+{
+	Matrix *invMats = (Matrix*)skin->inverseMatrices;
+	Matrix invAtmMat, tmp;
+	int32 i, b, n;
+	bool32 localSpace;
+
+	localSpace = hier->flags & HAnimHierarchy::LOCALSPACEMATRICES;
+	if(!localSpace)
+		Matrix::invert(&invAtmMat, a->getFrame()->getLTM());
+	n = skin->numUsedBones ? skin->numUsedBones : skin->numBones;
+	for(i = 0; i < n; i++){
+		b = skin->numUsedBones ? skin->usedBones[i] : i;
+		invMats[b].flags = 0;
+		if(localSpace)
+			Matrix::mult(&mats[b], &invMats[b], &hier->matrices[b]);
+		else{
+			Matrix::mult(&tmp, &hier->matrices[b], &invAtmMat);
+			Matrix::mult(&mats[b], &invMats[b], &tmp);
+		}
+		// the kernels read whole rows, keep w zero
+		mats[b].flags = 0;
+		mats[b].pad1 = 0;
+		mats[b].pad2 = 0;
+		mats[b].pad3 = 0;
+	}
+}
+
+struct SkinJob
+{
+	Skin *skin;
+	Matrix *mats;
+	V3d *inVerts, *inNormals;
+	V3d *outVerts, *outNormals;
+	int32 numVertices;
+};
+
+#define SKINBATCH 1024
+
+static void
+skinScalar(SkinJob *job, int32 start, int32 end)
+{
+	int32 i, j;
+	Matrix m, *b;
+	float32 w;
+	uint8 *indices = &job->skin->indices[start*4];
+	float32 *weights = &job->skin->weights[start*4];
+	int32 numWeights = job->skin->numWeights;
+
+	for(i = start; i < end; i++){
+		if(numWeights == 1)
+			m = job->mats[indices[0]];
+		else{
+			memset(&m, 0, sizeof(m));
+			for(j = 0; j < numWeights; j++){
+				w = weights[j];
+				b = &job->mats[indices[j]];
+				m.right = add(m.right, scale(b->right, w));
+				m.up = add(m.up, scale(b->up, w));
+				m.at = add(m.at, scale(b->at, w));
+				m.pos = add(m.pos, scale(b->pos, w));
+			}
+		}
+		V3d::transformPoints(&job->outVerts[i], &job->inVerts[i], 1, &m);
+		if(job->outNormals)
+			V3d::transformVectors(&job->outNormals[i], &job->inNormals[i], 1, &m);
+		indices += 4;
+		weights += 4;
+	}
+}
+
+#ifdef RW_SIMD
+// Store xyz without touching the w of the next vector
+// unless it's in our range anyway.
+static inline void
+vstore3(V3d *p, vec4 v, bool32 last)
+{
+	float32 tmp[4];
+	if(!last){
+		vstore(&p->x, v);
+		return;
+	}
+	vstore(tmp, v);
+	p->x = tmp[0];
+	p->y = tmp[1];
+	p->z = tmp[2];
+}
+
+// 1, 2 and 4 weight kernels; the matrix rows are blended
+// and the vertex transformed with the result.
+template <int NW>
+static void
+skinSIMD(SkinJob *job, int32 start, int32 end)
+{
+	int32 i, j;
+	vec4 r, u, a, p, w, v;
+	const float32 *m;
+	uint8 *indices = &job->skin->indices[start*4];
+	float32 *weights = &job->skin->weights[start*4];
+	const float32 *mats = (float32*)job->mats;
+
+	for(i = start; i < end; i++){
+		m = &mats[indices[0]*16];
+		if(NW == 1){
+			r = vload(m);
+			u = vload(m+4);
+			a = vload(m+8);
+			p = vload(m+12);
+		}else{
+			w = vdup(&weights[0]);
+			r = vmul(vload(m), w);
+			u = vmul(vload(m+4), w);
+			a = vmul(vload(m+8), w);
+			p = vmul(vload(m+12), w);
+			for(j = 1; j < NW; j++){
+				m = &mats[indices[j]*16];
+				w = vdup(&weights[j]);
+				r = vadd(r, vmul(vload(m), w));
+				u = vadd(u, vmul(vload(m+4), w));
+				a = vadd(a, vmul(vload(m+8), w));
+				p = vadd(p, vmul(vload(m+12), w));
+			}
+		}
+		v = vmul(r, vdup(&job->inVerts[i].x));
+		v = vadd(v, vmul(u, vdup(&job->inVerts[i].y)));
+		v = vadd(v, vmul(a, vdup(&job->inVerts[i].z)));
+		vstore3(&job->outVerts[i], vadd(v, p), i == end-1);
+		if(job->outNormals){
+			v = vmul(r, vdup(&job->inNormals[i].x));
+			v = vadd(v, vmul(u, vdup(&job->inNormals[i].y)));
+			v = vadd(v, vmul(a, vdup(&job->inNormals[i].z)));
+			vstore3(&job->outNormals[i], v, i == end-1);
+		}
+		indices += 4;
+		weights += 4;
+	}
+}
+#endif
+
+static void
+skinJob(int32 n, void *data)
+{
+	SkinJob *job = (SkinJob*)data;
+	int32 start = n*SKINBATCH;
+	int32 end = start + SKINBATCH;
+	if(end > job->numVertices)
+		end = job->numVertices;
+#ifdef RW_SIMD
+	if(getSimdMath()){
+		switch(job->skin->numWeights){
+		case 1: skinSIMD<1>(job, start, end); return;
+		case 2: skinSIMD<2>(job, start, end); return;
+		// 3 weights are rare, the fourth is just zero
+		default: skinSIMD<4>(job, start, end); return;
+		}
+	}
+#endif
+	skinScalar(job, start, end);
+}
+
+// Skin the first morph target of a skinned atomic on the CPU.
+// Results are in atomic space like in the GPU pipelines;
+// normals are not renormalized and may be nil.
+// The output arrays must not alias the geometry's.
+bool32
+Skin::skinVertices(Atomic *a, V3d *verts, V3d *normals, int32 numThreads)
+{
+	Geometry *geo = a->geometry;
+	Skin *skin = Skin::get(geo);
+	HAnimHierarchy *hier = Skin::getHierarchy(a);
+	MorphTarget *mt;
+	SkinJob job;
+
+	if(skin == nil || hier == nil || hier->matrices == nil ||
+	   skin->indices == nil || skin->weights == nil){
+		RWERROR((ERR_GENERAL, "atomic can't be skinned"));
+		return 0;
+	}
+	mt = &geo->morphTargets[0];
+	if(mt->vertices == nil){
+		RWERROR((ERR_GENERAL, "geometry has no vertices"));
+		return 0;
+	}
+	if(mt->normals == nil)
+		normals = nil;
+	assert(skin->numBones == hier->numNodes);
+
+	// zeroed so bogus indices with zero weight are harmless
+	job.mats = rwNewT(Matrix, 256, MEMDUR_FUNCTION | ID_SKIN);
+	memset(job.mats, 0, 256*sizeof(Matrix));
+	calcSkinMatrices(a, skin, hier, job.mats);
+
+	job.skin = skin;
+	job.inVerts = mt->vertices;
+	job.inNormals = mt->normals;
+	job.outVerts = verts;
+	job.outNormals = normals;
+	job.numVertices = geo->numVertices;
+	parallelFor((geo->numVertices + SKINBATCH-1)/SKINBATCH, numThreads, skinJob, &job);
+
+	rwFree(job.mats);
+	return 1;
+}
+
 void
 Skin::setPipeline(Atomic *a, int32 type)
 {
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 
 #define WITH_D3D
@@ -22,8 +23,9 @@
 
 namespace rw {
 
-int32 Texture::numAllocated;
-int32 TexDictionary::numAllocated;
+atomic32 Texture::numAllocated;
+ObjPool Texture::s_pool(&Texture::s_plglist, ID_TEXTURE);
+atomic32 TexDictionary::numAllocated;
 
 PluginList TexDictionary::s_plglist(sizeof(TexDictionary));
 PluginList Texture::s_plglist(sizeof(Texture));
@@ -39,9 +41,18 @@ struct TextureGlobals
 	bool32 makeDummies;
 	bool32 mipmapping;
 	bool32 autoMipmapping;
+	// find textures in all dictionaries, not just the current one
+	bool32 findInAllDicts;
+	// threads for TexDictionary::streamRead, 1 = serial
+	int32 numReadThreads;
 	LinkList texDicts;
 
 	LinkList textures;
+
+	// name hash of all textures in dictionaries
+	Texture **texHash;
+	int32 texHashSize;
+	int32 numHashedTextures;
 };
 int32 textureModuleOffset;
 
@@ -54,6 +65,9 @@ textureOpen(void *object, int32 offset, int32 size)
 	textureModuleOffset = offset;
 	TEXTUREGLOBAL(texDicts).init();
 	TEXTUREGLOBAL(textures).init();
+	TEXTUREGLOBAL(texHash) = nil;
+	TEXTUREGLOBAL(texHashSize) = 0;
+	TEXTUREGLOBAL(numHashedTextures) = 0;
 	texdict = TexDictionary::create();
 	TEXTUREGLOBAL(initialTexDict) = texdict;
 	TexDictionary::setCurrent(texdict);
@@ -61,6 +75,8 @@ textureOpen(void *object, int32 offset, int32 size)
 	TEXTUREGLOBAL(makeDummies) = 0;
 	TEXTUREGLOBAL(mipmapping) = 0;
 	TEXTUREGLOBAL(autoMipmapping) = 0;
+	TEXTUREGLOBAL(findInAllDicts) = 0;
+	TEXTUREGLOBAL(numReadThreads) = 1;
 	return object;
 }
 static void*
@@ -70,6 +86,9 @@ textureClose(void *object, int32 offset, int32 size)
 		TexDictionary::fromLink(lnk)->destroy();
 	TEXTUREGLOBAL(initialTexDict) = nil;
 	TEXTUREGLOBAL(currentTexDict) = nil;
+	rwFree(TEXTUREGLOBAL(texHash));
+	TEXTUREGLOBAL(texHash) = nil;
+	TEXTUREGLOBAL(texHashSize) = 0;
 
 	FORLIST(lnk, TEXTUREGLOBAL(textures)){
 		Texture *tex = LLLinkGetData(lnk, Texture, inGlobalList);
@@ -98,10 +117,144 @@ Texture::setCreateDummies(bool32 b)
 	TEXTUREGLOBAL(makeDummies) = b;
 }
 
+// Texture::streamRead overrides the mipmap state while it reads a texture.
+// The override is per thread so loaders on other threads don't see it.
+struct MipmapState
+{
+	bool32 set;
+	bool32 mipmapping;
+	bool32 autoMipmapping;
+};
+static RWTHREADLOCAL MipmapState streamMipState;
+
+void Texture::setFindInAllDicts(bool32 b) { TEXTUREGLOBAL(findInAllDicts) = b; }
 void Texture::setMipmapping(bool32 b) { TEXTUREGLOBAL(mipmapping) = b; }
 void Texture::setAutoMipmapping(bool32 b) { TEXTUREGLOBAL(autoMipmapping) = b; }
-bool32 Texture::getMipmapping(void) { return TEXTUREGLOBAL(mipmapping); }
-bool32 Texture::getAutoMipmapping(void) { return TEXTUREGLOBAL(autoMipmapping); }
+bool32
+Texture::getMipmapping(void)
+{
+	return streamMipState.set ? streamMipState.mipmapping : TEXTUREGLOBAL(mipmapping);
+}
+bool32
+Texture::getAutoMipmapping(void)
+{
+	return streamMipState.set ? streamMipState.autoMipmapping : TEXTUREGLOBAL(autoMipmapping);
+}
+
+//
+// Texture name hash
+//
+// Every texture that is in a dictionary is chained into one
+// case insensitive hash table. Textures in one dictionary keep the
+// order of the dictionary's list in their chain, so find returns the same
+// texture a linear search would.
+// Textures in a dictionary have to be renamed with setName.
+//
+
+static uint32
+hashTexName(const char *name)
+{
+	uint32 h = 2166136261u;
+	for(int32 i = 0; i < 32 && name[i]; i++)
+		h = (h ^ (uint8)tolower(name[i])) * 16777619u;
+	return h;
+}
+
+static void
+hashInsert(Texture **table, int32 size, Texture *t, bool32 front)
+{
+	Texture **p = &table[t->nameHash & (size-1)];
+	if(!front)
+		while(*p)
+			p = &(*p)->hashNext;
+	t->hashNext = *p;
+	*p = t;
+}
+
+static void
+growTexHash(void)
+{
+	int32 i, size;
+	Texture **table, *t, *next;
+
+	size = TEXTUREGLOBAL(texHashSize)*2;
+	if(size == 0)
+		size = 256;
+	table = rwNewT(Texture*, size, MEMDUR_GLOBAL | ID_TEXTUREMODULE);
+	memset(table, 0, size*sizeof(Texture*));
+	for(i = 0; i < TEXTUREGLOBAL(texHashSize); i++)
+		for(t = TEXTUREGLOBAL(texHash)[i]; t; t = next){
+			next = t->hashNext;
+			hashInsert(table, size, t, 0);
+		}
+	rwFree(TEXTUREGLOBAL(texHash));
+	TEXTUREGLOBAL(texHash) = table;
+	TEXTUREGLOBAL(texHashSize) = size;
+}
+
+static void
+addToHash(Texture *t, bool32 front)
+{
+	if(TEXTUREGLOBAL(numHashedTextures) >= TEXTUREGLOBAL(texHashSize))
+		growTexHash();
+	t->nameHash = hashTexName(t->name);
+	hashInsert(TEXTUREGLOBAL(texHash), TEXTUREGLOBAL(texHashSize), t, front);
+	TEXTUREGLOBAL(numHashedTextures)++;
+}
+
+static void
+removeFromHash(Texture *t)
+{
+	Texture **p = &TEXTUREGLOBAL(texHash)[t->nameHash & (TEXTUREGLOBAL(texHashSize)-1)];
+	for(; *p; p = &(*p)->hashNext)
+		if(*p == t){
+			*p = t->hashNext;
+			t->hashNext = nil;
+			TEXTUREGLOBAL(numHashedTextures)--;
+			return;
+		}
+}
+
+// Put t back into its chain after its name changed, before the next
+// texture of its dictionary that shares the bucket.
+static void
+rehashTexture(Texture *t)
+{
+	Texture **table = TEXTUREGLOBAL(texHash);
+	uint32 mask = TEXTUREGLOBAL(texHashSize)-1;
+	Texture *next, **p;
+	LLLink *lnk;
+
+	removeFromHash(t);
+	t->nameHash = hashTexName(t->name);
+	next = nil;
+	for(lnk = t->inDict.next; lnk != t->dict->textures.end(); lnk = lnk->next)
+		if((Texture::fromDict(lnk)->nameHash & mask) == (t->nameHash & mask)){
+			next = Texture::fromDict(lnk);
+			break;
+		}
+	for(p = &table[t->nameHash & mask]; *p != next; p = &(*p)->hashNext);
+	t->hashNext = *p;
+	*p = t;
+	TEXTUREGLOBAL(numHashedTextures)++;
+}
+
+// dict == nil finds the texture in any dictionary
+static Texture*
+findInHash(TexDictionary *dict, const char *name)
+{
+	Texture *t;
+	uint32 h;
+
+	if(TEXTUREGLOBAL(texHashSize) == 0)
+		return nil;
+	h = hashTexName(name);
+	for(t = TEXTUREGLOBAL(texHash)[h & (TEXTUREGLOBAL(texHashSize)-1)]; t; t = t->hashNext)
+		if(t->nameHash == h && (dict == nil || t->dict == dict) &&
+		   strncmp_ci(t->name, name, 32) == 0)
+			return t;
+	return nil;
+}
 
 //
 // TexDictionary
@@ -115,10 +268,12 @@ TexDictionary::create(void)
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
 	}
-	numAllocated++;
 	dict->object.init(TexDictionary::ID, 0);
 	dict->textures.init();
+	lockEngine();
+	numAllocated++;
 	TEXTUREGLOBAL(texDicts).add(&dict->inGlobalList);
+	unlockEngine();
 	s_plglist.construct(dict);
 	return dict;
 }
@@ -128,52 +283,200 @@ TexDictionary::destroy(void)
 {
 	if(TEXTUREGLOBAL(currentTexDict) == this)
 		TEXTUREGLOBAL(currentTexDict) = nil;
+	LoaderContext *ctx = getLoaderContext();
+	if(ctx && ctx->currentTexDict == this)
+		ctx->currentTexDict = nil;
 	FORLIST(lnk, this->textures){
 		Texture *tex = Texture::fromDict(lnk);
 		this->remove(tex);
 		tex->destroy();
 	}
 	s_plglist.destruct(this);
+	lockEngine();
 	this->inGlobalList.remove();
-	rwFree(this);
 	numAllocated--;
+	unlockEngine();
+	rwFree(this);
+}
+
+// The name hash is shared by all dictionaries, so these lock the engine.
+
+static void
+unlinkTexture(Texture *t)
+{
+	t->inDict.remove();
+	t->dict = nil;
+	removeFromHash(t);
 }
 
 void
 TexDictionary::add(Texture *t)
 {
+	lockEngine();
 	if(t->dict)
-		t->inDict.remove();
+		unlinkTexture(t);
 	t->dict = this;
 	this->textures.append(&t->inDict);
+	addToHash(t, 0);
+	unlockEngine();
 }
 
 void
 TexDictionary::remove(Texture *t)
 {
 	assert(t->dict == this);
-	t->inDict.remove();
-	t->dict = nil;
+	lockEngine();
+	unlinkTexture(t);
+	unlockEngine();
 }
 
 void
 TexDictionary::addFront(Texture *t)
 {
+	lockEngine();
 	if(t->dict)
-		t->inDict.remove();
+		unlinkTexture(t);
 	t->dict = this;
 	this->textures.add(&t->inDict);
+	addToHash(t, 1);
+	unlockEngine();
 }
 
 Texture*
 TexDictionary::find(const char *name)
 {
-	FORLIST(lnk, this->textures){
-		Texture *tex = Texture::fromDict(lnk);
-		if(strncmp_ci(tex->name, name, 32) == 0)
-			return tex;
+	Texture *t;
+	lockEngine();
+	t = findInHash(this, name);
+	unlockEngine();
+	return t;
+}
+
+Texture*
+TexDictionary::findAny(const char *name)
+{
+	Texture *t;
+	lockEngine();
+	t = findInHash(nil, name);
+	unlockEngine();
+	return t;
+}
+
+void TexDictionary::setNumReadThreads(int32 n) { TEXTUREGLOBAL(numReadThreads) = n; }
+int32 TexDictionary::getNumReadThreads(void) { return TEXTUREGLOBAL(numReadThreads); }
+
+// Native textures whose rasters are emulated in memory on this platform.
+// These can be read on any thread. Everything else
+// talks to the GPU or (PS2) changes global state while reading.
+static bool32
+canReadOnWorker(uint32 platform)
+{
+#ifdef RW_D3D9
+	return platform == PLATFORM_XBOX;
+#else
+	return platform != (uint32)rw::platform &&
+		(platform == PLATFORM_D3D8 ||
+		 platform == PLATFORM_D3D9 ||
+		 platform == PLATFORM_XBOX);
+#endif
+}
+
+struct NativeTexJob
+{
+	uint8 *data;	// TEXTURENATIVE payload
+	uint32 length;
+	uint32 platform;
+	bool32 ownsData;
+	Texture *tex;
+};
+
+// the payload is freed as soon as it's decoded
+static void
+readNativeTexJob(NativeTexJob *job)
+{
+	StreamMemory stream;
+	stream.open(job->data, job->length);
+	job->tex = Texture::streamReadNative(&stream);
+	if(job->tex)
+		Texture::s_plglist.streamRead(&stream, job->tex);
+	stream.close();
+	if(job->ownsData)
+		rwFree(job->data);
+	job->data = nil;
+	job->ownsData = 0;
+}
+
+static void
+readNativeTexWorker(int32 i, void *data)
+{
+	readNativeTexJob(&((NativeTexJob*)data)[i]);
+}
+
+// The calling thread reads the TEXTURENATIVE payloads in stream order
+// and hands them to the workers through a bounded queue, so only a few
+// payloads are held at a time. Textures that can't be read on a worker
+// are decoded by the reader in between.
+// Textures are added in stream order again.
+static bool32
+readTexturesParallel(Stream *stream, TexDictionary *txd, int32 numTex, int32 numThreads)
+{
+	NativeTexJob *jobs;
+	JobQueue *queue;
+	uint32 length;
+	int32 i;
+	bool32 success;
+
+	jobs = rwNewT(NativeTexJob, numTex, MEMDUR_FUNCTION | ID_TEXDICTIONARY);
+	memset(jobs, 0, numTex*sizeof(NativeTexJob));
+	queue = createJobQueue(numThreads, readNativeTexWorker, jobs);
+	success = 1;
+
+	for(i = 0; i < numTex; i++){
+		if(!findChunk(stream, ID_TEXTURENATIVE, &length, nil)){
+			RWERROR((ERR_CHUNK, "TEXTURENATIVE"));
+			success = 0;
+			goto out;
+		}
+		jobs[i].length = length;
+		jobs[i].data = stream->getPointer(stream->tell(), length);
+		if(jobs[i].data)
+			stream->seek(length);
+		else{
+			// freed on the worker, out of order
+			jobs[i].data = rwNewT(uint8, length, MEMDUR_EVENT | ID_TEXDICTIONARY);
+			jobs[i].ownsData = 1;
+			if(stream->read8(jobs[i].data, length) != length){
+				RWERROR((ERR_CHUNK, "TEXTURENATIVE"));
+				success = 0;
+				goto out;
+			}
+		}
+		// payload starts with the struct chunk header, then the platform
+		if(length >= 16){
+			memcpy(&jobs[i].platform, jobs[i].data+12, 4);
+			memNative32(&jobs[i].platform, 4);
+		}
+		if(canReadOnWorker(jobs[i].platform))
+			pushJob(queue, i);
+		else
+			readNativeTexJob(&jobs[i]);
 	}
-	return nil;
+
+out:
+	finishJobs(queue);
+	for(i = 0; i < numTex; i++)
+		if(jobs[i].tex == nil)
+			success = 0;
+	for(i = 0; i < numTex; i++){
+		if(success)
+			txd->add(jobs[i].tex);
+		else if(jobs[i].tex)
+			jobs[i].tex->destroy();
+		if(jobs[i].ownsData)
+			rwFree(jobs[i].data);
+	}
+	rwFree(jobs);
+	return success;
 }
 
 TexDictionary*
@@ -191,6 +494,12 @@ TexDictionary::streamRead(Stream *stream)
 	if(txd == nil)
 		return nil;
 	Texture *tex;
+	int32 numThreads = TEXTUREGLOBAL(numReadThreads);
+	if(numThreads != 1 && numTex > 1){
+		if(!readTexturesParallel(stream, txd, numTex, numThreads))
+			goto fail;
+		numTex = 0;
+	}
 	for(int32 i = 0; i < numTex; i++){
 		if(!findChunk(stream, ID_TEXTURENATIVE, nil, nil)){
 			RWERROR((ERR_CHUNK, "TEXTURENATIVE"));
@@ -212,20 +521,27 @@ fail:
 void
 TexDictionary::streamWrite(Stream *stream)
 {
-	writeChunkHeader(stream, ID_TEXDICTIONARY, this->streamGetSize());
+	bool32 patch = stream->patchesSizes();
+	uint32 chunk = beginChunk(stream, ID_TEXDICTIONARY,
+		patch ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, 4);
 	int32 numTex = this->count();
 	stream->writeI16(numTex);
 	stream->writeI16(0);
 	FORLIST(lnk, this->textures){
 		Texture *tex = Texture::fromDict(lnk);
-		uint32 sz = tex->streamGetSizeNative();
-		sz += 12 + Texture::s_plglist.streamGetSize(tex);
-		writeChunkHeader(stream, ID_TEXTURENATIVE, sz);
+		uint32 sz = 0;
+		if(!patch){
+			sz = tex->streamGetSizeNative();
+			sz += 12 + Texture::s_plglist.streamGetSize(tex);
+		}
+		uint32 texChunk = beginChunk(stream, ID_TEXTURENATIVE, sz);
 		tex->streamWriteNative(stream);
 		Texture::s_plglist.streamWrite(stream, tex);
+		endChunk(stream, texChunk);
 	}
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 }
 
 uint32
@@ -244,12 +560,19 @@ TexDictionary::streamGetSize(void)
 void
 TexDictionary::setCurrent(TexDictionary *txd)
 {
-	PLUGINOFFSET(TextureGlobals, engine, textureModuleOffset)->currentTexDict = txd;
+	LoaderContext *ctx = getLoaderContext();
+	if(ctx)
+		ctx->currentTexDict = txd;
+	else
+		PLUGINOFFSET(TextureGlobals, engine, textureModuleOffset)->currentTexDict = txd;
 }
 
 TexDictionary*
 TexDictionary::getCurrent(void)
 {
+	LoaderContext *ctx = getLoaderContext();
+	if(ctx)
+		return ctx->currentTexDict;
 	return PLUGINOFFSET(TextureGlobals, engine, textureModuleOffset)->currentTexDict;
 }
 
@@ -266,20 +589,24 @@ Texture *(*Texture::readCB)(const char *name, const char *mask) = defaultReadCB;
 Texture*
 Texture::create(Raster *raster)
 {
-	Texture *tex = (Texture*)rwMalloc(s_plglist.size, MEMDUR_EVENT | ID_TEXTURE);
+	Texture *tex = (Texture*)s_pool.alloc();
 	if(tex == nil){
 		RWERROR((ERR_ALLOC, s_plglist.size));
 		return nil;
 	}
-	numAllocated++;
 	tex->dict = nil;
 	tex->inDict.init();
+	tex->nameHash = 0;
+	tex->hashNext = nil;
 	memset(tex->name, 0, 32);
 	memset(tex->mask, 0, 32);
 	tex->filterAddressing = (WRAP << 12) | (WRAP << 8) | NEAREST;
 	tex->raster = raster;
 	tex->refCount = 1;
+	lockEngine();
+	numAllocated++;
 	TEXTUREGLOBAL(textures).add(&tex->inGlobalList);
+	unlockEngine();
 	s_plglist.construct(tex);
 	return tex;
 }
@@ -287,26 +614,41 @@ Texture::create(Raster *raster)
 void
 Texture::destroy(void)
 {
-	this->refCount--;
-	if(this->refCount <= 0){
+	if(--this->refCount <= 0){
 		s_plglist.destruct(this);
 		if(this->dict)
-			this->inDict.remove();
+			this->dict->remove(this);
 		if(this->raster)
 			this->raster->destroy();
+		lockEngine();
 		this->inGlobalList.remove();
-		rwFree(this);
 		numAllocated--;
+		unlockEngine();
+		s_pool.free(this);
 	}
 }
 
+void
+Texture::setName(const char *name)
+{
+	lockEngine();
+	strncpy(this->name, name, 32);
+	if(this->dict)
+		rehashTexture(this);
+	unlockEngine();
+}
+
 static Texture*
 defaultFindCB(const char *name)
 {
-	if(TEXTUREGLOBAL(currentTexDict))
-		return TEXTUREGLOBAL(currentTexDict)->find(name);
-	// TODO: RW searches *all* TXDs otherwise
-	return nil;
+	Texture *tex = nil;
+	TexDictionary *txd = TexDictionary::getCurrent();
+	if(txd)
+		tex = txd->find(name);
+	// RW searches *all* TXDs otherwise
+	if(tex == nil && TEXTUREGLOBAL(findInAllDicts))
+		tex = TexDictionary::findAny(name);
+	return tex;
 }
 
 
@@ -354,10 +696,11 @@ Texture::read(const char *name, const char *mask)
 		raster = Raster::create(0, 0, 0, Raster::DONTALLOCATE);
 		tex->raster = raster;
 	}
-	if(tex && TEXTUREGLOBAL(currentTexDict)){
+	TexDictionary *txd = TexDictionary::getCurrent();
+	if(tex && txd){
 		if(tex->dict)
-			tex->inDict.remove();
-		TEXTUREGLOBAL(currentTexDict)->add(tex);
+			tex->dict->remove(tex);
+		txd->add(tex);
 	}
 	return tex;
 }
@@ -391,22 +734,21 @@ Texture::streamRead(Stream *stream)
 	}
 	stream->read8(mask, length);
 
-	bool32 mipState = getMipmapping();
-	bool32 autoMipState = getAutoMipmapping();
+	MipmapState mipState = streamMipState;
 	int32 filter = filterAddressing&0xFF;
+	streamMipState.set = 1;
 	if(filter == MIPNEAREST || filter == MIPLINEAR ||
 	   filter == LINEARMIPNEAREST || filter == LINEARMIPLINEAR){
-		setMipmapping(1);
-		setAutoMipmapping((filterAddressing&0x10000) == 0);
+		streamMipState.mipmapping = 1;
+		streamMipState.autoMipmapping = (filterAddressing&0x10000) == 0;
 	}else{
-		setMipmapping(0);
-		setAutoMipmapping(0);
+		streamMipState.mipmapping = 0;
+		streamMipState.autoMipmapping = 0;
 	}
 
 	Texture *tex = Texture::read(name, mask);
 
-	setMipmapping(mipState);
-	setAutoMipmapping(autoMipState);
+	streamMipState = mipState;
 
 	if(tex == nil){
 		s_plglist.streamSkip(stream);
@@ -427,7 +769,8 @@ Texture::streamWrite(Stream *stream)
 {
 	int size;
 	char buf[36];
-	writeChunkHeader(stream, ID_TEXTURE, this->streamGetSize());
+	uint32 chunk = beginChunk(stream, ID_TEXTURE,
+		stream->patchesSizes() ? 0 : this->streamGetSize());
 	writeChunkHeader(stream, ID_STRUCT, 4);
 	uint32 filterAddressing = this->filterAddressing;
 	if(this->raster && (raster->format & Raster::AUTOMIPMAP) == 0)
@@ -447,6 +790,7 @@ Texture::streamWrite(Stream *stream)
 	stream->write8(buf, size);
 
 	s_plglist.streamWrite(stream, this);
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifndef RW_PS2
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+#include "rwbase.h"
+#include "rwerror.h"
+#include "rwplg.h"
+#include "rwpipeline.h"
+#include "rwobjects.h"
+#include "rwengine.h"
+
+#define PLUGIN_ID 0
+
+namespace rw {
+
+static RWTHREADLOCAL LoaderContext *loaderContext;
+
+void setLoaderContext(LoaderContext *ctx) { loaderContext = ctx; }
+LoaderContext *getLoaderContext(void) { return loaderContext; }
+
+#ifdef RW_PS2
+
+int32 getNumProcessors(void) { return 1; }
+
+void
+parallelFor(int32 n, int32, JobFunc func, void *data)
+{
+	for(int32 i = 0; i < n; i++)
+		func(i, data);
+}
+
+struct JobQueue
+{
+	JobFunc func;
+	void *data;
+};
+
+JobQueue*
+createJobQueue(int32, JobFunc func, void *data)
+{
+	JobQueue *q = rwNewT(JobQueue, 1, MEMDUR_FUNCTION);
+	q->func = func;
+	q->data = data;
+	return q;
+}
+
+void pushJob(JobQueue *q, int32 i) { q->func(i, q->data); }
+void finishJobs(JobQueue *q) { rwFree(q); }
+void stopJobThreads(void) { }
+
+void lockEngine(void) { }
+void unlockEngine(void) { }
+
+#else
+
+#define MAXTHREADS 64
+#define MAXTASKS 256
+
+static std::recursive_mutex engineMutex;
+
+int32
+getNumProcessors(void)
+{
+	int32 n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+static int32
+clampThreads(int32 numThreads)
+{
+	if(numThreads <= 0)
+		numThreads = getNumProcessors();
+	if(numThreads > MAXTHREADS)
+		numThreads = MAXTHREADS;
+	return numThreads;
+}
+
+// Worker threads are started when first needed and kept until
+// stopJobThreads. They take tasks from one bounded queue.
+// A thread that waits for its tasks runs queued ones meanwhile,
+// so tasks can wait for tasks of their own without deadlocking.
+
+struct TaskGroup
+{
+	int32 numPending;	// queued or running
+};
+
+struct Task
+{
+	JobFunc func;
+	void *data;
+	int32 i;
+	TaskGroup *group;
+};
+
+struct ThreadPool
+{
+	std::mutex mutex;
+	std::condition_variable workCond;	// task queued or stopping
+	std::condition_variable doneCond;	// task finished or thread exited
+	Task tasks[MAXTASKS];
+	int32 head;
+	int32 numTasks;
+	int32 numThreads;
+	bool stopping;
+};
+// never freed, detached workers may still touch it at exit
+static ThreadPool *pool;
+static std::once_flag poolOnce;
+
+static void
+createPool(void)
+{
+	pool = new ThreadPool;
+	pool->head = 0;
+	pool->numTasks = 0;
+	pool->numThreads = 0;
+	pool->stopping = false;
+}
+
+static ThreadPool*
+getPool(void)
+{
+	std::call_once(poolOnce, createPool);
+	return pool;
+}
+
+// pool->mutex is held by lock in all of these
+
+static bool
+runTask(std::unique_lock<std::mutex> &lock)
+{
+	Task t;
+	if(pool->numTasks == 0)
+		return false;
+	t = pool->tasks[pool->head];
+	pool->head = (pool->head+1) % MAXTASKS;
+	pool->numTasks--;
+	lock.unlock();
+	t.func(t.i, t.data);
+	lock.lock();
+	t.group->numPending--;
+	pool->doneCond.notify_all();
+	return true;
+}
+
+static void
+submitTask(std::unique_lock<std::mutex> &lock, TaskGroup *g, JobFunc func, void *data, int32 i)
+{
+	Task *t;
+	// queue full, run it here
+	if(pool->numTasks == MAXTASKS){
+		lock.unlock();
+		func(i, data);
+		lock.lock();
+		return;
+	}
+	t = &pool->tasks[(pool->head + pool->numTasks) % MAXTASKS];
+	t->func = func;
+	t->data = data;
+	t->i = i;
+	t->group = g;
+	pool->numTasks++;
+	g->numPending++;
+	pool->workCond.notify_one();
+}
+
+static void
+waitTasks(std::unique_lock<std::mutex> &lock, TaskGroup *g)
+{
+	while(g->numPending > 0)
+		if(!runTask(lock))
+			pool->doneCond.wait(lock);
+}
+
+static void
+workerMain(void)
+{
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	while(!pool->stopping)
+		if(!runTask(lock))
+			pool->workCond.wait(lock);
+	pool->numThreads--;
+	pool->doneCond.notify_all();
+}
+
+static void
+startThreads(int32 n)
+{
+	if(n > MAXTHREADS-1)
+		n = MAXTHREADS-1;
+	while(pool->numThreads < n){
+		std::thread(workerMain).detach();
+		pool->numThreads++;
+	}
+}
+
+// Called at Engine::term, no jobs may be running
+void
+stopJobThreads(void)
+{
+	if(pool == nil)
+		return;
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->stopping = true;
+	pool->workCond.notify_all();
+	while(pool->numThreads > 0)
+		pool->doneCond.wait(lock);
+	pool->stopping = false;
+}
+
+struct JobRun
+{
+	std::atomic<int32> next;
+	int32 n;
+	JobFunc func;
+	void *data;
+};
+
+static void
+runJobs(int32, void *data)
+{
+	JobRun *run = (JobRun*)data;
+	int32 i;
+	while(i = run->next++, i < run->n)
+		run->func(i, run->data);
+}
+
+// Calls func for 0..n-1 on up to numThreads threads (0 = one per processor).
+// The calling thread takes part, returns when all jobs are done.
+void
+parallelFor(int32 n, int32 numThreads, JobFunc func, void *data)
+{
+	JobRun run;
+	TaskGroup group;
+	int32 i;
+
+	numThreads = clampThreads(numThreads);
+	if(numThreads > n)
+		numThreads = n;
+	if(numThreads <= 1){
+		for(i = 0; i < n; i++)
+			func(i, data);
+		return;
+	}
+
+	run.next = 0;
+	run.n = n;
+	run.func = func;
+	run.data = data;
+	group.numPending = 0;
+	std::unique_lock<std::mutex> lock(getPool()->mutex);
+	startThreads(numThreads-1);
+	for(i = 1; i < numThreads; i++)
+		submitTask(lock, &group, runJobs, &run, 0);
+	lock.unlock();
+	runJobs(0, &run);
+	lock.lock();
+	waitTasks(lock, &group);
+}
+
+struct JobQueue
+{
+	JobFunc func;
+	void *data;
+	int32 capacity;
+	TaskGroup group;
+};
+
+// func(i, data) runs on a worker for every pushed i.
+// At most two jobs per worker are pending at a time.
+JobQueue*
+createJobQueue(int32 numThreads, JobFunc func, void *data)
+{
+	JobQueue *q = rwNewT(JobQueue, 1, MEMDUR_FUNCTION);
+	numThreads = clampThreads(numThreads);
+	q->func = func;
+	q->data = data;
+	q->capacity = (numThreads-1)*2;
+	q->group.numPending = 0;
+	if(q->capacity > 0){
+		std::unique_lock<std::mutex> lock(getPool()->mutex);
+		startThreads(numThreads-1);
+	}
+	return q;
+}
+
+// Blocks while the queue is full, running queued tasks meanwhile
+void
+pushJob(JobQueue *q, int32 i)
+{
+	if(q->capacity == 0){
+		q->func(i, q->data);
+		return;
+	}
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	while(q->group.numPending >= q->capacity)
+		if(!runTask(lock))
+			pool->doneCond.wait(lock);
+	submitTask(lock, &q->group, q->func, q->data, i);
+}
+
+// Waits for all pushed jobs and destroys the queue
+void
+finishJobs(JobQueue *q)
+{
+	if(q->capacity > 0){
+		std::unique_lock<std::mutex> lock(pool->mutex);
+		waitTasks(lock, &q->group);
+	}
+	rwFree(q);
+}
+
+// Protects global engine bookkeeping (allocation counters, global lists)
+// when objects are created and destroyed on several threads.
+// Recursive because memory functions may lock while it's held.
+void lockEngine(void) { engineMutex.lock(); }
+void unlockEngine(void) { engineMutex.unlock(); }
+
+#endif
+
+}
@@ -10,6 +10,8 @@
 #include "rwpipeline.h"
 #include "rwobjects.h"
 #include "rwengine.h"
+#include "rwanim.h"
+#include "rwplugins.h"
 
 #define PLUGIN_ID 2
 
@@ -617,6 +619,293 @@ printSmesh(&smesh);
 	verifyMesh(this);
 }
 
+/*
+ * Vertex cache optimization for triangle lists.
+ * This is Tom Forsyth's "Linear-Speed Vertex Cache Optimisation":
+ * vertices are scored by their position in a simulated LRU cache
+ * and by the number of triangles still using them, and the
+ * triangle with the highest score is added next.
+ */
+
+#define VCACHESIZE 32
+
+struct VCacheVertex
+{
+	float32 score;
+	int32 cachePos;	/* -1 if not in cache */
+	int32 numActive;	/* triangles not added yet */
+	int32 firstTri;	/* start in triangle list */
+};
+
+static float32
+vcacheScore(VCacheVertex *v)
+{
+	float32 score;
+	if(v->numActive == 0)
+		return -1.0f;
+	score = 0.0f;
+	if(v->cachePos >= 0){
+		/* the last triangle's vertices get a fixed score,
+		 * otherwise we'd keep fanning around one vertex */
+		if(v->cachePos < 3)
+			score = 0.75f;
+		else
+			score = powf(1.0f - (v->cachePos-3)/(float32)(VCACHESIZE-3), 1.5f);
+	}
+	/* finish off vertices with few triangles left */
+	score += 2.0f*powf((float32)v->numActive, -0.5f);
+	return score;
+}
+
+static void
+vcacheOptimize(Triangle *dst, Triangle *tris, int32 numTris, VCacheVertex *verts)
+{
+	int32 *triList, *active;
+	float32 *triScore;
+	uint8 *added;
+	int32 cache[VCACHESIZE+3], newCache[VCACHESIZE+3];
+	int32 cacheLen, newLen;
+	int32 i, j, k, n, t, v, best, next;
+	float32 bestScore;
+	VCacheVertex *vert;
+
+	triList = rwNewT(int32, numTris*3, MEMDUR_FUNCTION | ID_GEOMETRY);
+	triScore = rwNewT(float32, numTris, MEMDUR_FUNCTION | ID_GEOMETRY);
+	added = rwNewT(uint8, numTris, MEMDUR_FUNCTION | ID_GEOMETRY);
+	memset(added, 0, numTris);
+
+	/* build the vertex -> triangle lists, only touching used vertices */
+	for(t = 0; t < numTris; t++)
+		for(j = 0; j < 3; j++){
+			vert = &verts[tris[t].v[j]];
+			vert->cachePos = -1;
+			vert->numActive = 0;
+			vert->firstTri = -1;
+		}
+	for(t = 0; t < numTris; t++)
+		for(j = 0; j < 3; j++)
+			verts[tris[t].v[j]].numActive++;
+	n = 0;
+	for(t = 0; t < numTris; t++)
+		for(j = 0; j < 3; j++){
+			vert = &verts[tris[t].v[j]];
+			if(vert->firstTri < 0){
+				vert->firstTri = n;
+				n += vert->numActive;
+				vert->numActive = 0;
+			}
+			triList[vert->firstTri + vert->numActive++] = t;
+		}
+	for(t = 0; t < numTris; t++)
+		for(j = 0; j < 3; j++){
+			vert = &verts[tris[t].v[j]];
+			vert->score = vcacheScore(vert);
+		}
+	best = 0;
+	bestScore = -1.0f;
+	for(t = 0; t < numTris; t++){
+		triScore[t] = verts[tris[t].v[0]].score +
+		              verts[tris[t].v[1]].score +
+		              verts[tris[t].v[2]].score;
+		if(triScore[t] > bestScore){
+			bestScore = triScore[t];
+			best = t;
+		}
+	}
+
+	cacheLen = 0;
+	next = 0;
+	for(i = 0; i < numTris; i++){
+		/* nothing useful in the cache, just take the next one */
+		if(best < 0){
+			while(added[next])
+				next++;
+			best = next;
+		}
+		dst[i] = tris[best];
+		added[best] = 1;
+
+		/* remove from the vertices' active lists
+		 * and put the vertices at the front of the cache */
+		newLen = 0;
+		for(j = 0; j < 3; j++){
+			v = tris[best].v[j];
+			vert = &verts[v];
+			active = &triList[vert->firstTri];
+			for(k = 0; k < vert->numActive; k++)
+				if(active[k] == best){
+					active[k] = active[--vert->numActive];
+					break;
+				}
+			for(k = 0; k < newLen; k++)
+				if(newCache[k] == v)
+					break;
+			if(k == newLen)
+				newCache[newLen++] = v;
+		}
+		n = newLen;
+		for(k = 0; k < cacheLen; k++){
+			v = cache[k];
+			for(j = 0; j < n; j++)
+				if(newCache[j] == v)
+					break;
+			if(j == n)
+				newCache[newLen++] = v;
+		}
+
+		/* rescore the vertices that moved and their triangles */
+		for(k = 0; k < newLen; k++){
+			vert = &verts[newCache[k]];
+			vert->cachePos = k < VCACHESIZE ? k : -1;
+			vert->score = vcacheScore(vert);
+		}
+		best = -1;
+		bestScore = -1.0f;
+		for(k = 0; k < newLen; k++){
+			vert = &verts[newCache[k]];
+			active = &triList[vert->firstTri];
+			for(j = 0; j < vert->numActive; j++){
+				t = active[j];
+				triScore[t] = verts[tris[t].v[0]].score +
+				              verts[tris[t].v[1]].score +
+				              verts[tris[t].v[2]].score;
+				if(k < VCACHESIZE && triScore[t] > bestScore){
+					bestScore = triScore[t];
+					best = t;
+				}
+			}
+		}
+		cacheLen = newLen < VCACHESIZE ? newLen : VCACHESIZE;
+		memcpy(cache, newCache, cacheLen*sizeof(int32));
+	}
+
+	rwFree(triList);
+	rwFree(triScore);
+	rwFree(added);
+}
+
+/* Reorder the triangles of every material for the post-transform cache.
+ * Triangles end up grouped by material. Meshes are rebuilt. */
+void
+Geometry::optimizeTriangleOrder(void)
+{
+	if(this->flags & Geometry::NATIVE){
+		fprintf(stderr, "WARNING: trying Geometry::optimizeTriangleOrder() on pre-instanced geometry\n");
+		return;
+	}
+	if(this->numTriangles == 0)
+		return;
+	this->lock(LOCKPOLYGONS);
+	this->orderTrianglesForCache();
+	this->unlock();
+}
+
+void
+Geometry::orderTrianglesForCache(void)
+{
+	int32 i, m, numMeshes;
+	int32 *start;
+	Triangle *sorted;
+	VCacheVertex *verts;
+
+	if(this->numTriangles == 0)
+		return;
+
+	/* sort by material */
+	numMeshes = this->matList.numMaterials;
+	start = rwNewT(int32, numMeshes+1, MEMDUR_FUNCTION | ID_GEOMETRY);
+	memset(start, 0, (numMeshes+1)*sizeof(int32));
+	for(i = 0; i < this->numTriangles; i++){
+		assert(this->triangles[i].matId < numMeshes);
+		start[this->triangles[i].matId+1]++;
+	}
+	for(m = 0; m < numMeshes; m++)
+		start[m+1] += start[m];
+	sorted = rwNewT(Triangle, this->numTriangles, MEMDUR_FUNCTION | ID_GEOMETRY);
+	for(i = 0; i < this->numTriangles; i++)
+		sorted[start[this->triangles[i].matId]++] = this->triangles[i];
+	/* start[m] is now the end of m */
+
+	verts = rwNewT(VCacheVertex, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	for(m = 0; m < numMeshes; m++){
+		i = m == 0 ? 0 : start[m-1];
+		if(start[m] > i)
+			vcacheOptimize(&this->triangles[i], &sorted[i], start[m]-i, verts);
+	}
+	rwFree(verts);
+	rwFree(sorted);
+	rwFree(start);
+}
+
+/* Renumber the vertices in the order they are first used by the triangles
+ * so fetches are more linear. Unused vertices go to the end.
+ * Skin weights are reordered too. If remap is given it receives the new
+ * index of every old vertex so other plugin data can be reordered the same way. */
+void
+Geometry::optimizeVertexOrder(uint16 *remap)
+{
+	int32 i, j, n;
+	int32 *newIndex;
+	uint8 *tmp;
+	MorphTarget *mt;
+	Skin *skin;
+	struct SkinIndices { uint8 i[4]; };
+	struct SkinWeights { float32 w[4]; };
+
+	if(this->flags & Geometry::NATIVE){
+		fprintf(stderr, "WARNING: trying Geometry::optimizeVertexOrder() on pre-instanced geometry\n");
+		return;
+	}
+	if(this->numVertices == 0)
+		return;
+	this->lock(LOCKALL);
+
+	newIndex = rwNewT(int32, this->numVertices, MEMDUR_FUNCTION | ID_GEOMETRY);
+	memset(newIndex, 0xFF, this->numVertices*sizeof(int32));
+	n = 0;
+	for(i = 0; i < this->numTriangles; i++)
+		for(j = 0; j < 3; j++)
+			if(newIndex[this->triangles[i].v[j]] < 0)
+				newIndex[this->triangles[i].v[j]] = n++;
+	for(i = 0; i < this->numVertices; i++)
+		if(newIndex[i] < 0)
+			newIndex[i] = n++;
+
+	for(i = 0; i < this->numTriangles; i++)
+		for(j = 0; j < 3; j++)
+			this->triangles[i].v[j] = newIndex[this->triangles[i].v[j]];
+
+	tmp = rwNewT(uint8, this->numVertices*sizeof(SkinWeights), MEMDUR_FUNCTION | ID_GEOMETRY);
+#define REORDER(array, type) \
+	if(array){ \
+		for(j = 0; j < this->numVertices; j++) \
+			((type*)tmp)[newIndex[j]] = (array)[j]; \
+		memcpy(array, tmp, this->numVertices*sizeof(type)); \
+	}
+	for(i = 0; i < this->numMorphTargets; i++){
+		mt = &this->morphTargets[i];
+		REORDER(mt->vertices, V3d);
+		REORDER(mt->normals, V3d);
+	}
+	REORDER(this->colors, RGBA);
+	for(i = 0; i < this->numTexCoordSets; i++)
+		REORDER(this->texCoords[i], TexCoords);
+	skin = skinGlobals.geoOffset ? Skin::get(this) : nil;
+	if(skin){
+		REORDER((SkinIndices*)skin->indices, SkinIndices);
+		REORDER((SkinWeights*)skin->weights, SkinWeights);
+	}
+#undef REORDER
+	rwFree(tmp);
+
+	if(remap)
+		for(i = 0; i < this->numVertices; i++)
+			remap[i] = newIndex[i];
+	rwFree(newIndex);
+
+	this->unlock();
+}
+
 /* Check that tristripped mesh and geometry triangles are actually the same. */
 static void
 verifyMesh(Geometry *geo)
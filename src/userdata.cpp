@@ -294,27 +294,27 @@ UserDataExtension::findIndex(const char *name) {
 int32 \
 UserDataArray::NAME##Add(TYPE *t, const char *name, int32 datatype, int32 numElements) \
 { \
-	return PLUGINOFFSET(UserDataExtension, t, userDataGlobals.NAME##Offset)->add(name, datatype, numElements); \
+	return UserDataExtension::get(t)->add(name, datatype, numElements); \
 } \
 void \
 UserDataArray::NAME##Remove(TYPE *t, int32 n) \
 { \
-	PLUGINOFFSET(UserDataExtension, t, userDataGlobals.NAME##Offset)->remove(n); \
+	UserDataExtension::get(t)->remove(n); \
 } \
 int32 \
 UserDataArray::NAME##GetCount(TYPE *t) \
 { \
-	return PLUGINOFFSET(UserDataExtension, t, userDataGlobals.NAME##Offset)->getCount(); \
+	return UserDataExtension::get(t)->getCount(); \
 } \
 UserDataArray* \
 UserDataArray::NAME##Get(TYPE *t, int32 n) \
 { \
-	return PLUGINOFFSET(UserDataExtension, t, userDataGlobals.NAME##Offset)->get(n); \
+	return UserDataExtension::get(t)->get(n); \
 } \
 int32 \
 UserDataArray::NAME##FindIndex(TYPE *t, const char *name) \
 { \
-	return PLUGINOFFSET(UserDataExtension, t, userDataGlobals.NAME##Offset)->findIndex(name); \
+	return UserDataExtension::get(t)->findIndex(name); \
 }
 
 ACCESSOR(Geometry, geometry)
@@ -324,12 +324,12 @@ ACCESSOR(Light, light)
 ACCESSOR(Material, material)
 ACCESSOR(Texture, texture)
 
-UserDataExtension *UserDataExtension::get(Geometry *geo) { return PLUGINOFFSET(UserDataExtension, geo, userDataGlobals.geometryOffset); }
-UserDataExtension *UserDataExtension::get(Frame *frame) { return PLUGINOFFSET(UserDataExtension, frame, userDataGlobals.frameOffset); }
-UserDataExtension *UserDataExtension::get(Camera *cam) { return PLUGINOFFSET(UserDataExtension, cam, userDataGlobals.cameraOffset); }
-UserDataExtension *UserDataExtension::get(Light *light) { return PLUGINOFFSET(UserDataExtension, light, userDataGlobals.lightOffset); }
-UserDataExtension *UserDataExtension::get(Material *mat) { return PLUGINOFFSET(UserDataExtension, mat, userDataGlobals.materialOffset); }
-UserDataExtension *UserDataExtension::get(Texture *tex) { return PLUGINOFFSET(UserDataExtension, tex, userDataGlobals.textureOffset); }
+UserDataExtension *UserDataExtension::get(Geometry *geo) { Geometry::s_plglist.parseLazy(geo, ID_USERDATA); return PLUGINOFFSET(UserDataExtension, geo, userDataGlobals.geometryOffset); }
+UserDataExtension *UserDataExtension::get(Frame *frame) { Frame::s_plglist.parseLazy(frame, ID_USERDATA); return PLUGINOFFSET(UserDataExtension, frame, userDataGlobals.frameOffset); }
+UserDataExtension *UserDataExtension::get(Camera *cam) { Camera::s_plglist.parseLazy(cam, ID_USERDATA); return PLUGINOFFSET(UserDataExtension, cam, userDataGlobals.cameraOffset); }
+UserDataExtension *UserDataExtension::get(Light *light) { Light::s_plglist.parseLazy(light, ID_USERDATA); return PLUGINOFFSET(UserDataExtension, light, userDataGlobals.lightOffset); }
+UserDataExtension *UserDataExtension::get(Material *mat) { Material::s_plglist.parseLazy(mat, ID_USERDATA); return PLUGINOFFSET(UserDataExtension, mat, userDataGlobals.materialOffset); }
+UserDataExtension *UserDataExtension::get(Texture *tex) { Texture::s_plglist.parseLazy(tex, ID_USERDATA); return PLUGINOFFSET(UserDataExtension, tex, userDataGlobals.textureOffset); }
 
 void
 registerUserDataPlugin(void)
@@ -361,4 +361,15 @@ registerUserDataPlugin(void)
 	Texture::registerPluginStream(ID_USERDATA, readUserData, writeUserData, getSizeUserData);
 }
 
+void
+setUserDataLazy(bool32 lazy)
+{
+	Geometry::setStreamLazy(ID_USERDATA, lazy);
+	Frame::setStreamLazy(ID_USERDATA, lazy);
+	Camera::setStreamLazy(ID_USERDATA, lazy);
+	Light::setStreamLazy(ID_USERDATA, lazy);
+	Material::setStreamLazy(ID_USERDATA, lazy);
+	Texture::setStreamLazy(ID_USERDATA, lazy);
+}
+
 }
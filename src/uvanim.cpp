@@ -93,8 +93,8 @@ fail:
 bool
 UVAnimDictionary::streamWrite(Stream *stream)
 {
-	uint32 size = this->streamGetSize();
-	writeChunkHeader(stream, ID_UVANIMDICT, size);
+	uint32 size = stream->patchesSizes() ? 0 : this->streamGetSize();
+	uint32 chunk = beginChunk(stream, ID_UVANIMDICT, size);
 	writeChunkHeader(stream, ID_STRUCT, 4);
 	int32 numAnims = this->count();
 	stream->writeI32(numAnims);
@@ -102,6 +102,7 @@ UVAnimDictionary::streamWrite(Stream *stream)
 		UVAnimDictEntry *de = UVAnimDictEntry::fromDict(lnk);
 		de->anim->streamWrite(stream);
 	}
+	endChunk(stream, chunk);
 	return true;
 }
 
@@ -14,7 +14,7 @@
 
 namespace rw {
 
-int32 World::numAllocated = 0;
+atomic32 World::numAllocated;
 
 PluginList World::s_plglist(sizeof(World));
 
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <rw.h>
+#include <args.h>
+
+// Compares the SIMD matrix and transform functions against the scalar ones.
+
+using namespace rw;
+
+char *argv0;
+static float32 tolerance = 1.0e-4f;
+static int32 numFailed;
+
+static uint32 seed = 1;
+
+static float32
+frand(void)
+{
+	seed = seed*1103515245u + 12345u;
+	return ((seed>>8) & 0xFFFF)/32768.0f - 1.0f;
+}
+
+static V3d
+randV3d(float32 scale)
+{
+	return makeV3d(frand()*scale, frand()*scale, frand()*scale);
+}
+
+static void
+randMatrix(Matrix *m, int32 i)
+{
+	V3d axis;
+	switch(i % 3){
+	case 0:
+		// arbitrary affine
+		m->right = randV3d(2.0f);
+		m->up = randV3d(2.0f);
+		m->at = randV3d(2.0f);
+		m->pos = randV3d(100.0f);
+		m->update();
+		break;
+	case 1:
+		// rotation and translation
+		axis = normalize(randV3d(1.0f));
+		Matrix::makeRotation(m, &axis, frand()*180.0f);
+		m->pos = randV3d(100.0f);
+		m->optimize();
+		break;
+	default:
+		m->setIdentity();
+		break;
+	}
+}
+
+static bool32
+close(float32 a, float32 b)
+{
+	float32 d = fabsf(a - b);
+	float32 mag = fabsf(a) > fabsf(b) ? fabsf(a) : fabsf(b);
+	return d <= tolerance || d <= tolerance*mag;
+}
+
+static void
+compare(const char *what, int32 i, const float32 *a, const float32 *b, int32 n)
+{
+	int32 j;
+	for(j = 0; j < n; j++)
+		if(!close(a[j], b[j])){
+			fprintf(stderr, "%s %d: element %d differs: %g %g\n", what, i, j, a[j], b[j]);
+			numFailed++;
+			return;
+		}
+}
+
+static void
+compareMatrix(const char *what, int32 i, const Matrix *a, const Matrix *b)
+{
+	float32 fa[12], fb[12];
+	memcpy(&fa[0], &a->right, 12); memcpy(&fa[3], &a->up, 12);
+	memcpy(&fa[6], &a->at, 12); memcpy(&fa[9], &a->pos, 12);
+	memcpy(&fb[0], &b->right, 12); memcpy(&fb[3], &b->up, 12);
+	memcpy(&fb[6], &b->at, 12); memcpy(&fb[9], &b->pos, 12);
+	compare(what, i, fa, fb, 12);
+}
+
+static void
+testMult(int32 n)
+{
+	Matrix a, b, ref, res;
+	for(int32 i = 0; i < n; i++){
+		randMatrix(&a, i);
+		randMatrix(&b, i/3);
+		setSimdMath(0);
+		Matrix::mult(&ref, &a, &b);
+		setSimdMath(1);
+		Matrix::mult(&res, &a, &b);
+		compareMatrix("mult", i, &ref, &res);
+	}
+}
+
+static void
+testInvert(int32 n)
+{
+	Matrix a, ref, res;
+	for(int32 i = 0; i < n; i++){
+		randMatrix(&a, i);
+		setSimdMath(0);
+		Matrix::invertGeneral(&ref, &a);
+		setSimdMath(1);
+		Matrix::invertGeneral(&res, &a);
+		compareMatrix("invertGeneral", i, &ref, &res);
+	}
+}
+
+// odd count so the remainder loops run too
+#define NUMVERTS 1027
+
+static void
+testTransform(int32 n)
+{
+	static V3d in[NUMVERTS], ref[NUMVERTS], res[NUMVERTS];
+	Matrix m;
+	int32 i, j;
+
+	for(j = 0; j < NUMVERTS; j++)
+		in[j] = randV3d(50.0f);
+	for(i = 0; i < n; i++){
+		randMatrix(&m, i);
+		setSimdMath(0);
+		V3d::transformPoints(ref, in, NUMVERTS, &m);
+		setSimdMath(1);
+		V3d::transformPoints(res, in, NUMVERTS, &m);
+		compare("transformPoints", i, (float32*)ref, (float32*)res, NUMVERTS*3);
+
+		setSimdMath(0);
+		V3d::transformVectors(ref, in, NUMVERTS, &m);
+		setSimdMath(1);
+		V3d::transformVectors(res, in, NUMVERTS, &m);
+		compare("transformVectors", i, (float32*)ref, (float32*)res, NUMVERTS*3);
+	}
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-t tolerance]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int32 n = 1000;
+
+	ARGBEGIN{
+	case 'n':
+		n = atoi(EARGF(usage()));
+		break;
+	case 't':
+		tolerance = atof(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND;
+
+	rw::Engine::init();
+	rw::Engine::open(nil);
+	rw::Engine::start();
+
+	testMult(n);
+	testInvert(n);
+	testTransform(n/10 + 1);
+
+	setSimdMath(1);
+	rw::Engine::stop();
+	rw::Engine::close();
+	rw::Engine::term();
+
+	if(numFailed){
+		fprintf(stderr, "%d comparisons failed\n", numFailed);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include <rw.h>
+#include <args.h>
+
+using namespace rw;
+
+char *argv0;
+
+//
+// Batch converter for DFF and TXD files.
+// All files share one engine; everything that touches
+// global engine state is locked by librw. PS2 rasters still
+// change global state while they're read, so files with those
+// run serially after the parallel pass.
+//
+
+enum {
+	FILE_DFF,
+	FILE_TXD
+};
+
+struct ConvertFile
+{
+	std::string inPath;
+	std::string outPath;
+	int type;
+	bool serial;
+	bool ok;
+	bool skipped;
+	size_t inSize;
+	size_t outSize;
+};
+
+static int32 outPlatform = -1;
+static bool32 rebuildMeshes;
+static bool32 removeMaterials;
+static bool32 verbose;
+
+static std::atomic<int32> numDone;
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-m] [-r] [-V] [-v version] -p platform -o outdir files/dirs...\n", argv0);
+	fprintf(stderr, "\t-p\toutput platform: null, ps2, xbox, d3d8, d3d9, wdgl\n");
+	fprintf(stderr, "\t-o\toutput directory, the input tree is mirrored there\n");
+	fprintf(stderr, "\t-j\tnumber of threads, 0 (default) is one per processor\n");
+	fprintf(stderr, "\t-m\trebuild meshes\n");
+	fprintf(stderr, "\t-r\tremove unused materials\n");
+	fprintf(stderr, "\t-v\tRW version to write, e.g. 33002\n");
+	fprintf(stderr, "\t-V\tprint every file\n");
+	exit(1);
+}
+
+static int32
+findPlatformByName(const char *name)
+{
+	static struct { const char *name; int32 platform; } platforms[] = {
+		{ "null", PLATFORM_NULL },
+		{ "ps2", PLATFORM_PS2 },
+		{ "xbox", PLATFORM_XBOX },
+		{ "d3d8", PLATFORM_D3D8 },
+		{ "d3d9", PLATFORM_D3D9 },
+		{ "wdgl", PLATFORM_WDGL }
+	};
+	for(uint32 i = 0; i < nelem(platforms); i++)
+		if(strcmp(platforms[i].name, name) == 0)
+			return platforms[i].platform;
+	return -1;
+}
+
+//
+// Files
+//
+
+static bool
+hasExtension(const char *path, const char *ext)
+{
+	size_t len = strlen(path);
+	size_t extlen = strlen(ext);
+	if(len < extlen)
+		return false;
+	path += len - extlen;
+	while(*ext)
+		if(tolower(*path++) != *ext++)
+			return false;
+	return true;
+}
+
+static void
+addFile(std::vector<ConvertFile> &files, const std::string &path, const std::string &relPath)
+{
+	ConvertFile f;
+	if(hasExtension(path.c_str(), ".dff"))
+		f.type = FILE_DFF;
+	else if(hasExtension(path.c_str(), ".txd"))
+		f.type = FILE_TXD;
+	else
+		return;
+	f.inPath = path;
+	f.outPath = relPath;
+	f.serial = false;
+	f.ok = false;
+	f.skipped = false;
+	f.inSize = 0;
+	f.outSize = 0;
+	files.push_back(f);
+}
+
+#ifdef _WIN32
+static bool
+isDirectory(const char *path)
+{
+	DWORD attr = GetFileAttributesA(path);
+	return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+static void
+walkDirectory(std::vector<ConvertFile> &files, const std::string &dir, const std::string &rel)
+{
+	WIN32_FIND_DATAA data;
+	HANDLE h = FindFirstFileA((dir + "\\*").c_str(), &data);
+	if(h == INVALID_HANDLE_VALUE)
+		return;
+	do{
+		if(strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0)
+			continue;
+		std::string path = dir + "/" + data.cFileName;
+		std::string relPath = rel.empty() ? data.cFileName : rel + "/" + data.cFileName;
+		if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			walkDirectory(files, path, relPath);
+		else
+			addFile(files, path, relPath);
+	}while(FindNextFileA(h, &data));
+	FindClose(h);
+}
+
+static void
+makeDirectory(const char *path)
+{
+	_mkdir(path);
+}
+#else
+static bool
+isDirectory(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void
+walkDirectory(std::vector<ConvertFile> &files, const std::string &dir, const std::string &rel)
+{
+	DIR *d = opendir(dir.c_str());
+	struct dirent *e;
+	if(d == nil)
+		return;
+	while(e = readdir(d), e){
+		if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		std::string path = dir + "/" + e->d_name;
+		std::string relPath = rel.empty() ? e->d_name : rel + "/" + e->d_name;
+		if(isDirectory(path.c_str()))
+			walkDirectory(files, path, relPath);
+		else
+			addFile(files, path, relPath);
+	}
+	closedir(d);
+}
+
+static void
+makeDirectory(const char *path)
+{
+	mkdir(path, 0777);
+}
+#endif
+
+// create all directories leading up to a file
+static void
+makeParentDirectories(const std::string &path)
+{
+	std::string dir;
+	for(size_t i = 1; i < path.size(); i++)
+		if(path[i] == '/' || path[i] == '\\'){
+			dir = path.substr(0, i);
+			makeDirectory(dir.c_str());
+		}
+}
+
+static uint8*
+readFile(const char *path, size_t *size)
+{
+	FILE *f;
+	uint8 *data;
+	long len;
+
+	f = fopen(path, "rb");
+	if(f == nil)
+		return nil;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = (uint8*)malloc(len > 0 ? len : 1);
+	if(data == nil || fread(data, 1, len, f) != (size_t)len){
+		free(data);
+		fclose(f);
+		return nil;
+	}
+	fclose(f);
+	*size = len;
+	return data;
+}
+
+static uint32
+readU32LE(const uint8 *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | (uint32)p[3]<<24;
+}
+
+// Check whether any native texture of a TXD is a PS2 raster.
+// Only the chunk headers are read, seeking over the texture data.
+static bool
+hasPs2Textures(FILE *fp)
+{
+	uint8 buf[28];
+	long p;
+	// TXD header, struct with texture count
+	if(fread(buf, 1, 28, fp) != 28 || readU32LE(buf) != ID_TEXDICTIONARY)
+		return false;
+	p = 12 + 12 + (long)readU32LE(buf+16);
+	while(fseek(fp, p, SEEK_SET) == 0 && fread(buf, 1, 28, fp) == 28 &&
+	      readU32LE(buf) == ID_TEXTURENATIVE){
+		// native texture struct starts with the platform
+		if(readU32LE(buf+24) == FOURCC_PS2)
+			return true;
+		p += 12 + (long)readU32LE(buf+4);
+	}
+	return false;
+}
+
+//
+// Conversion
+//
+
+static int32
+findPlatform(Clump *c)
+{
+	FORLIST(lnk, c->atomics){
+		Geometry *g = Atomic::fromClump(lnk)->geometry;
+		if(g->instData)
+			return g->instData->platform;
+	}
+	return PLATFORM_NULL;
+}
+
+// Select the pipelines of a platform. The default pipeline has to be set
+// explicitly because rw::platform is the output platform.
+static void
+switchPipes(Clump *c, int32 platform)
+{
+	FORLIST(lnk, c->atomics){
+		Atomic *a = Atomic::fromClump(lnk);
+		if(a->pipeline && a->pipeline->pluginID == ID_SKIN)
+			a->pipeline = skinGlobals.pipelines[platform];
+		else if(a->pipeline && a->pipeline->pluginID == ID_MATFX)
+			a->pipeline = matFXGlobals.pipelines[platform];
+		else if(platform == rw::platform)
+			a->pipeline = nil;
+		else
+			a->pipeline = engine->driver[platform]->defaultPipeline;
+	}
+}
+
+static bool
+convertClump(Clump *c)
+{
+	int32 srcPlatform = findPlatform(c);
+	bool32 native = srcPlatform != PLATFORM_NULL;
+
+	if(native && (srcPlatform != outPlatform || rebuildMeshes || removeMaterials)){
+		switchPipes(c, srcPlatform);
+		FORLIST(lnk, c->atomics){
+			Atomic *a = Atomic::fromClump(lnk);
+			a->uninstance();
+			if(outPlatform != PLATFORM_PS2)
+				ps2::unconvertADC(a->geometry);
+		}
+		native = 0;
+	}
+	FORLIST(lnk, c->atomics){
+		Geometry *g = Atomic::fromClump(lnk)->geometry;
+		if(g->flags & Geometry::NATIVE)
+			continue;
+		if(rebuildMeshes)
+			g->buildMeshes();
+		if(removeMaterials)
+			g->removeUnusedMaterials();
+	}
+	switchPipes(c, outPlatform);
+	if(!native && outPlatform != PLATFORM_NULL)
+		FORLIST(lnk, c->atomics)
+			Atomic::fromClump(lnk)->instance();
+	return true;
+}
+
+// Write a serialized object out in one go
+static bool
+writeOutput(ConvertFile *f, StreamMemory *s)
+{
+	StreamFile out;
+	if(!out.open(f->outPath.c_str(), "wb"))
+		return false;
+	f->outSize = out.write8(s->data, s->length);
+	out.close();
+	return f->outSize == s->length;
+}
+
+static bool
+convertDff(ConvertFile *f, StreamMemory *in)
+{
+	Clump *c;
+	StreamMemory out;
+	bool ok;
+
+	if(!findChunk(in, ID_CLUMP, nil, nil))
+		return false;
+	c = Clump::streamRead(in);
+	if(c == nil)
+		return false;
+	if(!convertClump(c)){
+		c->destroy();
+		return false;
+	}
+	// chunk sizes are patched in, no sizing pass needed
+	out.openGrowable((uint32)f->inSize);
+	c->streamWrite(&out);
+	ok = writeOutput(f, &out);
+	out.close();
+	c->destroy();
+	return ok;
+}
+
+static bool
+convertTxd(ConvertFile *f, StreamMemory *in)
+{
+	TexDictionary *txd;
+	StreamMemory out;
+	bool ok;
+
+	if(outPlatform == PLATFORM_NULL){
+		// no rasters on the null platform
+		f->skipped = true;
+		return true;
+	}
+	if(!findChunk(in, ID_TEXDICTIONARY, nil, nil))
+		return false;
+	txd = TexDictionary::streamRead(in);
+	if(txd == nil)
+		return false;
+	FORLIST(lnk, txd->textures){
+		Texture *tex = Texture::fromDict(lnk);
+		tex->raster = Raster::convertTexToCurrentPlatform(tex->raster);
+	}
+	out.openGrowable((uint32)f->inSize);
+	txd->streamWrite(&out);
+	ok = writeOutput(f, &out);
+	out.close();
+	txd->destroy();
+	return ok;
+}
+
+static void
+convertFile(ConvertFile *f)
+{
+	uint8 *data;
+	StreamMemory in;
+
+	data = readFile(f->inPath.c_str(), &f->inSize);
+	if(data == nil){
+		fprintf(stderr, "Error: couldn't read %s\n", f->inPath.c_str());
+		return;
+	}
+	makeParentDirectories(f->outPath);
+	in.open(data, f->inSize);
+	if(f->type == FILE_DFF)
+		f->ok = convertDff(f, &in);
+	else
+		f->ok = convertTxd(f, &in);
+	in.close();
+	free(data);
+
+	numDone++;
+	if(!f->ok)
+		fprintf(stderr, "Error: couldn't convert %s\n", f->inPath.c_str());
+	else if(verbose)
+		printf("%s -> %s%s\n", f->inPath.c_str(), f->outPath.c_str(),
+			f->skipped ? " (skipped)" : "");
+}
+
+static void
+convertJob(int32 i, void *data)
+{
+	ConvertFile **files = (ConvertFile**)data;
+	// keep this job's dirty frames and current TXD out of the shared state
+	LoaderContext ctx;
+	ctx.init();
+	setLoaderContext(&ctx);
+	convertFile(files[i]);
+	setLoaderContext(nil);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *outDir = nil;
+	int32 numThreads = 0;
+	int32 writeVersion = 0;
+	std::vector<ConvertFile> files;
+	std::vector<ConvertFile*> parallel, serial;
+	size_t i, inBytes, outBytes;
+	int32 numFailed, numSkipped;
+
+	ARGBEGIN{
+	case 'p':
+		outPlatform = findPlatformByName(EARGF(usage()));
+		if(outPlatform < 0)
+			usage();
+		break;
+	case 'o':
+		outDir = EARGF(usage());
+		break;
+	case 'j':
+		numThreads = atoi(EARGF(usage()));
+		break;
+	case 'm':
+		rebuildMeshes = 1;
+		break;
+	case 'r':
+		removeMaterials = 1;
+		break;
+	case 'v':
+		sscanf(EARGF(usage()), "%x", &writeVersion);
+		break;
+	case 'V':
+		verbose = 1;
+		break;
+	default:
+		usage();
+	}ARGEND;
+
+	if(argc < 1 || outPlatform < 0 || outDir == nil)
+		usage();
+
+	rw::platform = outPlatform;
+	rw::Engine::init();
+	rw::registerMeshPlugin();
+	rw::registerNativeDataPlugin();
+	rw::registerAtomicRightsPlugin();
+	rw::registerMaterialRightsPlugin();
+	rw::xbox::registerVertexFormatPlugin();
+	rw::registerSkinPlugin();
+	rw::registerUserDataPlugin();
+	// user data is passed through untouched
+	rw::setUserDataLazy(1);
+	rw::registerHAnimPlugin();
+	rw::registerMatFXPlugin();
+	rw::registerUVAnimPlugin();
+	rw::ps2::registerADCPlugin();
+	rw::Engine::open(nil);
+	rw::Engine::start();
+	if(writeVersion)
+		rw::version = writeVersion;
+
+	// Materials only keep the texture names, don't go looking for images
+	Texture::setLoadTextures(0);
+	Texture::setCreateDummies(1);
+	Texture::setFindInAllDicts(0);
+	TexDictionary::setCurrent(nil);
+
+	for(int32 j = 0; j < argc; j++){
+		if(isDirectory(argv[j]))
+			walkDirectory(files, argv[j], "");
+		else{
+			const char *name = strrchr(argv[j], '/');
+			addFile(files, argv[j], name ? name+1 : argv[j]);
+		}
+	}
+	for(i = 0; i < files.size(); i++){
+		ConvertFile *f = &files[i];
+		f->outPath = std::string(outDir) + "/" + f->outPath;
+		if(f->type == FILE_TXD && outPlatform == PLATFORM_PS2)
+			f->serial = true;
+		else if(f->type == FILE_TXD){
+			FILE *fp = fopen(f->inPath.c_str(), "rb");
+			if(fp){
+				f->serial = hasPs2Textures(fp);
+				fclose(fp);
+			}
+		}
+		if(f->serial)
+			serial.push_back(f);
+		else
+			parallel.push_back(f);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	if(!parallel.empty())
+		parallelFor(parallel.size(), numThreads, convertJob, &parallel[0]);
+	for(i = 0; i < serial.size(); i++)
+		convertFile(serial[i]);
+	auto end = std::chrono::steady_clock::now();
+	double secs = std::chrono::duration<double>(end - start).count();
+
+	inBytes = 0;
+	outBytes = 0;
+	numFailed = 0;
+	numSkipped = 0;
+	for(i = 0; i < files.size(); i++){
+		inBytes += files[i].inSize;
+		outBytes += files[i].outSize;
+		if(!files[i].ok)
+			numFailed++;
+		else if(files[i].skipped)
+			numSkipped++;
+	}
+	if(secs <= 0.0)
+		secs = 1e-6;
+	printf("%d files (%d failed, %d skipped, %d serial) in %.2fs\n",
+		(int)files.size(), numFailed, numSkipped, (int)serial.size(), secs);
+	printf("%.1f files/s, %.2f MB/s in, %.2f MB/s out\n",
+		numDone/secs, inBytes/secs/(1024*1024), outBytes/secs/(1024*1024));
+
+	rw::Engine::stop();
+	rw::Engine::close();
+	rw::Engine::term();
+	return numFailed ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rw.h>
+
+// Checks the PS2 raster swizzle against a per-pixel reference
+// and that swizzling and unswizzling round-trip.
+
+using namespace rw;
+
+// PSMT8/PSMT4 as PSMCT32/PSMCT16, same as swizzle() in ps2raster.cpp
+static uint32
+swizzleAddr(uint32 x, uint32 y, uint32 logw)
+{
+#define X(n) ((x>>(n))&1)
+#define Y(n) ((y>>(n))&1)
+	uint32 nx, ny, n;
+	x ^= (Y(1)^Y(2))<<2;
+	nx = (x&7) | ((x>>1)&~7);
+	ny = (y&1) | ((y>>1)&~1);
+	n = Y(1) | X(3)<<1;
+	return n | nx<<2 | ny<<(logw-1+2);
+#undef X
+#undef Y
+}
+
+static int32
+getPixel(uint8 *px, uint32 a, bool32 pal4)
+{
+	if(!pal4)
+		return px[a];
+	return a & 1 ? px[a>>1] >> 4 : px[a>>1] & 0xF;
+}
+
+static void
+setPixel(uint8 *px, uint32 a, int32 c, bool32 pal4)
+{
+	if(!pal4)
+		px[a] = c;
+	else if(a & 1)
+		px[a>>1] = (px[a>>1]&0xF) | c<<4;
+	else
+		px[a>>1] = (px[a>>1]&0xF0) | c;
+}
+
+// one pixel at a time in strips of 4 rows, w and h are the transfer size
+static void
+refSwizzle(uint8 *dst, uint8 *src, int32 w, int32 h, bool32 pal4, bool32 unswizzle)
+{
+	int32 x, y, logw;
+	uint32 a, s, mask;
+
+	logw = 0;
+	for(x = 1; x < w; x *= 2) logw++;
+	mask = (1<<(logw+2))-1;
+	for(y = 0; y < h; y++)
+		for(x = 0; x < w; x++){
+			a = (y<<logw) + x;
+			s = (y&~3)<<logw | (swizzleAddr(x, y, logw)&mask);
+			if(unswizzle)
+				setPixel(dst, a, getPixel(src, s, pal4), pal4);
+			else
+				setPixel(dst, s, getPixel(src, a, pal4), pal4);
+		}
+}
+
+int
+main(void)
+{
+	int32 pal4, w, h, pw, ph, size, i;
+	int32 numTests, numFailed;
+	uint8 *orig, *ref, *pixels;
+	Raster *ras;
+	ps2::Ps2Raster *natras;
+	clock_t t, tRef, tNew;
+
+	rw::Engine::init();
+	rw::Engine::open(nil);
+	rw::Engine::start();
+
+	numTests = 0;
+	numFailed = 0;
+	tRef = tNew = 0;
+	for(pal4 = 0; pal4 < 2; pal4++)
+	for(w = 1; w <= 1024; w *= 2)
+	for(h = 1; h <= 1024; h *= 2){
+		// minimum transfer size of PSMT8/PSMT4 swizzled as PSMCT32/PSMCT16
+		pw = w < (pal4 ? 32 : 16) ? (pal4 ? 32 : 16) : w;
+		ph = h < 4 ? 4 : h;
+		size = pal4 ? pw*ph/2 : pw*ph;
+		orig = (uint8*)malloc(size);
+		ref = (uint8*)malloc(size);
+		pixels = (uint8*)malloc(size);
+		for(i = 0; i < size; i++)
+			orig[i] = rand();
+
+		ras = Raster::create(w, h, pal4 ? 4 : 8,
+			(pal4 ? Raster::PAL4 : Raster::PAL8) | Raster::C8888 |
+			Raster::TEXTURE | Raster::DONTALLOCATE, PLATFORM_PS2);
+		natras = GETPS2RASTEREXT(ras);
+		natras->flags = pal4 ? ps2::Ps2Raster::SWIZZLED4 : ps2::Ps2Raster::SWIZZLED8;
+		ras->pixels = pixels;
+
+		memcpy(pixels, orig, size);
+		t = clock();
+		refSwizzle(ref, orig, pw, ph, pal4, 1);
+		tRef += clock() - t;
+		t = clock();
+		ps2::unswizzleRaster(ras);
+		tNew += clock() - t;
+		if(memcmp(ref, pixels, size) != 0){
+			fprintf(stderr, "%s %dx%d: unswizzle differs\n", pal4 ? "PAL4" : "PAL8", w, h);
+			numFailed++;
+		}
+
+		memcpy(pixels, ref, size);
+		t = clock();
+		refSwizzle(ref, pixels, pw, ph, pal4, 0);
+		tRef += clock() - t;
+		t = clock();
+		ps2::swizzleRaster(ras);
+		tNew += clock() - t;
+		if(memcmp(ref, pixels, size) != 0){
+			fprintf(stderr, "%s %dx%d: swizzle differs\n", pal4 ? "PAL4" : "PAL8", w, h);
+			numFailed++;
+		}else if(memcmp(orig, pixels, size) != 0){
+			fprintf(stderr, "%s %dx%d: no round trip\n", pal4 ? "PAL4" : "PAL8", w, h);
+			numFailed++;
+		}
+		numTests++;
+
+		ras->pixels = nil;
+		ras->destroy();
+		free(orig);
+		free(ref);
+		free(pixels);
+	}
+
+	printf("%d rasters, reference %.1f ms, swizzle %.1f ms\n", numTests,
+		tRef*1000.0/CLOCKS_PER_SEC, tNew*1000.0/CLOCKS_PER_SEC);
+
+	rw::Engine::stop();
+	rw::Engine::close();
+	rw::Engine::term();
+
+	if(numFailed){
+		fprintf(stderr, "%d checks failed\n", numFailed);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}